@@ -32,6 +32,7 @@
 #include <librevault/crypto/Hex.h>
 #include <QDebug>
 #include <QtGlobal>
+#include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QIODevice>
@@ -91,6 +92,20 @@ void CliApplication::performProcessing() {
 		}else if(args["unset"].asBool()) {
 			action_globals_unset();
 		}
+	}else if(args["folder"].asBool() && args["priority"].asBool()) {
+		if(args["get"].asBool()) {
+			action_folder_priority_get();
+		}else if(args["set"].asBool()) {
+			action_folder_priority_set();
+		}else if(args["clear"].asBool()) {
+			action_folder_priority_clear();
+		}
+	}else if(args["folder"].asBool() && args["archive"].asBool()) {
+		if(args["list"].asBool()) {
+			action_folder_archive_list();
+		}else if(args["restore"].asBool()) {
+			action_folder_archive_restore();
+		}
 	}
 }
 
@@ -146,4 +161,49 @@ void CliApplication::action_globals_unset() {
 	connect(reply, &QNetworkReply::finished, this, &QCoreApplication::quit);
 }
 
+void CliApplication::action_folder_priority_get() {
+	QNetworkRequest request(daemon_control_.toString().append("/v1/folders/").append(QString::fromStdString(args["<folderid>"].asString())).append("/priority"));
+	QNetworkReply* reply = nam_->get(request);
+	connect(reply, &QNetworkReply::finished, [reply] {
+		qStdOut() << QJsonDocument::fromJson(reply->readAll()).toJson();
+		quit();
+	});
+}
+
+void CliApplication::action_folder_priority_set() {
+	QJsonArray paths;
+	for(auto& path : args["<path>"].asStringList())
+		paths.append(QString::fromStdString(path));
+
+	QNetworkRequest request(daemon_control_.toString().append("/v1/folders/").append(QString::fromStdString(args["<folderid>"].asString())).append("/priority"));
+	QNetworkReply* reply = nam_->put(request, QJsonDocument(paths).toJson(QJsonDocument::Compact));
+	connect(reply, &QNetworkReply::finished, this, &QCoreApplication::quit);
+}
+
+void CliApplication::action_folder_priority_clear() {
+	QNetworkRequest request(daemon_control_.toString().append("/v1/folders/").append(QString::fromStdString(args["<folderid>"].asString())).append("/priority"));
+	QNetworkReply* reply = nam_->deleteResource(request);
+	connect(reply, &QNetworkReply::finished, this, &QCoreApplication::quit);
+}
+
+void CliApplication::action_folder_archive_list() {
+	QNetworkRequest request(daemon_control_.toString().append("/v1/folders/").append(QString::fromStdString(args["<folderid>"].asString())).append("/archive"));
+	QNetworkReply* reply = nam_->get(request);
+	connect(reply, &QNetworkReply::finished, [reply] {
+		qStdOut() << QJsonDocument::fromJson(reply->readAll()).toJson();
+		quit();
+	});
+}
+
+void CliApplication::action_folder_archive_restore() {
+	QJsonObject restore;
+	if(args["<destination>"].isString())
+		restore["destination"] = QString::fromStdString(args["<destination>"].asString());
+
+	QNetworkRequest request(daemon_control_.toString().append("/v1/folders/").append(QString::fromStdString(args["<folderid>"].asString())).append("/archive/")
+		.append(QString::fromStdString(args["<pathid>"].asString())).append("/").append(QString::fromStdString(args["<revision>"].asString())));
+	QNetworkReply* reply = nam_->post(request, QJsonDocument(restore).toJson(QJsonDocument::Compact));
+	connect(reply, &QNetworkReply::finished, this, &QCoreApplication::quit);
+}
+
 } /* namespace librevault */
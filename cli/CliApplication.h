@@ -57,6 +57,13 @@ private:
 	void action_globals_get();
 	void action_globals_set();
 	void action_globals_unset();
+
+	void action_folder_priority_get();
+	void action_folder_priority_set();
+	void action_folder_priority_clear();
+
+	void action_folder_archive_list();
+	void action_folder_archive_restore();
 };
 
 } /* namespace librevault */
@@ -55,6 +55,11 @@ Usage:
   librevault folder remove [--daemon=<daemon>] <folderid>
   librevault folder reindex [--daemon=<daemon>] <folderid>
   librevault folder list-folders [--daemon=<daemon>]
+  librevault folder priority get [--daemon=<daemon>] <folderid>
+  librevault folder priority set [--daemon=<daemon>] <folderid> <path>...
+  librevault folder priority clear [--daemon=<daemon>] <folderid>
+  librevault folder archive list [--daemon=<daemon>] <folderid>
+  librevault folder archive restore [--daemon=<daemon>] <folderid> <pathid> <revision> [<destination>]
   librevault (-h | --help)
 
 Commands:
@@ -67,6 +72,8 @@ Commands:
   folder add         add synchronization folder
   folder remove      remove synchronization folder. <folderid> is a folder id, computed using "gen-folderid" command
   folder list        list all synchronization folders
+  folder priority    download files under <path> (relative to the folder root) before everything else, sequentially
+  folder archive     list archived revisions, or restore one of them to <destination> (relative to the folder root, the original path by default)
 
 Options:
   --daemon=<daemon>  set URL to Librevault Client API
@@ -47,6 +47,7 @@ class FolderService;
 
 class Client {
 	friend class ControlServer;
+	friend class ControlHTTPServer;
 public:
 	Client();
 	virtual ~Client();
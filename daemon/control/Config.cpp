@@ -70,18 +70,19 @@ Json::Value Config::globals() const {
 }
 
 void Config::set_globals(Json::Value globals_conf) {
-	std::set<std::pair<std::string, Json::Value>> old_globals, new_globals;
-	std::list<std::pair<std::string, Json::Value>> diff;
+	// Names of values, that were added, removed or changed
+	std::set<std::string> diff;
 	for(auto& name : globals_custom_.getMemberNames())
-		old_globals.insert({name, globals_custom_[name]});
+		if(!globals_conf.isMember(name) || globals_conf[name] != globals_custom_[name])
+			diff.insert(name);
 	for(auto& name : globals_conf.getMemberNames())
-		new_globals.insert({name, globals_conf[name]});
-	std::set_difference(old_globals.begin(), old_globals.end(), new_globals.begin(), new_globals.end(), diff.begin());
+		if(!globals_custom_.isMember(name))
+			diff.insert(name);
 
 	globals_custom_ = globals_conf;
 
-	for(auto& diff_val : diff)
-		config_changed(diff_val.first, global_get(diff_val.first));
+	for(auto& name : diff)
+		config_changed(name, global_get(name));
 }
 
 void Config::set_folders(Json::Value folders_conf) {
@@ -96,9 +97,25 @@ void Config::make_defaults() {
 	globals_defaults_["client_name"] = boost::asio::ip::host_name();
 	globals_defaults_["control_listen"] = "[::1]:42346";
 	globals_defaults_["p2p_listen"] = "[::]:42345";
+	globals_defaults_["p2p_raw_listen"] = "";   // E.g. "[::]:42348". Raw connections are not accepted, if empty
+	globals_defaults_["p2p_threads"] = 0;  // Number of CPU cores
+	globals_defaults_["folder_threads"] = 0;   // Number of CPU cores
 	globals_defaults_["p2p_download_slots"] = 10;
+	globals_defaults_["p2p_upload_slots"] = 4;
+	globals_defaults_["p2p_upload_cache_chunks"] = 32;
+	globals_defaults_["p2p_send_buffer_high"] = 4194304;
+	globals_defaults_["p2p_upload_limit"] = 0;
+	globals_defaults_["p2p_download_limit"] = 0;
+	globals_defaults_["p2p_upload_limit_peer"] = 0;
+	globals_defaults_["p2p_download_limit_peer"] = 0;
 	globals_defaults_["p2p_request_timeout"] = 10;
 	globals_defaults_["p2p_block_size"] = 32768;
+	globals_defaults_["p2p_max_block_size"] = 1048576;
+	globals_defaults_["p2p_download_max_window"] = 16777216;
+	globals_defaults_["p2p_download_partial_chunks"] = 32;
+	globals_defaults_["p2p_download_memory_chunk_size"] = 1048576;
+	globals_defaults_["p2p_download_open_files"] = 100;
+	globals_defaults_["p2p_download_endgame_chunks"] = 8;
 	globals_defaults_["natpmp_enabled"] = true;
 	globals_defaults_["natpmp_lifetime"] = 3600;
 	globals_defaults_["upnp_enabled"] = true;
@@ -144,7 +161,11 @@ void Config::make_defaults() {
 	folders_defaults_["archive_type"] = "trash";
 	folders_defaults_["archive_trash_ttl"] = 30;
 	folders_defaults_["archive_timestamp_count"] = 5;
+	folders_defaults_["archive_block_ttl"] = 30;
+	folders_defaults_["archive_block_count"] = 5;
 	folders_defaults_["mainline_dht_enabled"] = true;
+	folders_defaults_["upload_limit"] = 0;
+	folders_defaults_["download_limit"] = 0;
 }
 
 Json::Value Config::make_merged(const Json::Value& custom_value, const Json::Value& default_value) const {
@@ -29,7 +29,11 @@
 #include "ControlHTTPServer.h"
 #include "Client.h"
 #include "control/Config.h"
+#include "folder/AbstractFolder.h"
+#include "folder/FolderGroup.h"
+#include "folder/FolderService.h"
 #include "util/log.h"
+#include <librevault/crypto/Hex.h>
 #include <boost/algorithm/string/predicate.hpp>
 
 namespace librevault {
@@ -41,6 +45,8 @@ ControlHTTPServer::ControlHTTPServer(Client& client, ControlServer& cs, ControlS
 	handlers_.push_back(std::make_pair(std::regex(R"(^\/v1\/restart\/?$)"), [this](ControlServer::server::connection_ptr conn, std::smatch matched){handle_restart(conn, matched);}));
 	handlers_.push_back(std::make_pair(std::regex(R"(^\/v1\/shutdown\/?$)"), [this](ControlServer::server::connection_ptr conn, std::smatch matched){handle_shutdown(conn, matched);}));
 	handlers_.push_back(std::make_pair(std::regex(R"(^\/v1\/globals(?:\/(\w+?))?\/?$)"), [this](ControlServer::server::connection_ptr conn, std::smatch matched){handle_globals(conn, matched);}));
+	handlers_.push_back(std::make_pair(std::regex(R"(^\/v1\/folders\/(\w+?)\/priority\/?$)"), [this](ControlServer::server::connection_ptr conn, std::smatch matched){handle_folder_priority(conn, matched);}));
+	handlers_.push_back(std::make_pair(std::regex(R"(^\/v1\/folders\/(\w+?)\/archive(?:\/(\w+?)\/(\d+?))?\/?$)"), [this](ControlServer::server::connection_ptr conn, std::smatch matched){handle_folder_archive(conn, matched);}));
 }
 
 ControlHTTPServer::~ControlHTTPServer() {}
@@ -120,4 +126,87 @@ void ControlHTTPServer::handle_globals(ControlServer::server::connection_ptr con
 	}
 }
 
+void ControlHTTPServer::handle_folder_priority(ControlServer::server::connection_ptr conn, std::smatch matched) {
+	std::shared_ptr<FolderGroup> group;
+	try {
+		group = client_.folder_service_->get_group(matched[1].str() | crypto::De<crypto::Hex>());
+	}catch(std::exception& e) {}
+	if(!group) {
+		conn->set_status(websocketpp::http::status_code::not_found);
+		return;
+	}
+
+	if(conn->get_request().get_method() == "GET") {
+		Json::Value paths_json = Json::arrayValue;
+		for(auto& path : group->priority_paths())
+			paths_json.append(path);
+
+		conn->set_status(websocketpp::http::status_code::ok);
+		conn->append_header("Content-Type", "text/x-json");
+		conn->set_body(Json::FastWriter().write(paths_json));
+	}else if(conn->get_request().get_method() == "PUT") {
+		Json::Value paths_json;
+		if(!Json::Reader().parse(conn->get_request_body(), paths_json) || !paths_json.isArray()) {
+			conn->set_status(websocketpp::http::status_code::bad_request);
+			return;
+		}
+
+		std::vector<std::string> paths;
+		for(auto& path_json : paths_json)
+			if(path_json.isString())
+				paths.push_back(path_json.asString());
+
+		group->set_priority_paths(paths);
+		conn->set_status(websocketpp::http::status_code::ok);
+	}else if(conn->get_request().get_method() == "DELETE") {
+		group->set_priority_paths({});
+		conn->set_status(websocketpp::http::status_code::ok);
+	}
+}
+
+void ControlHTTPServer::handle_folder_archive(ControlServer::server::connection_ptr conn, std::smatch matched) {
+	std::shared_ptr<FolderGroup> group;
+	try {
+		group = client_.folder_service_->get_group(matched[1].str() | crypto::De<crypto::Hex>());
+	}catch(std::exception& e) {}
+	if(!group) {
+		conn->set_status(websocketpp::http::status_code::not_found);
+		return;
+	}
+
+	if(conn->get_request().get_method() == "GET" && !matched[2].matched) {
+		Json::Value revisions_json = Json::arrayValue;
+		for(auto& smeta : group->archived_revisions()) {
+			Json::Value revision_json;
+			revision_json["path_id"] = crypto::Hex().to_string(smeta.meta().path_id());
+			revision_json["revision"] = (Json::Value::Int64)smeta.meta().revision();
+			if(group->secret().get_type() <= Secret::Type::ReadOnly)
+				revision_json["path"] = smeta.meta().path(group->secret());
+			revisions_json.append(revision_json);
+		}
+
+		conn->set_status(websocketpp::http::status_code::ok);
+		conn->append_header("Content-Type", "text/x-json");
+		conn->set_body(Json::FastWriter().write(revisions_json));
+	}else if(conn->get_request().get_method() == "POST" && matched[2].matched) {
+		Json::Value restore_json;
+		if(!conn->get_request_body().empty() && (!Json::Reader().parse(conn->get_request_body(), restore_json) || !restore_json.isObject())) {
+			conn->set_status(websocketpp::http::status_code::bad_request);
+			return;
+		}
+
+		try {
+			Meta::PathRevision revision{matched[2].str() | crypto::De<crypto::Hex>(), std::stoll(matched[3].str())};
+			group->restore_revision(revision, restore_json.get("destination", "").asString());
+			conn->set_status(websocketpp::http::status_code::accepted);
+		}catch(AbstractFolder::no_such_meta& e) {
+			conn->set_status(websocketpp::http::status_code::not_found);
+		}catch(AbstractFolder::no_such_chunk& e) {
+			conn->set_status(websocketpp::http::status_code::conflict);   // Some chunks of this revision are missing
+		}catch(std::exception& e) {
+			conn->set_status(websocketpp::http::status_code::bad_request);
+		}
+	}
+}
+
 } /* namespace librevault */
@@ -60,6 +60,9 @@ private:
 	void handle_shutdown(ControlServer::server::connection_ptr conn, std::smatch matched);
 
 	void handle_globals(ControlServer::server::connection_ptr conn, std::smatch matched);
+
+	void handle_folder_priority(ControlServer::server::connection_ptr conn, std::smatch matched);
+	void handle_folder_archive(ControlServer::server::connection_ptr conn, std::smatch matched);
 };
 
 } /* namespace librevault */
@@ -37,7 +37,15 @@
 #include "folder/FolderService.h"
 #include "folder/meta/Index.h"
 #include "folder/meta/MetaStorage.h"
+#include "folder/transfer/Downloader.h"
+#include "folder/transfer/Uploader.h"
+#include "p2p/BandwidthLimiter.h"
 #include "p2p/P2PFolder.h"
+#include "p2p/P2PProvider.h"
+#include "p2p/RawService.h"
+#include "p2p/WSClient.h"
+#include "p2p/WSServer.h"
+#include "util/FileDescriptorCache.h"
 #include "util/log.h"
 
 namespace librevault {
@@ -134,6 +142,24 @@ Json::Value ControlServer::make_state_json() const {
 		folder_json["index_entries_symlink"] = (Json::Value::UInt64)index_status.symlink_entries;
 		folder_json["index_entries_deleted"] = (Json::Value::UInt64)index_status.deleted_entries;
 
+		// Downloads
+		folder_json["download_requests"] = (Json::Value::UInt64)folder->downloader_->inflight_requests();
+		folder_json["download_prioritized_chunks"] = (Json::Value::UInt64)folder->downloader_->prioritized_chunks();
+		auto file_stats = folder->downloader_->file_stats();
+		folder_json["download_incomplete_files"] = (Json::Value::UInt64)file_stats.incomplete;
+		folder_json["download_peak_incomplete_files"] = (Json::Value::UInt64)file_stats.peak_incomplete;
+		folder_json["download_completed_files"] = (Json::Value::UInt64)file_stats.completed;
+
+		auto strand_stats = folder->serial_strand_.heartbeat();
+		folder_json["serial_handlers"] = (Json::Value::UInt64)strand_stats.handlers;
+		folder_json["serial_latency_avg"] = (Json::Value::UInt64)strand_stats.average_latency.count();
+		folder_json["serial_latency_max"] = (Json::Value::UInt64)strand_stats.max_latency.count();
+
+		auto cache_stats = folder->uploader_->cache_stats();
+		folder_json["upload_pinned_chunks"] = (Json::Value::UInt64)cache_stats.pinned;
+		folder_json["upload_prefetched_chunks"] = (Json::Value::UInt64)cache_stats.prefetched;
+		folder_json["upload_prefetch_hits"] = (Json::Value::UInt64)cache_stats.prefetch_hits;
+
 		// Peers
 		folder_json["peers"] = Json::arrayValue;
 		for(auto p2p_peer : folder->p2p_dirs()) {
@@ -143,18 +169,42 @@ Json::Value ControlServer::make_state_json() const {
 			peer_json["endpoint"] = os.str();
 			peer_json["client_name"] = p2p_peer->client_name();
 			peer_json["user_agent"] = p2p_peer->user_agent();
+			peer_json["channel"] = p2p_peer->channel();   // 0, if connection is not multiplexed
 
 			// Bandwidth
 			auto bandwidth_stats = p2p_peer->heartbeat_stats();
 			peer_json["up_bandwidth"] = bandwidth_stats.up_bandwidth_;
-			peer_json["up_bandwidth_blocks"] = bandwidth_stats.up_bandwidth_;
+			peer_json["up_bandwidth_blocks"] = bandwidth_stats.up_bandwidth_blocks_;
 			peer_json["down_bandwidth"] = bandwidth_stats.down_bandwidth_;
-			peer_json["down_bandwidth_blocks"] = bandwidth_stats.down_bandwidth_;
+			peer_json["down_bandwidth_blocks"] = bandwidth_stats.down_bandwidth_blocks_;
 			// Transferred
 			peer_json["up_bytes"] = (Json::Value::UInt64)bandwidth_stats.up_bytes_;
 			peer_json["up_bytes_blocks"] = (Json::Value::UInt64)bandwidth_stats.up_bytes_blocks_;
 			peer_json["down_bytes"] = (Json::Value::UInt64)bandwidth_stats.down_bytes_;
 			peer_json["down_bytes_blocks"] = (Json::Value::UInt64)bandwidth_stats.down_bytes_blocks_;
+			// Choking
+			auto upload_stats = folder->uploader_->peer_stats(p2p_peer);
+			peer_json["am_choking"] = !upload_stats.unchoked;
+			peer_json["optimistic_unchoke"] = upload_stats.optimistic;
+			peer_json["peer_choking"] = p2p_peer->peer_choking();
+			peer_json["peer_interested"] = p2p_peer->peer_interested();
+			peer_json["local"] = p2p_peer->local();
+			peer_json["upload_rate"] = upload_stats.up_rate;
+			peer_json["download_rate"] = upload_stats.down_rate;
+			// Request window
+			auto remote_stats = folder->downloader_->remote_stats(p2p_peer);
+			peer_json["window"] = (Json::Value::UInt64)remote_stats.window;
+			peer_json["outstanding"] = (Json::Value::UInt64)remote_stats.outstanding;
+			peer_json["block_size"] = remote_stats.block_size;
+			peer_json["throughput"] = remote_stats.throughput;
+			peer_json["rtt"] = (Json::Value::UInt64)remote_stats.rtt.count();
+			peer_json["timeouts"] = remote_stats.timeouts;
+			// Send queue
+			auto send_queue_stats = p2p_peer->send_queue_stats();
+			peer_json["send_queue_blocks"] = (Json::Value::UInt64)send_queue_stats.blocks;
+			peer_json["send_queue_bytes"] = (Json::Value::UInt64)send_queue_stats.bytes;
+			peer_json["send_buffered"] = (Json::Value::UInt64)send_queue_stats.buffered;
+			peer_json["congested"] = send_queue_stats.congested;
 
 			folder_json["peers"].append(peer_json); //// /peer_json
 		}
@@ -164,6 +214,45 @@ Json::Value ControlServer::make_state_json() const {
 
 	state_json["dht_nodes_count"] = client_.discovery_->mldht_->node_count();
 
+	// P2P threads load
+	state_json["p2p_threads"] = Json::arrayValue;
+	for(auto& thread_stats : client_.p2p_provider_->ios_.heartbeat()) {
+		Json::Value thread_json;
+		thread_json["handlers"] = (Json::Value::UInt64)thread_stats.handlers;
+		thread_json["load"] = thread_stats.load;
+		state_json["p2p_threads"].append(thread_json);
+	}
+
+	// TLS handshakes
+	auto handshake_json = [](const WSService::HandshakeStats& stats) {
+		Json::Value json;
+		json["handshakes"] = (Json::Value::UInt64)stats.handshakes;
+		json["resumed"] = (Json::Value::UInt64)stats.resumed;
+		json["latency_avg"] = (Json::Value::UInt64)stats.average_latency.count();
+		json["latency_max"] = (Json::Value::UInt64)stats.max_latency.count();
+		return json;
+	};
+	state_json["tls"]["incoming"] = handshake_json(client_.p2p_provider_->ws_server_->handshake_stats());
+	state_json["tls"]["outgoing"] = handshake_json(client_.p2p_provider_->ws_client_->handshake_stats());
+	state_json["tls"]["raw"] = handshake_json(client_.p2p_provider_->raw_service_->handshake_stats());
+
+	// Bandwidth limits
+	auto upload_limit_stats = BandwidthLimiter::get()->upload()->stats();
+	auto download_limit_stats = BandwidthLimiter::get()->download()->stats();
+	state_json["bandwidth"]["upload_limit"] = (Json::Value::UInt64)upload_limit_stats.rate;
+	state_json["bandwidth"]["upload_payload_bytes"] = (Json::Value::UInt64)upload_limit_stats.payload_bytes;
+	state_json["bandwidth"]["upload_overhead_bytes"] = (Json::Value::UInt64)upload_limit_stats.overhead_bytes;
+	state_json["bandwidth"]["download_limit"] = (Json::Value::UInt64)download_limit_stats.rate;
+	state_json["bandwidth"]["download_payload_bytes"] = (Json::Value::UInt64)download_limit_stats.payload_bytes;
+	state_json["bandwidth"]["download_overhead_bytes"] = (Json::Value::UInt64)download_limit_stats.overhead_bytes;
+
+	// Incomplete chunk files
+	auto file_cache_stats = FileDescriptorCache::get_instance()->stats();
+	state_json["file_cache"]["open_files"] = (Json::Value::UInt64)file_cache_stats.open_files;
+	state_json["file_cache"]["opens"] = (Json::Value::UInt64)file_cache_stats.opens;
+	state_json["file_cache"]["evictions"] = (Json::Value::UInt64)file_cache_stats.evictions;
+	state_json["file_cache"]["syncs"] = (Json::Value::UInt64)file_cache_stats.syncs;
+
 	return state_json;                              // /state_json
 }
 
@@ -79,7 +79,11 @@ struct FolderParams {
 
 		archive_trash_ttl = json_params.get("archive_trash_ttl", defaults.archive_trash_ttl).asUInt();
 		archive_timestamp_count = json_params.get("archive_timestamp_count", defaults.archive_timestamp_count).asUInt();
+		archive_block_ttl = json_params.get("archive_block_ttl", defaults.archive_block_ttl).asUInt();
+		archive_block_count = json_params.get("archive_block_count", defaults.archive_block_count).asUInt();
 		mainline_dht_enabled = json_params.get("mainline_dht_enabled", defaults.mainline_dht_enabled).asBool();
+		upload_limit = json_params.get("upload_limit", Json::Value::UInt64(defaults.upload_limit)).asUInt64();
+		download_limit = json_params.get("download_limit", Json::Value::UInt64(defaults.download_limit)).asUInt64();
 	}
 
 	/* Parameters */
@@ -98,7 +102,11 @@ struct FolderParams {
 	ArchiveType archive_type = ArchiveType::TRASH_ARCHIVE;
 	unsigned archive_trash_ttl = 30;
 	unsigned archive_timestamp_count = 5;
+	unsigned archive_block_ttl = 30;
+	unsigned archive_block_count = 5;
 	bool mainline_dht_enabled = true;
+	uint64_t upload_limit = 0;  // Bytes per second, 0 is unlimited
+	uint64_t download_limit = 0;
 };
 
 } /* namespace librevault */
@@ -37,12 +37,14 @@
 #include "folder/transfer/MetaUploader.h"
 #include "folder/transfer/Uploader.h"
 #include "folder/transfer/Downloader.h"
+#include "p2p/BandwidthLimiter.h"
 #include "p2p/P2PFolder.h"
+#include <algorithm>
 
 namespace librevault {
 
 FolderGroup::FolderGroup(FolderParams params, io_service& bulk_ios, io_service& serial_ios) :
-		params_(std::move(params)), serial_ios_(serial_ios) {
+		params_(std::move(params)), serial_strand_(serial_ios), bulk_ios_(bulk_ios), restore_queue_(bulk_ios) {
 	LOGFUNC();
 
 	/* Creating directories */
@@ -58,33 +60,39 @@ FolderGroup::FolderGroup(FolderParams params, io_service& bulk_ios, io_service&
 		<< " System path" << (system_path_created ? " created" : "") << "=" << params_.system_path);
 
 	/* Initializing components */
+	upload_bucket_ = std::make_shared<TokenBucket>(BandwidthLimiter::get()->upload(), params_.upload_limit);
+	download_bucket_ = std::make_shared<TokenBucket>(BandwidthLimiter::get()->download(), params_.download_limit);
+
 	path_normalizer_ = std::make_unique<PathNormalizer>(params_);
 	ignore_list = std::make_unique<IgnoreList>(params_, *path_normalizer_);
 
 	meta_storage_ = std::make_unique<MetaStorage>(params_, *ignore_list, *path_normalizer_, bulk_ios);
 	chunk_storage = std::make_unique<ChunkStorage>(params_, *meta_storage_, *path_normalizer_, bulk_ios);
 
-	uploader_ = std::make_unique<Uploader>(*chunk_storage);
-	downloader_ = std::make_unique<Downloader>(params_, *meta_storage_, *chunk_storage, serial_ios);
-	meta_uploader_ = std::make_unique<MetaUploader>(*meta_storage_, *chunk_storage);
-	meta_downloader_ = std::make_unique<MetaDownloader>(*meta_storage_, *downloader_);
+	uploader_ = std::make_unique<Uploader>(*chunk_storage, *meta_storage_, serial_strand_, bulk_ios);
+	downloader_ = std::make_unique<Downloader>(params_, *meta_storage_, *chunk_storage, serial_strand_, bulk_ios);
+	meta_uploader_ = std::make_unique<MetaUploader>(*meta_storage_, *chunk_storage, serial_strand_, bulk_ios);
+	meta_downloader_ = std::make_unique<MetaDownloader>(*meta_storage_, *downloader_, serial_strand_, bulk_ios);
 
-	// Connecting signals and slots
+	// Connecting signals and slots. Metas are put into Index off the serial strand, so bitfields are computed there too
 	meta_storage_->index->new_meta_signal.connect([this](const SignedMeta& smeta){
-		serial_ios_.dispatch([=]{
-			handle_indexed_meta(smeta);
+		bitfield_type bitfield = chunk_storage->make_bitfield(smeta.meta());
+		serial_strand_.dispatch([=]{
+			handle_indexed_meta(smeta, bitfield);
 		});
 	});
 	chunk_storage->new_chunk_signal.connect([this](const blob& ct_hash){
-		serial_ios_.dispatch([=]{
+		serial_strand_.dispatch([=]{
 			downloader_->notify_local_chunk(ct_hash);
 			uploader_->broadcast_chunk(remotes(), ct_hash);
 		});
 	});
 
-	serial_ios_.dispatch([=]{
-		for(auto& smeta : meta_storage_->index->get_meta())
-			handle_indexed_meta(smeta);
+	bulk_ios_.post([=]{
+		for(auto& smeta : meta_storage_->index->get_meta()) {
+			bitfield_type bitfield = chunk_storage->make_bitfield(smeta.meta());
+			serial_strand_.post([=]{handle_indexed_meta(smeta, bitfield);});
+		}
 	});
 }
 
@@ -93,80 +101,191 @@ FolderGroup::~FolderGroup() {
 }
 
 /* Actions */
-void FolderGroup::handle_indexed_meta(const SignedMeta& smeta) {
+void FolderGroup::handle_indexed_meta(const SignedMeta& smeta, const bitfield_type& bitfield) {
 	Meta::PathRevision revision = smeta.meta().path_revision();
-	bitfield_type bitfield = chunk_storage->make_bitfield(smeta.meta());
 
 	downloader_->notify_local_meta(smeta, bitfield);
+	if(is_prioritized(smeta.meta()))
+		downloader_->prioritize({smeta});
 	meta_uploader_->broadcast_meta(remotes(), revision, bitfield);
 }
 
 // RemoteFolder actions
 void FolderGroup::handle_handshake(std::shared_ptr<RemoteFolder> origin) {
+	// Remote may be detached meanwhile, then its state must not be created after erase_remote
+	serial_strand_.post([origin = std::weak_ptr<RemoteFolder>(origin), this]{
+		auto remote_ptr = origin.lock();
+		if(remote_ptr && attached(remote_ptr))
+			downloader_->add_remote(remote_ptr);
+	});
+
 	origin->recv_choke.connect([origin = std::weak_ptr<RemoteFolder>(origin), this]{
-		serial_ios_.post([=]{downloader_->handle_choke(origin.lock());});
+		serial_strand_.post([=]{downloader_->handle_choke(origin.lock());});
 	});
 	origin->recv_unchoke.connect([origin = std::weak_ptr<RemoteFolder>(origin), this]{
-		serial_ios_.post([=]{downloader_->handle_unchoke(origin.lock());});
+		serial_strand_.post([=]{downloader_->handle_unchoke(origin.lock());});
 	});
 	origin->recv_interested.connect([origin = std::weak_ptr<RemoteFolder>(origin), this]{
-		serial_ios_.post([=]{uploader_->handle_interested(origin.lock());});
+		serial_strand_.post([=]{uploader_->handle_interested(origin.lock());});
 	});
 	origin->recv_not_interested.connect([origin = std::weak_ptr<RemoteFolder>(origin), this]{
-		serial_ios_.post([=]{uploader_->handle_not_interested(origin.lock());});
+		serial_strand_.post([=]{uploader_->handle_not_interested(origin.lock());});
 	});
 
 	origin->recv_have_meta.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const Meta::PathRevision& revision, const bitfield_type& bitfield){
-		serial_ios_.post([=]{meta_downloader_->handle_have_meta(origin.lock(), revision, bitfield);});
+		serial_strand_.post([=]{meta_downloader_->handle_have_meta(origin.lock(), revision, bitfield);});
 	});
 	origin->recv_have_chunk.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const blob& ct_hash){
-		serial_ios_.post([=]{downloader_->notify_remote_chunk(origin.lock(), ct_hash);});
+		serial_strand_.post([=]{downloader_->notify_remote_chunk(origin.lock(), ct_hash);});
 	});
 
 	origin->recv_meta_request.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](Meta::PathRevision path_revision){
-		serial_ios_.post([=]{meta_uploader_->handle_meta_request(origin.lock(), path_revision);});
+		serial_strand_.post([=]{meta_uploader_->handle_meta_request(origin.lock(), path_revision);});
 	});
 	origin->recv_meta_reply.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const SignedMeta& smeta, const bitfield_type& bitfield){
-		serial_ios_.post([=]{meta_downloader_->handle_meta_reply(origin.lock(), smeta, bitfield);});
+		serial_strand_.post([=]{meta_downloader_->handle_meta_reply(origin.lock(), smeta, bitfield);});
 	});
+	// recv_meta_cancel is left unconnected: meta requests are answered right away, so there is nothing to cancel.
 
 	origin->recv_block_request.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const blob& ct_hash, uint32_t offset, uint32_t size){
-		serial_ios_.post([=]{uploader_->handle_block_request(origin.lock(), ct_hash, offset, size);});
+		serial_strand_.post([=]{uploader_->handle_block_request(origin.lock(), ct_hash, offset, size);});
+	});
+	origin->recv_block_reply.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const blob& ct_hash, uint32_t offset, const shared_buffer& block){
+		serial_strand_.post([=]{downloader_->put_block(ct_hash, offset, block, origin.lock());});
 	});
-	origin->recv_block_reply.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const blob& ct_hash, uint32_t offset, const blob& block){
-		serial_ios_.post([=]{downloader_->put_block(ct_hash, offset, block, origin.lock());});
+	origin->recv_block_cancel.connect([origin = std::weak_ptr<RemoteFolder>(origin), this](const blob& ct_hash, uint32_t offset, uint32_t size){
+		serial_strand_.post([=]{uploader_->handle_block_cancel(origin.lock(), ct_hash, offset, size);});
+	});
+	origin->send_ready.connect([origin = std::weak_ptr<RemoteFolder>(origin), this]{
+		serial_strand_.post([=]{uploader_->handle_send_ready(origin.lock());});
 	});
 
-	serial_ios_.post([origin, this]{meta_uploader_->handle_handshake(origin);});
+	serial_strand_.post([origin, this]{meta_uploader_->handle_handshake(origin);});
 }
 
-void FolderGroup::attach(std::shared_ptr<P2PFolder> remote_ptr) {
-	if(have_p2p_dir(remote_ptr->remote_endpoint()) || have_p2p_dir(remote_ptr->remote_pubkey())) throw attach_error();
+/* Download priority */
+void FolderGroup::set_priority_paths(const std::vector<std::string>& paths) {
+	std::vector<std::string> normalized_paths;
+	for(auto& path : paths)
+		if(!path.empty())
+			normalized_paths.push_back(path_normalizer_->normalize_path(params_.path / path));
+
+	{
+		std::unique_lock<decltype(priority_paths_mtx_)> lk(priority_paths_mtx_);
+		priority_paths_ = std::move(normalized_paths);
+	}
+
+	bulk_ios_.post([this]{apply_priority();});
+}
+
+std::vector<std::string> FolderGroup::priority_paths() const {
+	std::unique_lock<decltype(priority_paths_mtx_)> lk(priority_paths_mtx_);
+	return priority_paths_;
+}
+
+void FolderGroup::apply_priority() {
+	std::list<SignedMeta> prioritized;
+	for(auto& smeta : meta_storage_->index->get_incomplete_meta())
+		if(is_prioritized(smeta.meta()))
+			prioritized.push_back(smeta);
+
+	LOGD("Prioritized " << prioritized.size() << " incomplete files");
+	serial_strand_.post([this, prioritized]{
+		downloader_->clear_priority();
+		downloader_->prioritize(prioritized);
+	});
+}
+
+bool FolderGroup::is_prioritized(const Meta& meta) const {
+	if(params_.secret.get_type() > Secret::Type::ReadOnly) return false;    // Paths are encrypted with the key, we don't have
+	if(meta.meta_type() != Meta::FILE) return false;
 
+	std::unique_lock<decltype(priority_paths_mtx_)> lk(priority_paths_mtx_);
+	if(priority_paths_.empty()) return false;
+
+	std::string path = meta.path(params_.secret);
+	for(auto& priority_path : priority_paths_) {
+		if(path.compare(0, priority_path.size(), priority_path) != 0) continue;
+		if(path.size() == priority_path.size() || path[priority_path.size()] == '/')
+			return true;
+	}
+	return false;
+}
+
+/* Archive */
+std::list<SignedMeta> FolderGroup::archived_revisions() {
+	std::list<SignedMeta> archived;
+	for(auto& revision : chunk_storage->get_archived_revisions()) {
+		try {
+			archived.push_back(chunk_storage->get_archived(revision));
+		}catch(AbstractFolder::no_such_meta& e) {}   // Expired in the meantime
+	}
+	return archived;
+}
+
+void FolderGroup::restore_revision(const Meta::PathRevision& revision, const std::string& destination) {
+	Meta meta = chunk_storage->get_archived(revision).meta();
+	if(meta.meta_type() != Meta::FILE) throw AbstractFolder::no_such_meta();
+	if(!chunk_storage->make_bitfield(meta).all()) throw AbstractFolder::no_such_chunk();
+
+	fs::path relpath = destination.empty() ? fs::path(meta.path(params_.secret)) : fs::path(destination);
+	if(relpath.empty() || relpath.has_root_path() || std::find(relpath.begin(), relpath.end(), "..") != relpath.end())
+		throw error("Restore destination is outside of the folder");
+	fs::path destination_path = params_.path / relpath;
+	if(fs::is_directory(destination_path))
+		throw error("Restore destination is a directory");
+
+	restore_queue_.invoke_post([this, revision, destination_path]{
+		try {
+			chunk_storage->restore(revision, destination_path);
+			LOGD("Restored r:" << revision.revision_ << " of " << AbstractFolder::path_id_readable(revision.path_id_));
+		}catch(std::exception& e) {
+			LOGW("Could not restore r:" << revision.revision_ << " of " << AbstractFolder::path_id_readable(revision.path_id_) << " e:" << e.what());
+		}
+	});
+}
+
+void FolderGroup::attach(std::shared_ptr<P2PFolder> remote_ptr) {
+	// Checked and inserted at once, so two connections from the same node can't both pass the check
 	std::unique_lock<decltype(p2p_folders_mtx_)> lk(p2p_folders_mtx_);
+	if(p2p_folders_endpoints_.count(remote_ptr->remote_endpoint()) || p2p_folders_pubkeys_.count(remote_ptr->remote_pubkey())) throw attach_error();
 
 	p2p_folders_.insert(remote_ptr);
 	p2p_folders_endpoints_.insert(remote_ptr->remote_endpoint());
 	p2p_folders_pubkeys_.insert(remote_ptr->remote_pubkey());
 
 	LOGD("Attached remote " << remote_ptr->name());
+	lk.unlock();   // Signal handlers may query the members
 
 	remote_ptr->handshake_performed.connect([remote_ptr = std::weak_ptr<RemoteFolder>(remote_ptr), this]{handle_handshake(remote_ptr.lock());});
 
-	serial_ios_.dispatch([this, remote_ptr]{attached_signal(remote_ptr);});
+	serial_strand_.dispatch([this, remote_ptr]{attached_signal(remote_ptr);});
 }
 
 void FolderGroup::detach(std::shared_ptr<P2PFolder> remote_ptr) {
 	std::unique_lock<decltype(p2p_folders_mtx_)> lk(p2p_folders_mtx_);
-	downloader_->erase_remote(remote_ptr);
+	if(!p2p_folders_.count(remote_ptr)) return; // Was not attached, so its endpoint and pubkey belong to another remote
+	// Transfer state is only touched on the serial strand
+	serial_strand_.post([this, remote_ptr]{
+		downloader_->erase_remote(remote_ptr);
+		uploader_->erase_remote(remote_ptr);
+	});
 
 	p2p_folders_pubkeys_.erase(remote_ptr->remote_pubkey());
 	p2p_folders_endpoints_.erase(remote_ptr->remote_endpoint());
 	p2p_folders_.erase(remote_ptr);
 
 	LOGD("Detached remote " << remote_ptr->name());
+	lk.unlock();   // Signal handlers may query the members
 
-	serial_ios_.dispatch([this, remote_ptr]{detached_signal(remote_ptr);});
+	serial_strand_.dispatch([this, remote_ptr]{detached_signal(remote_ptr);});
+}
+
+bool FolderGroup::attached(std::shared_ptr<RemoteFolder> remote_ptr) const {
+	std::unique_lock<decltype(p2p_folders_mtx_)> lk(p2p_folders_mtx_);
+	return std::any_of(p2p_folders_.begin(), p2p_folders_.end(), [&](const std::shared_ptr<P2PFolder>& p2p_folder){
+		return p2p_folder == remote_ptr;
+	});
 }
 
 bool FolderGroup::have_p2p_dir(const tcp_endpoint& endpoint) {
@@ -180,6 +299,7 @@ bool FolderGroup::have_p2p_dir(const blob& pubkey) {
 }
 
 std::set<std::shared_ptr<RemoteFolder>> FolderGroup::remotes() const {
+	std::unique_lock<decltype(p2p_folders_mtx_)> lk(p2p_folders_mtx_);
 	return std::set<std::shared_ptr<RemoteFolder>>(p2p_folders_.begin(), p2p_folders_.end());
 }
 
@@ -29,15 +29,20 @@
 #pragma once
 #include "AbstractFolder.h"
 #include "control/FolderParams.h"
+#include "util/monitored_strand.h"
 #include "util/network.h"
+#include "util/scoped_async_queue.h"
+#include "util/TokenBucket.h"
 
 #include <librevault/Secret.h>
 #include <librevault/SignedMeta.h>
 #include <librevault/util/bitfield_convert.h>
 
 #include <boost/signals2/signal.hpp>
+#include <list>
 #include <set>
 #include <mutex>
+#include <vector>
 
 namespace librevault {
 
@@ -68,15 +73,23 @@ public:
 		attach_error() : error("Could not attach remote to FolderGroup") {}
 	};
 
-	FolderGroup(FolderParams params, io_service& bulk_ios, io_service& serial_ios);
+	FolderGroup(FolderParams params, io_service& bulk_ios, io_service& serial_ios);    // Folder logic runs on its own strand of serial_ios
 	virtual ~FolderGroup();
 
 	/* Actions */
-	void handle_indexed_meta(const SignedMeta& smeta);
+	void handle_indexed_meta(const SignedMeta& smeta, const bitfield_type& bitfield);
 
 	// RemoteFolder actions
 	void handle_handshake(std::shared_ptr<RemoteFolder> origin);
 
+	/* Download priority */
+	void set_priority_paths(const std::vector<std::string>& paths);  // Paths are relative to the folder root, directories cover their subtrees
+	std::vector<std::string> priority_paths() const;
+
+	/* Archive */
+	std::list<SignedMeta> archived_revisions();
+	void restore_revision(const Meta::PathRevision& revision, const std::string& destination);   // Destination is relative to the folder root, the original path is used, if empty. Throws AbstractFolder::no_such_meta, AbstractFolder::no_such_chunk or error
+
 	/* Membership management */
 	void attach(std::shared_ptr<P2PFolder> remote_ptr);
 	void detach(std::shared_ptr<P2PFolder> remote_ptr);
@@ -84,22 +97,27 @@ public:
 	boost::signals2::signal<void(std::shared_ptr<P2PFolder>)> attached_signal;
 	boost::signals2::signal<void(std::shared_ptr<P2PFolder>)> detached_signal;
 
+	bool attached(std::shared_ptr<RemoteFolder> remote_ptr) const;
 	bool have_p2p_dir(const tcp_endpoint& endpoint);
 	bool have_p2p_dir(const blob& pubkey);
 
 	/* Getters */
 	std::set<std::shared_ptr<RemoteFolder>> remotes() const;
-	inline std::set<std::shared_ptr<P2PFolder>> p2p_dirs() const {return p2p_folders_;}
+	inline std::set<std::shared_ptr<P2PFolder>> p2p_dirs() const {std::unique_lock<decltype(p2p_folders_mtx_)> lk(p2p_folders_mtx_); return p2p_folders_;}
 
 	inline const FolderParams& params() const {return params_;}
 
 	inline const Secret& secret() const {return params().secret;}
 	inline const blob& hash() const {return secret().get_Hash();}
 
+	std::shared_ptr<TokenBucket> upload_bucket() const {return upload_bucket_;}
+	std::shared_ptr<TokenBucket> download_bucket() const {return download_bucket_;}
+
 	std::string log_tag() const;
 private:
 	const FolderParams params_;
-	io_service& serial_ios_;
+	monitored_strand serial_strand_;
+	io_service& bulk_ios_;
 
 	std::unique_ptr<PathNormalizer> path_normalizer_;
 	std::unique_ptr<IgnoreList> ignore_list;
@@ -112,6 +130,8 @@ private:
 	std::unique_ptr<MetaUploader> meta_uploader_;
 	std::unique_ptr<MetaDownloader> meta_downloader_;
 
+	std::shared_ptr<TokenBucket> upload_bucket_, download_bucket_;
+
 	/* Members */
 	mutable std::mutex p2p_folders_mtx_;
 
@@ -120,6 +140,16 @@ private:
 	// Member lookup optimization
 	std::set<blob> p2p_folders_pubkeys_;
 	std::set<tcp_endpoint> p2p_folders_endpoints_;
+
+	/* Download priority */
+	mutable std::mutex priority_paths_mtx_;
+	std::vector<std::string> priority_paths_;   // Normalized
+
+	void apply_priority();  // Runs on bulk io_service
+	bool is_prioritized(const Meta& meta) const;
+
+	/* Archive */
+	ScopedAsyncQueue restore_queue_;    // Destroyed first, so the pending restores are finished before storages go away
 };
 
 } /* namespace librevault */
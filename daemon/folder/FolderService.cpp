@@ -52,7 +52,9 @@ void FolderService::run() {
 			init_folder(folder_config);
 	});
 
-	serial_ios_.start(1);
+	// Every folder runs on its own strand, so folders don't wait for each other
+	unsigned serial_threads = Config::get()->global_get("folder_threads").asUInt();
+	serial_ios_.start(serial_threads ? serial_threads : std::max(std::thread::hardware_concurrency(), 1u));
 	bulk_ios_.start(std::max(std::thread::hardware_concurrency(), 1u));
 }
 
@@ -31,6 +31,8 @@
 #include <librevault/SignedMeta.h>
 #include <boost/signals2.hpp>
 #include "AbstractFolder.h"
+#include "util/TokenBucket.h"
+#include "util/shared_buffer.h"
 
 namespace librevault {
 
@@ -45,6 +47,7 @@ public:
 	using signal = typename boost::signals2::signal_type<Func, boost::signals2::keywords::mutex_type<boost::signals2::dummy_mutex>>::type;
 
 	signal<void()> handshake_performed;
+	signal<void()> send_ready;  // Remote is not congested anymore
 
 	/* Message signals */
 	signal<void()> recv_choke;
@@ -60,7 +63,7 @@ public:
 	signal<void(Meta::PathRevision)> recv_meta_cancel;
 
 	signal<void(blob, uint32_t, uint32_t)> recv_block_request;
-	signal<void(blob, uint32_t, blob)> recv_block_reply;
+	signal<void(const blob&, uint32_t, const shared_buffer&)> recv_block_reply;
 	signal<void(blob, uint32_t, uint32_t)> recv_block_cancel;
 
 	/* Message senders */
@@ -77,7 +80,7 @@ public:
 	virtual void cancel_meta(const Meta::PathRevision& revision) = 0;
 
 	virtual void request_block(const blob& ct_hash, uint32_t offset, uint32_t size) = 0;
-	virtual void post_block(const blob& ct_hash, uint32_t offset, const blob& chunk) = 0;
+	virtual void post_block(const blob& ct_hash, uint32_t offset, const shared_buffer& block) = 0;
 	virtual void cancel_block(const blob& ct_hash, uint32_t offset, uint32_t size) = 0;
 
 	/* High-level RAII wrappers */
@@ -96,6 +99,14 @@ public:
 	bool peer_interested() const {return peer_interested_;}
 
 	virtual bool ready() const = 0;
+	virtual bool congested() const = 0; // Blocks, sent to this remote now, would pile up in memory
+	virtual std::chrono::milliseconds rtt() const = 0;    // Round-trip time, zero if unknown
+	virtual bool local() const = 0;  // Remote is located in a local network
+
+	virtual uint64_t down_bytes_blocks() const = 0;
+	virtual uint64_t up_bytes_blocks() const = 0;
+
+	virtual const TokenBucket& download_bucket() const = 0; // Received data is charged here
 
 protected:
 	bool am_choking_ = true;
@@ -30,18 +30,21 @@
 
 #include "ChunkStorage.h"
 #include "control/FolderParams.h"
+#include "folder/AbstractFolder.h"
 #include "folder/PathNormalizer.h"
+#include "folder/meta/Index.h"
 #include "folder/meta/MetaStorage.h"
 #include "util/file_util.h"
-#include "util/regex_escape.h"
 #include "util/log.h"
 #include <regex>
+#include <thread>
 
 namespace librevault {
 
-Archive::Archive(const FolderParams& params, MetaStorage& meta_storage, PathNormalizer& path_normalizer, io_service& ios) :
+Archive::Archive(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, PathNormalizer& path_normalizer, io_service& ios) :
 	params_(params),
 	meta_storage_(meta_storage),
+	chunk_storage_(chunk_storage),
 	path_normalizer_(path_normalizer),
 	ios_(ios) {
 
@@ -49,7 +52,7 @@ Archive::Archive(const FolderParams& params, MetaStorage& meta_storage, PathNorm
 		case FolderParams::ArchiveType::NO_ARCHIVE: archive_strategy_ = std::make_unique<NoArchive>(*this); break;
 		case FolderParams::ArchiveType::TRASH_ARCHIVE: archive_strategy_ = std::make_unique<TrashArchive>(*this); break;
 		case FolderParams::ArchiveType::TIMESTAMP_ARCHIVE: archive_strategy_ = std::make_unique<TimestampArchive>(*this); break;
-		//case FolderParams::ArchiveType::BLOCK_ARCHIVE: archive_strategy_ = std::make_unique<NoArchive>(this); break;
+		case FolderParams::ArchiveType::BLOCK_ARCHIVE: archive_strategy_ = std::make_unique<BlockArchive>(*this); break;
 		default: throw std::runtime_error("Wrong Archive type");
 	}
 }
@@ -76,11 +79,65 @@ void Archive::archive(const fs::path& from) {
 	// TODO: else
 }
 
+std::list<Meta::PathRevision> Archive::get_archived_revisions() {
+	std::list<Meta::PathRevision> revisions;
+	for(auto row : meta_storage_.index->db().exec("SELECT path_id, revision FROM archive_meta WHERE archived IS NOT NULL ORDER BY path_id, revision DESC"))
+		revisions.push_back(Meta::PathRevision{row[0].as_blob(), row[1].as_int()});
+	return revisions;
+}
+
+SignedMeta Archive::get_archived(const Meta::PathRevision& revision) {
+	for(auto row : meta_storage_.index->db().exec("SELECT meta, signature FROM archive_meta WHERE path_id=:path_id AND revision=:revision AND archived IS NOT NULL", {
+		{":path_id", revision.path_id_},
+		{":revision", (int64_t)revision.revision_}
+	}))
+		return SignedMeta(row[0], row[1], params_.secret);
+	throw AbstractFolder::no_such_meta();
+}
+
 // NoArchive
 void Archive::NoArchive::archive(const fs::path& from) {
 	fs::remove(from);
 }
 
+// Archive catalog
+void Archive::import_catalog(const fs::path& archive_path) {
+	auto& db = meta_storage_.index->db();
+	if(db.exec("SELECT archived_path FROM archive_file LIMIT 1").have_rows()) return;
+
+	// Catalog is empty, so this archive may be created before catalog was introduced. One-time scan is needed.
+	std::regex timestamp_regex(R"((.*)~\d{8}-\d{6}(.*))");
+	SQLiteSavepoint raii_transaction(db, "Archive::import_catalog");
+	for(auto it = fs::recursive_directory_iterator(archive_path); it != fs::recursive_directory_iterator(); it++) {
+		if(!fs::is_regular_file(it->path())) continue;
+
+		std::string archived_relpath = it->path().generic_string().substr(archive_path.generic_string().size()+1);
+		std::smatch match;
+		std::string relpath = std::regex_match(archived_relpath, match, timestamp_regex) ? match[1].str()+match[2].str() : archived_relpath;
+
+		db.exec("INSERT OR REPLACE INTO archive_file (archived_path, path, archived) VALUES (:archived_path, :path, :archived);", {
+			{":archived_path", archived_relpath},
+			{":path", relpath},
+			{":archived", (int64_t)fs::last_write_time(it->path())}
+		});
+	}
+	raii_transaction.commit();
+}
+
+void Archive::add_catalog_entry(const std::string& relpath, const std::string& archived_relpath) {
+	meta_storage_.index->db().exec("INSERT OR REPLACE INTO archive_file (archived_path, path, archived) VALUES (:archived_path, :path, :archived);", {
+		{":archived_path", archived_relpath},
+		{":path", relpath},
+		{":archived", (int64_t)time(nullptr)}
+	});
+}
+
+void Archive::remove_catalog_entry(const fs::path& archive_path, const std::string& archived_relpath) {
+	LOGD("Removing an archive item: " << archived_relpath);
+	fs::remove(archive_path / fs::path(archived_relpath));
+	meta_storage_.index->db().exec("DELETE FROM archive_file WHERE archived_path=:archived_path", {{":archived_path", archived_relpath}});
+}
+
 // TrashArchive
 Archive::TrashArchive::TrashArchive(Archive& parent) :
 	ArchiveStrategy(parent),
@@ -100,19 +157,23 @@ Archive::TrashArchive::~TrashArchive() {
 void Archive::TrashArchive::maintain_cleanup(PeriodicProcess& process) {
 	LOGFUNC();
 
-	std::list<fs::path> removed_paths;
 	try {
-		for(auto it = fs::recursive_directory_iterator(archive_path_); it != fs::recursive_directory_iterator(); it++) {
-			time_t time_since_archivation = time(nullptr) - fs::last_write_time(it->path());
+		parent_.import_catalog(archive_path_);
+
+		if(parent_.params_.archive_trash_ttl != 0) {
 			constexpr unsigned sec_per_day = 60 * 60 * 24;
-			if(time_since_archivation >= parent_.params_.archive_trash_ttl * sec_per_day && parent_.params_.archive_trash_ttl != 0)
-				removed_paths.push_back(it->path());
-		}
 
-		for(const fs::path& path : removed_paths)
-			fs::remove(path);
+			std::list<std::string> removed_paths;
+			for(auto row : parent_.meta_storage_.index->db().exec("SELECT archived_path FROM archive_file WHERE archived<:cutoff ORDER BY archived", {
+				{":cutoff", (int64_t)time(nullptr) - (int64_t)parent_.params_.archive_trash_ttl * sec_per_day}
+			}))
+				removed_paths.push_back(row[0].as_text());
 
-		cleanup_process_.invoke_after(std::chrono::hours(24));
+			for(auto& archived_relpath : removed_paths)
+				parent_.remove_catalog_entry(archive_path_, archived_relpath);
+		}
+
+		schedule_cleanup();
 	}catch(std::exception& e) {
 		cleanup_process_.invoke_after(std::chrono::minutes(10));    // An error occured, retry in 10 min
 	}
@@ -120,11 +181,27 @@ void Archive::TrashArchive::maintain_cleanup(PeriodicProcess& process) {
 	LOGFUNCEND();
 }
 
+void Archive::TrashArchive::schedule_cleanup() {
+	// Wake up exactly when the oldest entry expires, but at least once a day.
+	std::chrono::seconds next_cleanup = std::chrono::hours(24);
+	if(parent_.params_.archive_trash_ttl != 0) {
+		constexpr unsigned sec_per_day = 60 * 60 * 24;
+		for(auto row : parent_.meta_storage_.index->db().exec("SELECT MIN(archived) FROM archive_file")) {
+			if(row[0].is_null()) break;
+			int64_t expires_in = row[0].as_int() + (int64_t)parent_.params_.archive_trash_ttl * sec_per_day - (int64_t)time(nullptr);
+			next_cleanup = std::min(next_cleanup, std::chrono::seconds(std::max(expires_in, int64_t(1))));
+		}
+	}
+	cleanup_process_.invoke_after(next_cleanup, PeriodicProcess::NO_RESET_TIMER);
+}
+
 void Archive::TrashArchive::archive(const fs::path& from) {
-	auto archived_path = archive_path_ / fs::path(parent_.path_normalizer_.normalize_path(from));
+	auto relpath = parent_.path_normalizer_.normalize_path(from);
+	auto archived_path = archive_path_ / fs::path(relpath);
 	LOGD("Adding an archive item: " << archived_path);
 	file_move(from, archived_path);
 	fs::last_write_time(archived_path, time(nullptr));
+	parent_.add_catalog_entry(relpath, relpath);
 }
 
 // TimestampArchive
@@ -133,11 +210,13 @@ Archive::TimestampArchive::TimestampArchive(Archive& parent) :
 	archive_path_(parent.params_.system_path / "archive") {
 
 	fs::create_directory(archive_path_);
+	parent_.import_catalog(archive_path_);
 }
 
 void Archive::TimestampArchive::archive(const fs::path& from) {
 	// Add a new entry
-	auto archived_path = archive_path_ / fs::path(parent_.path_normalizer_.normalize_path(from));
+	auto relpath = parent_.path_normalizer_.normalize_path(from);
+	auto archived_path = archive_path_ / fs::path(relpath);
 
 	time_t mtime = fs::last_write_time(from);
 	std::vector<char> strftime_buf(16);
@@ -145,25 +224,197 @@ void Archive::TimestampArchive::archive(const fs::path& from) {
 
 	std::string suffix = std::string("~")+strftime_buf.data();
 
-	auto timestamped_path = archived_path.stem();
+	auto timestamped_path = archived_path.parent_path() / archived_path.stem();
 	timestamped_path += boost::locale::conv::utf_to_utf<native_char_t>(suffix);
 	timestamped_path += archived_path.extension();
+	LOGD("Adding an archive item: " << timestamped_path);
 	file_move(from, timestamped_path);
+	parent_.add_catalog_entry(relpath, timestamped_path.generic_string().substr(archive_path_.generic_string().size()+1));
 
 	// Remove
-	std::map<std::string, fs::path> paths;
-	std::regex timestamp_regex(regex_escape(from.stem().generic_string()) + R"((~\d{8}-\d{6}))" + regex_escape(from.extension().generic_string()));
-	for(auto it = fs::directory_iterator(from.parent_path()); it != fs::directory_iterator(); it++) {
-		std::smatch match;
-		std::string generic_path = it->path().generic_string();	// To resolve stackoverflow.com/q/32164501
-		std::regex_match(generic_path, match, timestamp_regex);
-		if(!match.empty()) {
-			paths.insert({match[1].str(), from});
+	if(parent_.params_.archive_timestamp_count != 0) {
+		std::list<std::string> removed_paths;
+		for(auto row : parent_.meta_storage_.index->db().exec("SELECT archived_path FROM archive_file WHERE path=:path ORDER BY archived DESC LIMIT -1 OFFSET :count", {
+			{":path", relpath},
+			{":count", (uint64_t)parent_.params_.archive_timestamp_count}
+		}))
+			removed_paths.push_back(row[0].as_text());
+
+		for(auto& archived_relpath : removed_paths)
+			parent_.remove_catalog_entry(archive_path_, archived_relpath);
+	}
+}
+
+// BlockArchive
+Archive::BlockArchive::BlockArchive(Archive& parent) :
+	ArchiveStrategy(parent),
+	cleanup_process_(parent.ios_, [this](PeriodicProcess& process){
+		maintain_cleanup(process);
+	}) {
+
+	outdated_meta_connection_ = parent_.meta_storage_.index->outdated_meta_signal.connect([this](const SignedMeta& smeta){
+		stash_meta(smeta);
+	});
+	cleanup_process_.invoke_after(std::chrono::minutes(10));    // Start after a small delay.
+}
+
+Archive::BlockArchive::~BlockArchive() {
+	cleanup_process_.wait();
+}
+
+void Archive::BlockArchive::stash_meta(const SignedMeta& smeta) {
+	// Keep Meta until its file is actually replaced. Executed inside Index::put_meta transaction.
+	parent_.meta_storage_.index->db().exec("INSERT OR IGNORE INTO archive_meta (path_id, revision, meta, signature, archived) VALUES (:path_id, :revision, :meta, :signature, NULL);", {
+		{":path_id", smeta.meta().path_id()},
+		{":revision", (int64_t)smeta.meta().revision()},
+		{":meta", smeta.raw_meta()},
+		{":signature", smeta.signature()}
+	});
+}
+
+void Archive::BlockArchive::archive(const fs::path& from) {
+	auto& db = parent_.meta_storage_.index->db();
+	auto path_id = Meta::make_path_id(parent_.path_normalizer_.normalize_path(from), parent_.params_.secret);
+
+	std::list<SignedMeta> stashed_smeta;
+	for(auto row : db.exec("SELECT meta, signature FROM archive_meta WHERE path_id=:path_id AND archived IS NULL", {{":path_id", path_id}}))
+		stashed_smeta.push_back(SignedMeta(row[0], row[1], parent_.params_.secret));
+
+	for(auto& smeta : stashed_smeta) {
+		Meta::PathRevision revision = smeta.meta().path_revision();
+		if(retain_chunks(from, smeta.meta())) {
+			LOGD("Adding an archive revision of " << AbstractFolder::path_id_readable(path_id) << " r:" << revision.revision_);
+			db.exec("UPDATE archive_meta SET archived=:archived WHERE path_id=:path_id AND revision=:revision", {
+				{":archived", (int64_t)time(nullptr)},
+				{":path_id", revision.path_id_},
+				{":revision", (int64_t)revision.revision_}
+			});
+		}else{
+			// File was modified after the revision had been assembled, so its chunks cannot be extracted anymore.
+			db.exec("DELETE FROM archive_meta WHERE path_id=:path_id AND revision=:revision", {
+				{":path_id", revision.path_id_},
+				{":revision", (int64_t)revision.revision_}
+			});
 		}
 	}
-	if(paths.size() > parent_.params_.archive_timestamp_count && parent_.params_.archive_timestamp_count != 0) {
-		fs::remove(paths.begin()->second);
+
+	// Remove revisions over the limit
+	if(parent_.params_.archive_block_count != 0) {
+		std::list<Meta::PathRevision> excess_revisions;
+		for(auto row : db.exec("SELECT revision FROM archive_meta WHERE path_id=:path_id AND archived IS NOT NULL ORDER BY revision DESC LIMIT -1 OFFSET :count", {
+			{":path_id", path_id},
+			{":count", (uint64_t)parent_.params_.archive_block_count}
+		}))
+			excess_revisions.push_back(Meta::PathRevision{path_id, row[0].as_int()});
+
+		for(auto& revision : excess_revisions)
+			release_revision(revision);
+	}
+
+	fs::remove(from);
+}
+
+bool Archive::BlockArchive::retain_chunks(const fs::path& from, const Meta& meta) {
+	auto& db = parent_.meta_storage_.index->db();
+	std::list<blob> added_chunks;
+
+	try {
+		std::ostringstream transaction_name; transaction_name << "retain_chunks_" << std::this_thread::get_id();
+		SQLiteSavepoint raii_transaction(db, transaction_name.str());
+
+		file_wrapper archived_file(from, "rb");
+		archived_file.ios().exceptions(std::ios_base::failbit | std::ios_base::badbit);
+
+		uint64_t offset = 0;
+		for(auto& chunk : meta.chunks()) {
+			if(db.exec("SELECT refcount FROM archive_chunk WHERE ct_hash=:ct_hash", {{":ct_hash", chunk.ct_hash}}).have_rows()) {
+				// Deduplicated: this chunk is already referenced by another archived revision
+				db.exec("UPDATE archive_chunk SET refcount=refcount+1 WHERE ct_hash=:ct_hash", {{":ct_hash", chunk.ct_hash}});
+			}else{
+				blob chunk_pt(chunk.size);
+				archived_file.ios().seekg(offset);
+				archived_file.ios().read(reinterpret_cast<char*>(chunk_pt.data()), chunk_pt.size());
+
+				blob chunk_ct = Meta::Chunk::encrypt(chunk_pt, parent_.params_.secret.get_Encryption_Key(), chunk.iv);
+				if(Meta::Chunk::compute_strong_hash(chunk_ct, meta.strong_hash_type()) != chunk.ct_hash)
+					throw AbstractFolder::no_such_chunk();
+
+				parent_.chunk_storage_.retain_chunk(chunk.ct_hash, chunk_ct);
+				added_chunks.push_back(chunk.ct_hash);
+				db.exec("INSERT INTO archive_chunk (ct_hash, refcount) VALUES (:ct_hash, 1);", {{":ct_hash", chunk.ct_hash}});
+			}
+			offset += chunk.size;
+		}
+
+		raii_transaction.commit();
+		return true;
+	}catch(std::exception& e) {
+		LOGW("Could not archive revision of " << AbstractFolder::path_id_readable(meta.path_id()) << " e:" << e.what());
 	}
+
+	// Savepoint is rolled back at this point, so these chunks have no references.
+	for(auto& ct_hash : added_chunks)
+		parent_.chunk_storage_.release_chunk(ct_hash);
+	return false;
+}
+
+void Archive::BlockArchive::release_revision(const Meta::PathRevision& revision) {
+	auto& db = parent_.meta_storage_.index->db();
+
+	SignedMeta smeta = parent_.get_archived(revision);
+	LOGD("Removing an archive revision of " << AbstractFolder::path_id_readable(revision.path_id_) << " r:" << revision.revision_);
+
+	std::list<blob> released_chunks;
+	{
+		std::ostringstream transaction_name; transaction_name << "release_revision_" << std::this_thread::get_id();
+		SQLiteSavepoint raii_transaction(db, transaction_name.str());
+
+		for(auto& chunk : smeta.meta().chunks()) {
+			db.exec("UPDATE archive_chunk SET refcount=refcount-1 WHERE ct_hash=:ct_hash", {{":ct_hash", chunk.ct_hash}});
+			if(db.exec("SELECT refcount FROM archive_chunk WHERE ct_hash=:ct_hash AND refcount<=0", {{":ct_hash", chunk.ct_hash}}).have_rows()) {
+				db.exec("DELETE FROM archive_chunk WHERE ct_hash=:ct_hash", {{":ct_hash", chunk.ct_hash}});
+				released_chunks.push_back(chunk.ct_hash);
+			}
+		}
+		db.exec("DELETE FROM archive_meta WHERE path_id=:path_id AND revision=:revision", {
+			{":path_id", revision.path_id_},
+			{":revision", (int64_t)revision.revision_}
+		});
+
+		raii_transaction.commit();
+	}
+
+	for(auto& ct_hash : released_chunks)
+		parent_.chunk_storage_.release_chunk(ct_hash);
+}
+
+void Archive::BlockArchive::maintain_cleanup(PeriodicProcess& process) {
+	LOGFUNC();
+
+	try {
+		auto& db = parent_.meta_storage_.index->db();
+		constexpr unsigned sec_per_day = 60 * 60 * 24;
+
+		if(parent_.params_.archive_block_ttl != 0) {
+			std::map<std::string, SQLValue> cutoff = {{":cutoff", (int64_t)time(nullptr) - (int64_t)parent_.params_.archive_block_ttl * sec_per_day}};
+
+			std::list<Meta::PathRevision> expired_revisions;
+			for(auto row : db.exec("SELECT path_id, revision FROM archive_meta WHERE archived IS NOT NULL AND archived<:cutoff", cutoff))
+				expired_revisions.push_back(Meta::PathRevision{row[0].as_blob(), row[1].as_int()});
+
+			for(auto& revision : expired_revisions)
+				release_revision(revision);
+		}
+
+		// Stashed revisions, which were replaced on disk without being archived
+		db.exec("DELETE FROM archive_meta WHERE archived IS NULL AND path_id IN (SELECT path_id FROM meta WHERE assembled=1)");
+
+		cleanup_process_.invoke_after(std::chrono::hours(24));
+	}catch(std::exception& e) {
+		cleanup_process_.invoke_after(std::chrono::minutes(10));    // An error occured, retry in 10 min
+	}
+
+	LOGFUNCEND();
 }
 
 } /* namespace librevault */
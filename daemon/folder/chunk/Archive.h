@@ -31,29 +31,42 @@
 #include "util/fs.h"
 #include "util/log_scope.h"
 #include "util/network.h"
+#include <librevault/SignedMeta.h>
 #include <boost/filesystem/path.hpp>
+#include <boost/signals2/connection.hpp>
 
 namespace librevault {
 
 class FolderParams;
 class MetaStorage;
+class ChunkStorage;
 class PathNormalizer;
 
 class Archive {
 	friend class ArchiveStrategy;
 	LOG_SCOPE("Archive");
 public:
-	Archive(const FolderParams& params, MetaStorage& meta_storage, PathNormalizer& path_normalizer, io_service& ios);
+	Archive(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, PathNormalizer& path_normalizer, io_service& ios);
 	virtual ~Archive() {}
 
 	void archive(const fs::path& from);
 
+	/* Block archive */
+	std::list<Meta::PathRevision> get_archived_revisions();
+	SignedMeta get_archived(const Meta::PathRevision& revision);  // Throws AbstractFolder::no_such_meta
+
 private:
 	const FolderParams& params_;
 	MetaStorage& meta_storage_;
+	ChunkStorage& chunk_storage_;
 	PathNormalizer& path_normalizer_;
 	io_service& ios_;
 
+	/* Archive catalog */
+	void import_catalog(const fs::path& archive_path);
+	void add_catalog_entry(const std::string& relpath, const std::string& archived_relpath);
+	void remove_catalog_entry(const fs::path& archive_path, const std::string& archived_relpath);
+
 	struct ArchiveStrategy {
 	public:
 		virtual void archive(const fs::path& from) = 0;
@@ -78,6 +91,7 @@ private:
 
 	private:
 		void maintain_cleanup(PeriodicProcess& process);
+		void schedule_cleanup();
 
 		const fs::path archive_path_;
 		PeriodicProcess cleanup_process_;
@@ -91,6 +105,22 @@ private:
 	private:
 		const fs::path archive_path_;
 	};
+	class BlockArchive : public ArchiveStrategy {
+	public:
+		BlockArchive(Archive& parent);
+		virtual ~BlockArchive();
+		void archive(const fs::path& from);
+
+	private:
+		boost::signals2::scoped_connection outdated_meta_connection_;
+		PeriodicProcess cleanup_process_;
+
+		void stash_meta(const SignedMeta& smeta);
+		bool retain_chunks(const fs::path& from, const Meta& meta);
+		void release_revision(const Meta::PathRevision& revision);
+
+		void maintain_cleanup(PeriodicProcess& process);
+	};
 	std::unique_ptr<ArchiveStrategy> archive_strategy_;
 };
 
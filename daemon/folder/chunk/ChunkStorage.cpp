@@ -60,9 +60,13 @@ bool ChunkStorage::have_chunk(const blob& ct_hash) const noexcept {
 }
 
 blob ChunkStorage::get_chunk(const blob& ct_hash) {
+	return *get_chunk_ptr(ct_hash);
+}
+
+std::shared_ptr<blob> ChunkStorage::get_chunk_ptr(const blob& ct_hash) {
 	try {
 		// Cache hit
-		return *mem_storage->get_chunk(ct_hash);
+		return mem_storage->get_chunk(ct_hash);
 	}catch(AbstractFolder::no_such_chunk& e) {
 		// Cache missed
 		std::shared_ptr<blob> block_ptr;
@@ -75,7 +79,7 @@ blob ChunkStorage::get_chunk(const blob& ct_hash) {
 				throw;
 		}
 		mem_storage->put_chunk(ct_hash, block_ptr); // Put into cache
-		return *block_ptr;
+		return block_ptr;
 	}
 }
 
@@ -105,7 +109,37 @@ void ChunkStorage::cleanup(const Meta& meta) {
 	if(open_storage)
 		for(auto chunk : meta.chunks())
 			if(open_storage->have_chunk(chunk.ct_hash))
-				enc_storage->remove_chunk(chunk.ct_hash);
+				release_chunk(chunk.ct_hash);
+}
+
+void ChunkStorage::retain_chunk(const blob& ct_hash, const blob& chunk) {
+	enc_storage->put_chunk(ct_hash, chunk);
+}
+
+void ChunkStorage::release_chunk(const blob& ct_hash) {
+	// Chunks of archived revisions are kept until their last reference is expired
+	if(meta_storage_.index->db().exec("SELECT refcount FROM archive_chunk WHERE ct_hash=:ct_hash", {{":ct_hash", ct_hash}}).have_rows())
+		return;
+	// Chunk is still needed for assembling a file, and it cannot be extracted from open storage
+	if(!(open_storage && open_storage->have_chunk(ct_hash)) && !meta_storage_.index->containing_chunk(ct_hash).empty())
+		return;
+
+	enc_storage->remove_chunk(ct_hash);
+}
+
+std::list<Meta::PathRevision> ChunkStorage::get_archived_revisions() {
+	if(!file_assembler) return {};
+	return file_assembler->get_archived_revisions();
+}
+
+SignedMeta ChunkStorage::get_archived(const Meta::PathRevision& revision) {
+	if(!file_assembler) throw AbstractFolder::no_such_meta();
+	return file_assembler->get_archived(revision);
+}
+
+void ChunkStorage::restore(const Meta::PathRevision& revision, const fs::path& destination) {
+	if(!file_assembler) throw AbstractFolder::no_such_meta();
+	file_assembler->restore(revision, destination);
 }
 
 } /* namespace librevault */
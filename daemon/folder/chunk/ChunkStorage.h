@@ -29,7 +29,7 @@
 #pragma once
 #include "util/fs.h"
 #include "util/network.h"
-#include <librevault/Meta.h>
+#include <librevault/SignedMeta.h>
 #include <librevault/util/bitfield_convert.h>
 #include <boost/filesystem/path.hpp>
 #include <boost/signals2/signal.hpp>
@@ -55,12 +55,20 @@ public:
 
 	bool have_chunk(const blob& ct_hash) const noexcept ;
 	blob get_chunk(const blob& ct_hash);  // Throws AbstractFolder::no_such_chunk
+	std::shared_ptr<blob> get_chunk_ptr(const blob& ct_hash);  // Same, but without copying. Thread-safe
 	void put_chunk(const blob& ct_hash, const fs::path& chunk_location);
 
 	bitfield_type make_bitfield(const Meta& meta) const noexcept;   // Bulk version of "have_chunk"
 
 	void cleanup(const Meta& meta);
 
+	/* Archive support */
+	void retain_chunk(const blob& ct_hash, const blob& chunk);  // Puts chunk into EncStorage without announcing it
+	void release_chunk(const blob& ct_hash);    // Removes chunk from EncStorage, if it is not referenced by Index or archive anymore
+	std::list<Meta::PathRevision> get_archived_revisions();
+	SignedMeta get_archived(const Meta::PathRevision& revision);  // Throws AbstractFolder::no_such_meta
+	void restore(const Meta::PathRevision& revision, const fs::path& destination);  // Assembles an archived revision. Throws AbstractFolder::no_such_meta
+
 protected:
 	MetaStorage& meta_storage_;
 
@@ -79,6 +79,17 @@ void EncStorage::put_chunk(const blob& ct_hash, const fs::path& chunk_location)
 	LOGD("Encrypted block " << make_chunk_ct_name(ct_hash) << " pushed into EncStorage");
 }
 
+void EncStorage::put_chunk(const blob& ct_hash, const blob& chunk) {
+	auto chunk_location = params_.system_path / fs::unique_path("put-%%%%-%%%%-%%%%-%%%%");
+
+	file_wrapper chunk_file(chunk_location, "wb");
+	chunk_file.ios().exceptions(std::ios_base::failbit | std::ios_base::badbit);
+	chunk_file.ios().write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+	chunk_file.close();
+
+	put_chunk(ct_hash, chunk_location);
+}
+
 void EncStorage::remove_chunk(const blob& ct_hash) {
 	std::lock_guard<std::mutex> lk(storage_mtx_);
 	fs::remove(make_chunk_ct_path(ct_hash));
@@ -44,6 +44,7 @@ public:
 	bool have_chunk(const blob& ct_hash) const noexcept;
 	std::shared_ptr<blob> get_chunk(const blob& ct_hash) const;
 	void put_chunk(const blob& ct_hash, const boost::filesystem::path& chunk_location);
+	void put_chunk(const blob& ct_hash, const blob& chunk);
 	void remove_chunk(const blob& ct_hash);
 
 private:
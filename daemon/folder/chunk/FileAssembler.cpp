@@ -46,23 +46,13 @@ FileAssembler::FileAssembler(const FolderParams& params, MetaStorage& meta_stora
 	chunk_storage_(chunk_storage),
 	path_normalizer_(path_normalizer),
 	ios_(ios),
-	archive_(params_, meta_storage_, path_normalizer_, ios_),
+	archive_(params_, meta_storage_, chunk_storage_, path_normalizer_, ios_),
 	secret_(params_.secret),
 	assemble_process_(ios_, [this](PeriodicProcess& process){periodic_assemble_operation(process);}) {
 
 	assemble_process_.invoke();
 }
 
-blob FileAssembler::get_chunk_pt(const blob& ct_hash) const {
-	LOGT("get_chunk_pt(" << AbstractFolder::ct_hash_readable(ct_hash) << ")");
-	blob chunk = chunk_storage_.get_chunk(ct_hash);
-
-	for(auto row : meta_storage_.index->db().exec("SELECT size, iv FROM chunk WHERE ct_hash=:ct_hash", {{":ct_hash", ct_hash}})) {
-		return Meta::Chunk::decrypt(chunk, row[0].as_uint(), secret_.get_Encryption_Key(), row[1].as_blob());
-	}
-	throw AbstractFolder::no_such_chunk();
-}
-
 void FileAssembler::queue_assemble(const Meta& meta) {
 	assemble_queue_mtx_.lock();
 	if(assemble_queue_.find(meta.path_id()) == assemble_queue_.end()) {
@@ -80,6 +70,36 @@ void FileAssembler::queue_assemble(const Meta& meta) {
 	assemble_queue_mtx_.unlock();
 }
 
+std::list<Meta::PathRevision> FileAssembler::get_archived_revisions() {
+	return archive_.get_archived_revisions();
+}
+
+SignedMeta FileAssembler::get_archived(const Meta::PathRevision& revision) {
+	return archive_.get_archived(revision);
+}
+
+void FileAssembler::restore(const Meta::PathRevision& revision, const fs::path& destination) {
+	LOGFUNC();
+
+	Meta meta = archive_.get_archived(revision).meta();
+	if(!chunk_storage_.make_bitfield(meta).all())
+		throw AbstractFolder::no_such_chunk();
+
+	auto relpath = path_normalizer_.normalize_path(destination);
+	auto assembled_file = assemble_chunks(meta);
+
+	// Current version of the file goes to the archive, as if it were replaced by a remote
+	bool destination_exists = fs::exists(destination);
+	meta_storage_.prepare_assemble(relpath, Meta::FILE, destination_exists);
+
+	if(destination_exists)
+		archive_.archive(destination);
+	fs::create_directories(destination.parent_path());
+	fs::rename(assembled_file, destination);
+
+	meta_storage_.index_file(relpath);  // Restored version becomes a new revision
+}
+
 void FileAssembler::periodic_assemble_operation(PeriodicProcess& process) {
 	LOGFUNC();
 	LOGT("Performing periodic assemble");
@@ -178,19 +198,7 @@ bool FileAssembler::assemble_file(const Meta& meta) {
 	//
 	fs::path file_path = path_normalizer_.absolute_path(meta.path(secret_));
 	auto relpath = path_normalizer_.normalize_path(file_path);
-	auto assembled_file = params_.system_path / fs::unique_path("assemble-%%%%-%%%%-%%%%-%%%%");
-
-	// TODO: Check for assembled chunk and try to extract them and push into encstorage.
-	file_wrapper assembling_file(assembled_file, "wb"); // Opening file
-
-	for(auto chunk : meta.chunks()) {
-		blob chunk_pt = get_chunk_pt(chunk.ct_hash);
-		assembling_file.ios().write((const char*)chunk_pt.data(), chunk_pt.size());	// Writing to file
-	}
-
-	assembling_file.close();	// Closing file. Super!
-
-	fs::last_write_time(assembled_file, meta.mtime());
+	auto assembled_file = assemble_chunks(meta);
 
 	//dir_.ignore_list->add_ignored(relpath);
 	meta_storage_.prepare_assemble(relpath, Meta::FILE, fs::exists(file_path));
@@ -206,6 +214,24 @@ bool FileAssembler::assemble_file(const Meta& meta) {
 	return true;
 }
 
+fs::path FileAssembler::assemble_chunks(const Meta& meta) {
+	auto assembled_file = params_.system_path / fs::unique_path("assemble-%%%%-%%%%-%%%%-%%%%");
+
+	// TODO: Check for assembled chunk and try to extract them and push into encstorage.
+	file_wrapper assembling_file(assembled_file, "wb"); // Opening file
+
+	for(auto chunk : meta.chunks()) {
+		// Chunk properties are taken from Meta, as archived chunks may be absent in "chunk" table.
+		blob chunk_pt = Meta::Chunk::decrypt(chunk_storage_.get_chunk(chunk.ct_hash), chunk.size, secret_.get_Encryption_Key(), chunk.iv);
+		assembling_file.ios().write((const char*)chunk_pt.data(), chunk_pt.size());	// Writing to file
+	}
+
+	assembling_file.close();	// Closing file. Super!
+
+	fs::last_write_time(assembled_file, meta.mtime());
+	return assembled_file;
+}
+
 void FileAssembler::apply_attrib(const Meta& meta) {
 	fs::path file_path = path_normalizer_.absolute_path(meta.path(secret_));
 
@@ -30,6 +30,7 @@
 #include "Archive.h"
 #include "util/blob.h"
 #include "util/network.h"
+#include <librevault/Meta.h>
 #include <mutex>
 #include <set>
 
@@ -40,7 +41,6 @@ class PathNormalizer;
 class MetaStorage;
 class FolderParams;
 class ChunkStorage;
-class Meta;
 class Secret;
 
 class FileAssembler {
@@ -54,10 +54,13 @@ public:
 	FileAssembler(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, PathNormalizer& path_normalizer, io_service& ios);
 	virtual ~FileAssembler() {}
 
-	blob get_chunk_pt(const blob& ct_hash) const;
-
 	// File assembler
 	void queue_assemble(const Meta& meta);
+
+	// Archive
+	std::list<Meta::PathRevision> get_archived_revisions();
+	SignedMeta get_archived(const Meta::PathRevision& revision);
+	void restore(const Meta::PathRevision& revision, const fs::path& destination);
 	//void disassemble(const std::string& file_path, bool delete_file = true);
 
 private:
@@ -83,6 +86,7 @@ private:
 	bool assemble_symlink(const Meta& meta);
 	bool assemble_directory(const Meta& meta);
 	bool assemble_file(const Meta& meta);
+	fs::path assemble_chunks(const Meta& meta);
 
 	void apply_attrib(const Meta& meta);
 };
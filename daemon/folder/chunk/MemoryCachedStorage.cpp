@@ -34,10 +34,12 @@ namespace librevault {
 MemoryCachedStorage::MemoryCachedStorage(ChunkStorage& chunk_storage) : AbstractStorage(chunk_storage) {}
 
 bool MemoryCachedStorage::have_chunk(const blob& ct_hash) const noexcept {
+	std::lock_guard<std::mutex> lk(cache_mtx_);
 	return cache_iteraror_map_.find(ct_hash) != cache_iteraror_map_.end();
 }
 
 std::shared_ptr<blob> MemoryCachedStorage::get_chunk(const blob& ct_hash) const {
+	std::lock_guard<std::mutex> lk(cache_mtx_);
 	auto it = cache_iteraror_map_.find(ct_hash);
 	if(it == cache_iteraror_map_.end()) {
 		throw AbstractFolder::no_such_chunk();
@@ -48,6 +50,7 @@ std::shared_ptr<blob> MemoryCachedStorage::get_chunk(const blob& ct_hash) const
 }
 
 void MemoryCachedStorage::put_chunk(const blob& ct_hash, std::shared_ptr<blob> data) {
+	std::lock_guard<std::mutex> lk(cache_mtx_);
 	auto it = cache_iteraror_map_.find(ct_hash);
 	if(it != cache_iteraror_map_.end()) {
 		cache_list_.erase(it->second);
@@ -66,6 +69,7 @@ void MemoryCachedStorage::put_chunk(const blob& ct_hash, std::shared_ptr<blob> d
 }
 
 void MemoryCachedStorage::remove_chunk(const blob& ct_hash) noexcept {
+	std::lock_guard<std::mutex> lk(cache_mtx_);
 	auto iterator_to_iterator = cache_iteraror_map_.find(ct_hash);
 	if(iterator_to_iterator != cache_iteraror_map_.end()) {
 		cache_list_.erase(iterator_to_iterator->second);
@@ -30,10 +30,12 @@
 #include "AbstractStorage.h"
 #include <map>
 #include <list>
+#include <mutex>
 
 namespace librevault {
 
-// Cache implemented as a simple LRU structure over doubly-linked list and associative container (std::map, in this case)
+// Cache implemented as a simple LRU structure over doubly-linked list and associative container (std::map, in this case).
+// Thread-safe, as chunks are loaded into it from the bulk io_service
 class MemoryCachedStorage : public AbstractStorage {
 public:
 	MemoryCachedStorage(ChunkStorage& chunk_storage);
@@ -48,6 +50,7 @@ private:
 	using ct_hash_data_type = std::pair<blob, std::shared_ptr<blob>>;
 	using list_iterator_type = std::list<ct_hash_data_type>::iterator;
 
+	mutable std::mutex cache_mtx_;
 	mutable std::list<ct_hash_data_type> cache_list_;
 	std::map<blob, list_iterator_type> cache_iteraror_map_;
 
@@ -58,6 +58,18 @@ Index::Index(const FolderParams& params) : params_(params) {
 	db_->exec("CREATE INDEX IF NOT EXISTS openfs_assembled_idx ON openfs (ct_hash, assembled) WHERE assembled = 1;");    // For faster OpenStorage::have_chunk
 	db_->exec("CREATE INDEX IF NOT EXISTS openfs_path_id_fki ON openfs (path_id);");    // For faster FileAssembler::assemble_file
 	db_->exec("CREATE IF NOT EXISTS INDEX openfs_ct_hash_fki ON openfs (ct_hash);");    // For faster Index::containing_chunk
+	/* TABLE archive_meta */
+	db_->exec("CREATE TABLE IF NOT EXISTS archive_meta (path_id BLOB NOT NULL, revision INTEGER NOT NULL, meta BLOB NOT NULL, signature BLOB NOT NULL, archived INTEGER, PRIMARY KEY (path_id, revision));");
+	db_->exec("CREATE INDEX IF NOT EXISTS archive_meta_archived_idx ON archive_meta (archived);");    // For faster expiration in BlockArchive
+
+	/* TABLE archive_chunk */
+	db_->exec("CREATE TABLE IF NOT EXISTS archive_chunk (ct_hash BLOB NOT NULL PRIMARY KEY, refcount INTEGER NOT NULL);");
+
+	/* TABLE archive_file */
+	db_->exec("CREATE TABLE IF NOT EXISTS archive_file (archived_path TEXT NOT NULL PRIMARY KEY, path TEXT NOT NULL, archived INTEGER NOT NULL);");
+	db_->exec("CREATE INDEX IF NOT EXISTS archive_file_archived_idx ON archive_file (archived);");    // For faster expiration in TrashArchive
+	db_->exec("CREATE INDEX IF NOT EXISTS archive_file_path_idx ON archive_file (path, archived);");    // For faster version lookup in TimestampArchive
+
 	//db_->exec("CREATE TRIGGER IF NOT EXISTS chunk_deleter AFTER DELETE ON openfs BEGIN DELETE FROM chunk WHERE ct_hash NOT IN (SELECT ct_hash FROM openfs); END;");   // Damn, there are more problems with this trigger than profit from it. Anyway, we can add it anytime later.
 
 	/* Create a special hash-file */
@@ -96,6 +108,11 @@ void Index::put_meta(const SignedMeta& signed_meta, bool fully_assembled) {
 	std::ostringstream transaction_name; transaction_name << "put_Meta_" << std::this_thread::get_id();
 	SQLiteSavepoint raii_transaction(*db_, transaction_name.str()); // Begin transaction
 
+	if(!fully_assembled) {
+		for(auto& outdated_smeta : get_meta("SELECT meta, signature FROM meta WHERE path_id=:path_id AND type=0 AND assembled=1", {{":path_id", signed_meta.meta().path_id()}}))
+			outdated_meta_signal(outdated_smeta);
+	}
+
 	db_->exec("INSERT OR REPLACE INTO meta (path_id, meta, signature, type, assembled) VALUES (:path_id, :meta, :signature, :type, :assembled);", {
 			{":path_id", signed_meta.meta().path_id()},
 			{":meta", signed_meta.raw_meta()},
@@ -104,6 +121,9 @@ void Index::put_meta(const SignedMeta& signed_meta, bool fully_assembled) {
 			{":assembled", (uint64_t)fully_assembled}
 	});
 
+	// Chunks of the previous revision must not be attributed to this path anymore
+	db_->exec("DELETE FROM openfs WHERE path_id=:path_id;", {{":path_id", signed_meta.meta().path_id()}});
+
 	uint64_t offset = 0;
 	for(auto chunk : signed_meta.meta().chunks()){
 		db_->exec("INSERT OR IGNORE INTO chunk (ct_hash, size, iv) VALUES (:ct_hash, :size, :iv);", {
@@ -178,6 +198,8 @@ void Index::wipe() {
 	db_->exec("DELETE FROM meta");
 	db_->exec("DELETE FROM chunk");
 	db_->exec("DELETE FROM openfs");
+	db_->exec("DELETE FROM archive_meta");
+	db_->exec("DELETE FROM archive_chunk");
 	savepoint.commit();
 	db_->exec("VACUUM");
 }
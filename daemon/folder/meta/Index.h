@@ -48,6 +48,7 @@ public:
 
 	boost::signals2::signal<void(const SignedMeta&)> new_meta_signal;
 	boost::signals2::signal<void(const Meta&)> assemble_meta_signal;
+	boost::signals2::signal<void(const SignedMeta&)> outdated_meta_signal;	// Assembled Meta, which is about to be replaced by a newer remote revision
 
 	Index(const FolderParams& params);
 	virtual ~Index() {}
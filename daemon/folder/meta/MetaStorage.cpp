@@ -52,4 +52,8 @@ void MetaStorage::prepare_assemble(const std::string relpath, Meta::Type type, b
 	if(auto_indexer_) auto_indexer_->prepare_assemble(relpath, type, with_removal);
 }
 
+void MetaStorage::index_file(const std::string& relpath) {
+	if(indexer_) indexer_->async_index(relpath);
+}
+
 } /* namespace librevault */
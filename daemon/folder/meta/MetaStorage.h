@@ -46,6 +46,7 @@ public:
 
 	bool is_indexing() const;
 	void prepare_assemble(const std::string relpath, Meta::Type type, bool with_removal = false);
+	void index_file(const std::string& relpath);    // Indexes the file, even if its events were suppressed by prepare_assemble
 
 	std::unique_ptr<Index> index;
 
@@ -34,226 +34,494 @@
 #include "folder/chunk/ChunkStorage.h"
 #include "folder/meta/Index.h"
 #include "folder/meta/MetaStorage.h"
+#include "util/FileDescriptorCache.h"
 #include "util/fs.h"
 #include <librevault/crypto/Base32.h>
+#include <boost/endian/arithmetic.hpp>
 #include <boost/range/adaptor/map.hpp>
+#include <cryptopp/sha.h>
+#include <cryptopp/sha3.h>
+#include <algorithm>
+#include <limits>
 
 namespace librevault {
 
-/* GlobalFilePool */
-std::shared_ptr<file_wrapper> GlobalFilePool::get_file(const boost::filesystem::path& chunk_path) {
-	auto file_ptr = cache_[chunk_path].lock();
-	if(!file_ptr)
-		file_ptr = std::make_shared<file_wrapper>(chunk_path, "r+b");
-
-	release_file(chunk_path);
-	retain_file(chunk_path, file_ptr);
-
-	return file_ptr;
-}
-
-void GlobalFilePool::release_file(const boost::filesystem::path& system_path) {
-	auto it = cache_.find(system_path);
-	if(it != cache_.end()) {
-		std::shared_ptr<file_wrapper> file_ptr = it->second.lock();
-		opened_files_.erase(std::remove(opened_files_.begin(), opened_files_.end(), file_ptr), opened_files_.end());
-		cache_.erase(it);
+/* ChunkBufferPool */
+std::shared_ptr<blob> ChunkBufferPool::get_buffer(uint32_t size) {
+	std::unique_lock<std::mutex> lk(free_buffers_mtx_);
+	std::shared_ptr<blob> buffer;
+	if(free_buffers_.empty())
+		buffer = std::make_shared<blob>();
+	else{
+		buffer = free_buffers_.front();
+		free_buffers_.pop_front();
 	}
+	lk.unlock();
+
+	buffer->resize(size);
+	return buffer;
 }
 
-void GlobalFilePool::retain_file(boost::filesystem::path chunk_path, std::shared_ptr<file_wrapper> retained_file) {
-	cache_[chunk_path] = retained_file;
-	opened_files_.push_front(retained_file);
+void ChunkBufferPool::put_buffer(std::shared_ptr<blob> buffer) {
+	std::lock_guard<std::mutex> lk(free_buffers_mtx_);
+	free_buffers_.push_front(buffer);
 	while(overflow())
-		opened_files_.pop_back();
+		free_buffers_.pop_back();
 }
 
 /* MissingChunk */
-MissingChunk::MissingChunk(const fs::path& system_path, blob ct_hash, uint32_t size) : ct_hash_(std::move(ct_hash)), file_map_(size) {
+MissingChunk::MissingChunk(const fs::path& system_path, blob ct_hash, uint32_t size, Meta::StrongHashType strong_hash_type, ScopedAsyncQueue& disk_queue, ChunkBufferPool* buffer_pool) :
+		ct_hash_(std::move(ct_hash)), file_map_(size), buffer_pool_(buffer_pool), disk_queue_(disk_queue), strong_hash_type_(strong_hash_type) {
 	this_chunk_path_ = system_path / (std::string("incomplete-") + crypto::Base32().to_string(ct_hash_));
+	this_journal_path_ = system_path / (std::string("incomplete-") + crypto::Base32().to_string(ct_hash_) + ".journal");
+
+	switch(strong_hash_type_) {
+		case Meta::SHA3_224: hasher_ = std::make_unique<CryptoPP::SHA3_224>(); break;
+		case Meta::SHA2_224: hasher_ = std::make_unique<CryptoPP::SHA224>(); break;
+		default: break; // Verified in one pass, when complete
+	}
 
-	file_wrapper f(this_chunk_path_, "wb");
-	f.close();
-	fs::resize_file(this_chunk_path_, size);
+	if(buffer_pool_ || !load_journal())
+		reset();
+}
+
+MissingChunk::~MissingChunk() {
+	if(buffer_)
+		buffer_pool_->put_buffer(buffer_);
 }
 
 fs::path MissingChunk::release_chunk() {
-	GlobalFilePool::get_instance()->release_file(this_chunk_path_);
+	if(buffer_) {
+		try {
+			file_wrapper chunk_file(this_chunk_path_, "wb");
+			chunk_file.ios().exceptions(std::ios_base::failbit | std::ios_base::badbit);
+			chunk_file.ios().write((char*)buffer_->data(), size());
+			chunk_file.ios().flush();
+			chunk_file.close();
+		}catch(std::exception& e) {
+			// Truncated file must not get into EncStorage, the chunk is downloaded again
+			*disk_failed_ = true;
+			boost::system::error_code ec;
+			fs::remove(this_chunk_path_, ec);
+
+			buffer_pool_->put_buffer(buffer_);
+			buffer_.reset();
+			allocated_ = false;
+			throw;
+		}
+
+		buffer_pool_->put_buffer(buffer_);
+		buffer_.reset();
+	}else{
+		// Single fsync per chunk, before it is moved into EncStorage
+		FileDescriptorCache::get_instance()->sync(this_chunk_path_);
+		FileDescriptorCache::get_instance()->release(this_chunk_path_);
+		FileDescriptorCache::get_instance()->release(this_journal_path_);
+		fs::remove(this_journal_path_);
+	}
+	allocated_ = false; // Chunk is downloaded again from scratch, if ChunkStorage fails to take it
 	return this_chunk_path_;
 }
 
-void MissingChunk::put_block(uint32_t offset, const blob& content) {
+void MissingChunk::put_block(uint32_t offset, const shared_buffer& content) {
 	auto inserted = file_map_.insert({offset, content.size()}).second;
 	if(inserted) {
-		auto file_ptr = GlobalFilePool::get_instance()->get_file(this_chunk_path_);
-		if(file_ptr->ios().tellp() != offset)
-			file_ptr->ios().seekp(offset);
-		file_ptr->ios().write((char*)content.data(), content.size());
+		if(!allocated_) allocate();
+
+		if(buffer_) {
+			std::copy(content.begin(), content.end(), buffer_->begin() + offset);
+		}else{
+			uint64_t journal_offset = journal_size_;
+			journal_size_ += 2*sizeof(boost::endian::big_uint32_t);
+
+			disk_queue_.invoke_post([chunk_path = this_chunk_path_, journal_path = this_journal_path_, journal_offset, offset, content, disk_failed = disk_failed_]{
+				try {
+					FileDescriptorCache::get_instance()->write(chunk_path, offset, content.data(), content.size());
+
+					// Journal is appended after the data. If they get out of sync after crash, the chunk will fail verification.
+					boost::endian::big_uint32_t journal_record[2] = {offset, (uint32_t)content.size()};
+					FileDescriptorCache::get_instance()->write(journal_path, journal_offset, (const uint8_t*)journal_record, sizeof(journal_record));
+				}catch(std::exception& e) {
+					*disk_failed = true;
+				}
+			});
+		}
+
+		feed_hasher(offset, content);
+	}
+}
+
+void MissingChunk::allocate() {
+	if(buffer_pool_) {
+		buffer_ = buffer_pool_->get_buffer(size());
+	}else{
+		disk_queue_.invoke_post([chunk_path = this_chunk_path_, size = size(), disk_failed = disk_failed_]{
+			try {
+				FileDescriptorCache::get_instance()->release(chunk_path);
+				file_wrapper f(chunk_path, "wb");
+				f.close();
+				fs::resize_file(chunk_path, size);
+			}catch(std::exception& e) {
+				*disk_failed = true;
+			}
+		});
+		create_journal();
+	}
+	allocated_ = true;
+}
+
+bool MissingChunk::load_journal() {
+	try {
+		if(!fs::exists(this_journal_path_) || !fs::exists(this_chunk_path_) || fs::file_size(this_chunk_path_) != size())
+			return false;
+
+		file_wrapper journal(this_journal_path_, "rb");
+		boost::endian::big_uint32_t journal_header;
+		journal.ios().read((char*)&journal_header, sizeof(journal_header));
+		if(!journal.ios() || journal_header != size())
+			return false;
+
+		std::map<uint32_t, uint32_t> received_blocks;
+		boost::endian::big_uint32_t journal_record[2];
+		journal_size_ = sizeof(journal_header);
+		while(journal.ios().read((char*)journal_record, sizeof(journal_record))) {
+			journal_size_ += sizeof(journal_record);    // Incomplete trailing record will be overwritten
+			if(file_map_.insert({journal_record[0], journal_record[1]}).second)
+				received_blocks.insert({journal_record[0], journal_record[1]});
+		}
+
+		// Restore hasher state from received data
+		for(auto& received_block : received_blocks) {
+			blob content(received_block.second);
+			if(!FileDescriptorCache::get_instance()->read(this_chunk_path_, received_block.first, content.data(), content.size()))
+				return false;
+			feed_hasher(received_block.first, shared_buffer(std::move(content)));
+		}
+		allocated_ = true;
+		return true;
+	}catch(std::exception& e) {
+		return false;
 	}
 }
 
+void MissingChunk::create_journal() {
+	journal_size_ = sizeof(boost::endian::big_uint32_t);
+
+	disk_queue_.invoke_post([journal_path = this_journal_path_, size = size(), disk_failed = disk_failed_]{
+		try {
+			FileDescriptorCache::get_instance()->release(journal_path);
+
+			boost::endian::big_uint32_t journal_header = size;
+			file_wrapper journal(journal_path, "wb");
+			journal.ios().write((char*)&journal_header, sizeof(journal_header));
+		}catch(std::exception& e) {
+			*disk_failed = true;
+		}
+	});
+}
+
+void MissingChunk::feed_hasher(uint32_t offset, const shared_buffer& content) {
+	if(!hasher_) return;
+
+	if(buffer_) {
+		// Out-of-order blocks are in the buffer already
+		uint32_t contiguous_end = file_map_.full() ? size() : file_map_.begin()->first;
+		if(contiguous_end > hashed_offset_)
+			hash_block(buffer_->data() + hashed_offset_, contiguous_end - hashed_offset_);
+	}else if(offset == hashed_offset_) {
+		hash_block(content.data(), content.size());
+		// Feed blocks, that became contiguous
+		for(auto it = pending_blocks_.find(hashed_offset_); it != pending_blocks_.end(); it = pending_blocks_.find(hashed_offset_)) {
+			hash_block(it->second.data(), it->second.size());
+			pending_blocks_.erase(it);
+		}
+	}else
+		pending_blocks_.insert({offset, content});
+}
+
+void MissingChunk::hash_block(const uint8_t* data, size_t size) {
+	hasher_->Update(data, size);
+	hashed_offset_ += size;
+}
+
+bool MissingChunk::verify_hashed() {
+	if(!complete() || !hasher_ || hashed_offset_ != size()) return false;
+
+	blob digest(hasher_->DigestSize());
+	hasher_->Final(digest.data());
+	return digest == ct_hash_;
+}
+
+bool MissingChunk::verify_stored() {
+	// Confirm with Meta's own hash implementation before discarding downloaded data.
+	if(buffer_)
+		return Meta::Chunk::compute_strong_hash(*buffer_, strong_hash_type_) == ct_hash_;
+
+	blob chunk(size());
+	return FileDescriptorCache::get_instance()->read(this_chunk_path_, 0, chunk.data(), chunk.size())
+		&& Meta::Chunk::compute_strong_hash(chunk, strong_hash_type_) == ct_hash_;
+}
+
+void MissingChunk::reset() {
+	file_map_ = AvailabilityMap<uint32_t>(file_map_.size_original());
+	contributors.clear();
+
+	if(hasher_) hasher_->Restart();
+	hashed_offset_ = 0;
+	pending_blocks_.clear();
+
+	if(allocated_ && !buffer_) {
+		// Failed writes are behind this point in disk_queue_, so the new attempt starts clean
+		disk_queue_.invoke_post([disk_failed = disk_failed_]{*disk_failed = false;});
+		create_journal();
+	}else
+		*disk_failed_ = false;
+}
+
 /* WeightedDownloadQueue */
-float WeightedDownloadQueue::Weight::value() const {
+float WeightedDownloadQueue::Weight::value(size_t remotes_count) const {
 	float weight_value = 0;
 
 	weight_value += CLUSTERED_COEFFICIENT * (clustered ? 1 : 0);
-	weight_value += IMMEDIATE_COEFFICIENT * (immediate ? 1 : 0);
-	float rarity = (float)(remotes_count - owned_by) / (float)remotes_count;
-	weight_value += rarity * RARITY_COEFFICIENT;
+	weight_value += COMPLETION_COEFFICIENT * completion / (COMPLETION_LEVELS - 1);
+	if(remotes_count > 0) {
+		float rarity = (float)(remotes_count - std::min(owned_by, remotes_count)) / (float)remotes_count;
+		weight_value += rarity * RARITY_COEFFICIENT;
+	}
 
 	return weight_value;
 }
 
-WeightedDownloadQueue::Weight WeightedDownloadQueue::get_current_weight(std::shared_ptr<MissingChunk> chunk) {
-	auto it = weight_ordered_chunks_.left.find(chunk);
-	if(it != weight_ordered_chunks_.left.end())
-		return it->second;
-	else
-		return Weight();
+void WeightedDownloadQueue::place_chunk(ChunkPosition& position, std::shared_ptr<MissingChunk> chunk) {
+	auto bucket_it = buckets_.find(position.weight);
+	if(bucket_it == buckets_.end()) {
+		bucket_it = buckets_.emplace(position.weight, bucket_t()).first;
+		ordered_buckets_valid_ = false;
+	}
+
+	bucket_it->second.push_back(chunk);
+	position.bucket = bucket_it;
+	position.position = std::prev(bucket_it->second.end());
+}
+
+void WeightedDownloadQueue::unplace_chunk(ChunkPosition& position) {
+	auto bucket_it = position.bucket;
+	bucket_it->second.erase(position.position);
+	if(bucket_it->second.empty()) {
+		buckets_.erase(bucket_it);
+		ordered_buckets_valid_ = false;
+	}
 }
 
-void WeightedDownloadQueue::reweight_chunk(std::shared_ptr<MissingChunk> chunk, Weight new_weight) {
-	auto chunk_it = weight_ordered_chunks_.left.find(chunk);
+void WeightedDownloadQueue::reweight_chunk(positions_t::iterator position_it, Weight new_weight) {
+	ChunkPosition& position = position_it->second;
+	if(!(position.weight < new_weight) && !(new_weight < position.weight)) return;
 
-	if(chunk_it != weight_ordered_chunks_.left.end() && chunk_it->second != new_weight) {
-		weight_ordered_chunks_.left.erase(chunk_it);
-		weight_ordered_chunks_.left.insert(queue_left_value(chunk, new_weight));
+	if(position.immediate_seq) {
+		position.weight = new_weight;   // Immediate chunks are not bucketed
+	}else{
+		unplace_chunk(position);
+		position.weight = new_weight;
+		place_chunk(position, position_it->first);
 	}
 }
 
+const std::vector<std::map<WeightedDownloadQueue::Weight, WeightedDownloadQueue::bucket_t>::const_iterator>& WeightedDownloadQueue::ordered_buckets() const {
+	if(!ordered_buckets_valid_) {
+		ordered_buckets_.clear();
+		ordered_buckets_.reserve(buckets_.size());
+		for(auto bucket_it = buckets_.cbegin(); bucket_it != buckets_.cend(); ++bucket_it)
+			ordered_buckets_.push_back(bucket_it);
+
+		size_t remotes_count = remotes_count_;
+		std::stable_sort(ordered_buckets_.begin(), ordered_buckets_.end(), [remotes_count](std::map<Weight, bucket_t>::const_iterator a, std::map<Weight, bucket_t>::const_iterator b){
+			return a->first.value(remotes_count) > b->first.value(remotes_count);
+		});
+		ordered_buckets_valid_ = true;
+	}
+	return ordered_buckets_;
+}
+
 void WeightedDownloadQueue::add_chunk(std::shared_ptr<MissingChunk> chunk) {
-	weight_ordered_chunks_.left.insert(queue_left_value(chunk, Weight()));
+	if(chunk_positions_.find(chunk) != chunk_positions_.end()) return;
+
+	auto& position = chunk_positions_[chunk];
+	place_chunk(position, chunk);
 }
 
 void WeightedDownloadQueue::remove_chunk(std::shared_ptr<MissingChunk> chunk) {
-	weight_ordered_chunks_.left.erase(chunk);
+	auto position_it = chunk_positions_.find(chunk);
+	if(position_it == chunk_positions_.end()) return;
+
+	if(position_it->second.immediate_seq)
+		immediate_chunks_.erase(position_it->second.immediate_seq);
+	else
+		unplace_chunk(position_it->second);
+	chunk_positions_.erase(position_it);
 }
 
 void WeightedDownloadQueue::set_overall_remotes_count(size_t count) {
-	weight_ordered_chunks_t new_queue;
-	for(auto& entry : weight_ordered_chunks_.left) {
-		std::shared_ptr<MissingChunk> chunk = entry.first;
-		Weight weight = entry.second;
-
-		weight.remotes_count = count;
-		new_queue.left.insert(queue_left_value(chunk, weight));
+	if(remotes_count_ != count) {
+		remotes_count_ = count;
+		ordered_buckets_valid_ = false;
 	}
-	weight_ordered_chunks_ = new_queue;
 }
 
 void WeightedDownloadQueue::set_chunk_remotes_count(std::shared_ptr<MissingChunk> chunk, size_t count) {
-	Weight weight = get_current_weight(chunk);
-	weight.remotes_count = count;
+	auto position_it = chunk_positions_.find(chunk);
+	if(position_it == chunk_positions_.end()) return;
 
-	reweight_chunk(chunk, weight);
+	Weight weight = position_it->second.weight;
+	weight.owned_by = count;
+	reweight_chunk(position_it, weight);
 }
 
-void WeightedDownloadQueue::mark_clustered(std::shared_ptr<MissingChunk> chunk) {
-	Weight weight = get_current_weight(chunk);
-	weight.clustered = true;
+void WeightedDownloadQueue::set_chunk_completion(std::shared_ptr<MissingChunk> chunk, bool clustered, unsigned completion) {
+	auto position_it = chunk_positions_.find(chunk);
+	if(position_it == chunk_positions_.end()) return;
 
-	reweight_chunk(chunk, weight);
+	Weight weight = position_it->second.weight;
+	weight.clustered = clustered;
+	weight.completion = completion;
+	reweight_chunk(position_it, weight);
 }
 
 void WeightedDownloadQueue::mark_immediate(std::shared_ptr<MissingChunk> chunk) {
-	Weight weight = get_current_weight(chunk);
-	weight.immediate = true;
+	auto position_it = chunk_positions_.find(chunk);
+	if(position_it == chunk_positions_.end() || position_it->second.immediate_seq) return;
 
-	reweight_chunk(chunk, weight);
+	unplace_chunk(position_it->second);
+	position_it->second.immediate_seq = ++last_immediate_seq_;
+	immediate_chunks_.insert({position_it->second.immediate_seq, chunk});
 }
 
-std::list<std::shared_ptr<MissingChunk>> WeightedDownloadQueue::chunks() const {
-	std::list<std::shared_ptr<MissingChunk>> chunk_list;
-	for(auto& chunk_ptr : boost::adaptors::values(weight_ordered_chunks_.right))
-		chunk_list.push_back(chunk_ptr);
-	return chunk_list;
+bool WeightedDownloadQueue::immediate(std::shared_ptr<MissingChunk> chunk) const {
+	auto position_it = chunk_positions_.find(chunk);
+	return position_it != chunk_positions_.end() && position_it->second.immediate_seq;
+}
+
+void WeightedDownloadQueue::unmark_immediate(std::shared_ptr<MissingChunk> chunk) {
+	auto position_it = chunk_positions_.find(chunk);
+	if(position_it == chunk_positions_.end() || !position_it->second.immediate_seq) return;
+
+	immediate_chunks_.erase(position_it->second.immediate_seq);
+	position_it->second.immediate_seq = 0;
+	place_chunk(position_it->second, chunk);
 }
 
 /* Downloader */
-Downloader::Downloader(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, io_service& ios) :
-	params_(params), meta_storage_(meta_storage), chunk_storage_(chunk_storage),
-	periodic_maintain_(ios, [this](PeriodicProcess& process){maintain_requests(process);}) {
+Downloader::Downloader(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, monitored_strand& serial_strand, io_service& bulk_ios) :
+	params_(params), meta_storage_(meta_storage), chunk_storage_(chunk_storage), serial_strand_(serial_strand),
+	disk_queue_(bulk_ios),
+	serial_queue_(serial_strand.get_io_service(), serial_strand.strand()),
+	periodic_maintain_(serial_strand.get_io_service(), serial_strand.strand(), [this](PeriodicProcess& process){maintain_requests(process);}) {
 	LOGFUNC();
+	FileDescriptorCache::get_instance()->set_budget(Config::get()->global_get("p2p_download_open_files").asUInt());
 	periodic_maintain_.invoke();
 }
 
 Downloader::~Downloader() {
+	disk_queue_.wait();
+	serial_queue_.wait();   // Disk work posts its results here, and they may invoke periodic_maintain_
 	periodic_maintain_.wait();
 }
 
 void Downloader::notify_local_meta(const SignedMeta& smeta, const bitfield_type& bitfield) {
 	LOGFUNC();
 
-	bool incomplete_meta = false;
+	const blob& path_id = smeta.meta().path_id();
+	remove_file(path_id);   // Older revision
+
+	FileProgress progress;
+	progress.chunks = smeta.meta().chunks().size();
 
 	for(size_t chunk_idx = 0; chunk_idx < smeta.meta().chunks().size(); chunk_idx++) {
 		auto& chunk = smeta.meta().chunks().at(chunk_idx);
 		auto& ct_hash = chunk.ct_hash;
 		if(bitfield[chunk_idx]) {
 			// We have chunk, remove from missing
-			notify_local_chunk(ct_hash, false); // Do not mark connected chunks as clustered, because they will be marked inside the loop below.
-			incomplete_meta = true;
+			notify_local_chunk(ct_hash);
 		}else{
 			// We haven't this chunk, we need to download it
 
 			/* Compute encrypted chunk size */
 			uint32_t padded_chunksize = chunk.size % 16 == 0 ? chunk.size : ((chunk.size / 16) + 1) * 16;
 
-			auto missing_chunk = std::make_shared<MissingChunk>(params_.system_path, ct_hash, padded_chunksize);
-			missing_chunks_.insert({ct_hash, missing_chunk});
+			auto missing_chunk_it = missing_chunks_.find(ct_hash);
+			if(missing_chunk_it == missing_chunks_.end()) {
+				bool in_memory = padded_chunksize < Config::get()->global_get("p2p_download_memory_chunk_size").asUInt();
+				auto missing_chunk = std::make_shared<MissingChunk>(params_.system_path, ct_hash, padded_chunksize, smeta.meta().strong_hash_type(), disk_queue_, in_memory ? &buffer_pool_ : nullptr);
+				missing_chunk_it = missing_chunks_.insert({ct_hash, missing_chunk}).first;
+				if(missing_chunk->started())
+					partial_chunks_.insert(missing_chunk);
+				if(!missing_chunk->file_map().empty())
+					LOGD("Resuming download of " << AbstractFolder::ct_hash_readable(ct_hash) << ", " << missing_chunk->file_map().size_left() << " bytes left");
+
+				/* Add to download queue */
+				download_queue_.add_chunk(missing_chunk);
+			}
 
-			/* Add to download queue */
-			download_queue_.add_chunk(missing_chunk);
-			if(incomplete_meta)
-				download_queue_.mark_clustered(missing_chunk);
+			missing_chunk_it->second->files.insert(path_id);
+			progress.missing.insert(missing_chunk_it->second);
 		}
 	}
+
+	if(progress.missing.empty()) return;
+	auto& inserted_progress = files_.insert({path_id, std::move(progress)}).first->second;
+	update_file(path_id, inserted_progress, false, 0);
+	for(auto& missing_chunk : inserted_progress.missing)
+		update_chunk_completion(missing_chunk);
 }
 
-void Downloader::notify_local_chunk(const blob& ct_hash, bool mark_clustered) {
+void Downloader::notify_local_chunk(const blob& ct_hash) {
 	LOGFUNC();
 
 	// Remove from missing
 	auto missing_chunk_it = missing_chunks_.find(ct_hash);
-	if(missing_chunk_it != missing_chunks_.end()) {
-		download_queue_.remove_chunk(missing_chunk_it->second);
-		missing_chunks_.erase(missing_chunk_it);
-	}
-
-	// Mark all other chunks "clustered"
-	if(mark_clustered) {
-		for(auto& smeta : meta_storage_.index->containing_chunk(ct_hash)) {
-			for(auto& chunk : smeta.meta().chunks()) {
-				auto it = missing_chunks_.find(chunk.ct_hash);
-				if(it != missing_chunks_.end())
-					download_queue_.mark_clustered(it->second);
-			}
-		}
+	if(missing_chunk_it == missing_chunks_.end()) return;
+	auto missing_chunk = missing_chunk_it->second;
+
+	cancel_requests(missing_chunk);
+	download_queue_.remove_chunk(missing_chunk);
+	partial_chunks_.erase(missing_chunk);
+	missing_chunks_.erase(missing_chunk_it);
+	for(auto& owner_remote : missing_chunk->owned_by) {
+		auto remote_it = remotes_.find(owner_remote.first);
+		if(remote_it != remotes_.end())
+			remote_it->second.owned_chunks--;
+	}
+	prioritized_chunks_ = download_queue_.immediate_size();
+
+	// Files, containing this chunk, are closer to completion now
+	for(auto& path_id : missing_chunk->files) {
+		auto file_it = files_.find(path_id);
+		if(file_it == files_.end()) continue;
+
+		bool was_incomplete = file_it->second.incomplete();
+		unsigned old_completion = file_it->second.completion();
+		file_it->second.missing.erase(missing_chunk);
+
+		update_file(path_id, file_it->second, was_incomplete, old_completion);
 	}
 }
 
-void Downloader::notify_remote_meta(std::shared_ptr<RemoteFolder> remote, const Meta::PathRevision& revision, bitfield_type bitfield) {
+void Downloader::notify_remote_meta(std::shared_ptr<RemoteFolder> remote, const Meta& meta, bitfield_type bitfield) {
 	LOGFUNC();
-	try {
-		auto chunks = meta_storage_.index->get_meta(revision).meta().chunks();
-		for(size_t chunk_idx = 0; chunk_idx < chunks.size(); chunk_idx++)
-			if(bitfield[chunk_idx])
-				notify_remote_chunk(remote, chunks[chunk_idx].ct_hash);
-		remotes_.insert(remote);
-		download_queue_.set_overall_remotes_count(remotes_.size());
-	}catch(AbstractFolder::no_such_meta){
-		LOGD("Expired Meta");
-		// Well, remote node notifies us about expired meta. It was not requested by us OR another peer sent us newer meta, so this had been expired.
-		// Nevertheless, ignore this notification.
-	}
+	auto& chunks = meta.chunks();
+	for(size_t chunk_idx = 0; chunk_idx < chunks.size() && chunk_idx < bitfield.size(); chunk_idx++)
+		if(bitfield[chunk_idx])
+			notify_remote_chunk(remote, chunks[chunk_idx].ct_hash);
 }
 void Downloader::notify_remote_chunk(std::shared_ptr<RemoteFolder> remote, const blob& ct_hash) {
 	LOGFUNC();
+	if(remotes_.find(remote) == remotes_.end()) return;
+
 	auto missing_chunk_it = missing_chunks_.find(ct_hash);
 	if(missing_chunk_it == missing_chunks_.end()) return;
 
 	auto missing_chunk = missing_chunk_it->second;
-	missing_chunk->owned_by.insert({remote, remote->get_interest_guard()});
+	if(missing_chunk->owned_by.insert({remote, remote->get_interest_guard()}).second)
+		remotes_[remote].owned_chunks++;
 	download_queue_.set_chunk_remotes_count(missing_chunk, missing_chunk->owned_by.size());
 
 	periodic_maintain_.invoke_post();
@@ -261,131 +529,570 @@ void Downloader::notify_remote_chunk(std::shared_ptr<RemoteFolder> remote, const
 
 void Downloader::handle_choke(std::shared_ptr<RemoteFolder> remote) {
 	LOGFUNC();
+	if(remotes_.find(remote) == remotes_.end()) return;
 
 	/* Remove requests to this node */
-	for(auto& missing_chunk : missing_chunks_)
-		missing_chunk.second->requests.erase(remote);
+	for(auto& missing_chunk : missing_chunks_ | boost::adaptors::map_values)
+		remove_requests(missing_chunk, remote);
 
 	periodic_maintain_.invoke_post();
 }
 
 void Downloader::handle_unchoke(std::shared_ptr<RemoteFolder> remote) {
 	LOGFUNC();
+	if(remotes_.find(remote) == remotes_.end()) return;
 	periodic_maintain_.invoke_post();
 }
 
-void Downloader::put_block(const blob& ct_hash, uint32_t offset, const blob& data, std::shared_ptr<RemoteFolder> from) {
+void Downloader::put_block(const blob& ct_hash, uint32_t offset, const shared_buffer& data, std::shared_ptr<RemoteFolder> from) {
 	LOGFUNC();
+	auto remote_it = remotes_.find(from);
+	if(remote_it == remotes_.end()) return;    // Its requests were removed with it
+
 	auto missing_chunk_it = missing_chunks_.find(ct_hash);
 	if(missing_chunk_it == missing_chunks_.end()) return;
+	auto missing_chunk = missing_chunk_it->second;
+	if(missing_chunk->complete()) return;   // Being moved into ChunkStorage
 
-	auto& requests = missing_chunk_it->second->requests;
-	for(auto request_it = requests.begin(); request_it != requests.end();) {
-		bool incremented_already = false;
-
+	auto& requests = missing_chunk->requests;
+	for(auto request_it = requests.begin(); request_it != requests.end(); ++request_it) {
 		if(request_it->second.offset == offset          // Chunk position incorrect
 			&& request_it->second.size == data.size()   // Chunk size incorrect
 			&& request_it->first == from) {     // Requested node != replied. Well, it isn't critical, but will be useful to ban "fake" peers
 
-			incremented_already = true;
-			request_it = requests.erase(request_it);
+			update_throughput(from, remote_it->second, data.size(), request_it->second.started);
+			remove_request(missing_chunk, request_it);
 
-			missing_chunk_it->second->put_block(offset, data);
-			if(missing_chunk_it->second->complete()) {
-				chunk_storage_.put_chunk(ct_hash, missing_chunk_it->second->release_chunk());
-			}   // TODO: catch "invalid hash" exception here
+			// Endgame: this block was requested from other remotes too, they lost
+			for(auto duplicate_it = requests.begin(); duplicate_it != requests.end();) {
+				if(duplicate_it->second.offset == offset && duplicate_it->second.size == data.size())
+					duplicate_it = cancel_request(missing_chunk, duplicate_it);
+				else
+					++duplicate_it;
+			}
 
-			periodic_maintain_.invoke_post();
+			if(missing_chunk->disk_failed()) {
+				handle_write_error(missing_chunk);
+				break;
+			}
+			missing_chunk->put_block(offset, data);
+			missing_chunk->contributors.insert(from);
+			if(missing_chunk->complete())
+				finish_chunk(missing_chunk);
+			break;
 		}
-
-		if(!incremented_already) ++request_it;
 	}
+
+	// Refill the window of this remote right away, without waiting for the next maintenance
+	expire_requests();
+	fill_windows();
+
+	auto delay = throttle_delay();
+	if(delay != std::chrono::steady_clock::duration::max())
+		periodic_maintain_.invoke_after(delay);
+}
+
+void Downloader::add_remote(std::shared_ptr<RemoteFolder> remote) {
+	LOGFUNC();
+	if(!remote || remotes_.find(remote) != remotes_.end()) return;
+
+	update_window(remote, remotes_[remote]);
+	download_queue_.set_overall_remotes_count(remotes_.size());
 }
 
 void Downloader::erase_remote(std::shared_ptr<RemoteFolder> remote) {
 	LOGFUNC();
 
 	for(auto& missing_chunk : missing_chunks_ | boost::adaptors::map_values) {
-		missing_chunk->requests.erase(remote);
+		remove_requests(missing_chunk, remote);
 		missing_chunk->owned_by.erase(remote);
+		missing_chunk->contributors.erase(remote);
 		download_queue_.set_chunk_remotes_count(missing_chunk, missing_chunk->owned_by.size());
 	}
 	remotes_.erase(remote);
 	download_queue_.set_overall_remotes_count(remotes_.size());
+
+	std::lock_guard<std::mutex> lk(remote_stats_mtx_);
+	remote_stats_.erase(remote);
 }
 
-void Downloader::maintain_requests(PeriodicProcess& process) {
+void Downloader::prioritize(const std::list<SignedMeta>& smetas) {
 	LOGFUNC();
 
-	auto request_timeout = std::chrono::seconds(Config::get()->global_get("p2p_request_timeout").asUInt64());
+	// Files, that are closer to completion, become usable first
+	std::vector<std::pair<size_t, const Meta*>> files;
+	for(auto& smeta : smetas) {
+		size_t missing = 0;
+		for(auto& chunk : smeta.meta().chunks())
+			missing += missing_chunks_.count(chunk.ct_hash);
+		if(missing > 0)
+			files.push_back({missing, &smeta.meta()});
+	}
+	std::stable_sort(files.begin(), files.end(), [](const std::pair<size_t, const Meta*>& a, const std::pair<size_t, const Meta*>& b){return a.first < b.first;});
+
+	// Inside a file, chunks are downloaded in order, so it can be read while being downloaded
+	for(auto& file : files) {
+		for(auto& chunk : file.second->chunks()) {
+			auto missing_chunk_it = missing_chunks_.find(chunk.ct_hash);
+			if(missing_chunk_it != missing_chunks_.end())
+				download_queue_.mark_immediate(missing_chunk_it->second);
+		}
+	}
+	prioritized_chunks_ = download_queue_.immediate_size();
+
+	periodic_maintain_.invoke_post();
+}
+
+void Downloader::clear_priority() {
+	LOGFUNC();
+
+	for(auto& missing_chunk : missing_chunks_ | boost::adaptors::map_values)
+		download_queue_.unmark_immediate(missing_chunk);
+	prioritized_chunks_ = 0;
+}
+
+/* File progress */
+void Downloader::remove_file(const blob& path_id) {
+	auto file_it = files_.find(path_id);
+	if(file_it == files_.end()) return;
+
+	if(file_it->second.incomplete()) {
+		std::lock_guard<std::mutex> lk(file_stats_mtx_);
+		file_stats_.incomplete--;
+	}
+	auto missing = std::move(file_it->second.missing);
+	files_.erase(file_it);
 
-	// Prune old requests by timeout
-	for(auto& missing_chunk : missing_chunks_) {
-		auto& requests = missing_chunk.second->requests; // We should lock a mutex on this
-		for(auto request = requests.begin(); request != requests.end(); ) {
-			if(request->second.started + request_timeout < std::chrono::steady_clock::now())
-				request = requests.erase(request);
-			else
-				++request;
+	for(auto& missing_chunk : missing) {
+		missing_chunk->files.erase(path_id);
+		update_chunk_completion(missing_chunk);
+	}
+}
+
+void Downloader::update_file(const blob& path_id, FileProgress& progress, bool was_incomplete, unsigned old_completion) {
+	{
+		std::lock_guard<std::mutex> lk(file_stats_mtx_);
+		if(progress.incomplete() && !was_incomplete) {
+			file_stats_.incomplete++;
+			file_stats_.peak_incomplete = std::max(file_stats_.peak_incomplete, file_stats_.incomplete);
+		}else if(!progress.incomplete() && was_incomplete)
+			file_stats_.incomplete--;
+	}
+
+	if(progress.missing.empty()) {
+		{
+			std::lock_guard<std::mutex> lk(file_stats_mtx_);
+			file_stats_.completed++;
 		}
+		files_.erase(path_id);
+		return;
 	}
 
-	// Make new requests
-	for(size_t i = requests_overall(); i < Config::get()->global_get("p2p_download_slots").asUInt(); i++) {
-		bool requested = request_one();
-		if(!requested) break;
+	// Reweight only when the quantized completion changes, this happens at most COMPLETION_LEVELS times per file
+	if(progress.incomplete() != was_incomplete || progress.completion() != old_completion)
+		for(auto& missing_chunk : progress.missing)
+			update_chunk_completion(missing_chunk);
+}
+
+void Downloader::update_chunk_completion(std::shared_ptr<MissingChunk> chunk) {
+	// If a chunk is contained in multiple files, the most complete one counts
+	bool clustered = false;
+	unsigned completion = 0;
+	for(auto& path_id : chunk->files) {
+		auto file_it = files_.find(path_id);
+		if(file_it == files_.end()) continue;
+
+		clustered |= file_it->second.incomplete();
+		completion = std::max(completion, file_it->second.completion());
+	}
+	download_queue_.set_chunk_completion(chunk, clustered, completion);
+}
+
+Downloader::FileStats Downloader::file_stats() const {
+	std::lock_guard<std::mutex> lk(file_stats_mtx_);
+	return file_stats_;
+}
+
+Downloader::RemoteStats Downloader::remote_stats(std::shared_ptr<RemoteFolder> remote) const {
+	std::lock_guard<std::mutex> lk(remote_stats_mtx_);
+	auto it = remote_stats_.find(remote);
+	return it != remote_stats_.end() ? it->second : RemoteStats();
+}
+
+void Downloader::finish_chunk(std::shared_ptr<MissingChunk> missing_chunk) {
+	bool hash_verified = missing_chunk->verify_hashed();
+	disk_queue_.invoke_post([this, missing_chunk, hash_verified]{
+		if(missing_chunk->disk_failed()) {
+			serial_queue_.invoke_post([this, missing_chunk]{handle_write_error(missing_chunk);});
+			return;
+		}
+		if(!hash_verified && !missing_chunk->verify_stored()) {
+			serial_queue_.invoke_post([this, missing_chunk]{handle_corrupted_chunk(missing_chunk);});
+			return;
+		}
+
+		try {
+			// Chunk is removed from missing, when ChunkStorage announces it
+			chunk_storage_.put_chunk(missing_chunk->ct_hash_, missing_chunk->release_chunk());
+		}catch(std::exception& e) {
+			LOGW("Could not store chunk " << AbstractFolder::ct_hash_readable(missing_chunk->ct_hash_) << " e:" << e.what());
+			serial_queue_.invoke_post([this, missing_chunk]{handle_write_error(missing_chunk);});
+		}
+	});
+}
+
+void Downloader::handle_write_error(std::shared_ptr<MissingChunk> missing_chunk) {
+	LOGW("Could not write chunk " << AbstractFolder::ct_hash_readable(missing_chunk->ct_hash_) << ", downloading it again");
+	cancel_requests(missing_chunk);
+	missing_chunk->reset();
+	periodic_maintain_.invoke_post();
+}
+
+void Downloader::handle_corrupted_chunk(std::shared_ptr<MissingChunk> missing_chunk) {
+	LOGW("Chunk " << AbstractFolder::ct_hash_readable(missing_chunk->ct_hash_) << " failed verification, downloading it again");
+
+	// If there is only one contributor, it is definitely the one, who sent corrupted data.
+	unsigned penalty = missing_chunk->contributors.size() == 1 ? MAX_VERIFICATION_FAILURES : 1;
+	for(auto& contributor : missing_chunk->contributors) {
+		auto remote_it = remotes_.find(contributor);
+		if(remote_it == remotes_.end()) continue;
+
+		remote_it->second.failures += penalty;
+		if(remote_it->second.failures >= MAX_VERIFICATION_FAILURES)
+			LOGW("Remote " << contributor->name() << " sent too much corrupted data, not requesting blocks from it anymore");
 	}
 
-	process.invoke_after(request_timeout);
+	cancel_requests(missing_chunk);
+	missing_chunk->reset();
+	periodic_maintain_.invoke_post();
 }
 
-bool Downloader::request_one() {
+void Downloader::maintain_requests(PeriodicProcess& process) {
 	LOGFUNC();
-	// Try to choose chunk to request
-	for(auto missing_chunk : download_queue_.chunks()) {
-		// Try to choose a remote to request this block from
-		auto remote = find_node_for_request(missing_chunk);
-		if(remote == nullptr) continue;
-
-		// Rebuild request map to determine, which block to download now.
-		AvailabilityMap<uint32_t> request_map = missing_chunk->file_map();
-		for(auto& request : missing_chunk->requests)
-			request_map.insert({request.second.offset, request.second.size});
-
-		// Request, actually
-		if(!request_map.full()) {
-			MissingChunk::BlockRequest request;
-			request.offset = request_map.begin()->first;
-			request.size = std::min(request_map.begin()->second, uint32_t(Config::get()->global_get("p2p_block_size").asUInt()));
-			request.started = std::chrono::steady_clock::now();
-
-			remote->request_block(missing_chunk->ct_hash_, request.offset, request.size);
-			missing_chunk->requests.insert({remote, request});
-			return true;
+
+	expire_requests();
+
+	// Make new requests
+	fill_windows();
+
+	// Wake up, when the oldest request expires or rate limit lets more requests through
+	auto request_timeout = std::chrono::seconds(Config::get()->global_get("p2p_request_timeout").asUInt64());
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::duration next_wakeup = request_timeout;
+	if(!request_deadlines_.empty()) {
+		auto deadline = request_deadlines_.front().started + request_timeout;
+		next_wakeup = std::chrono::duration_cast<std::chrono::seconds>(deadline - now) + std::chrono::seconds(1);
+	}
+	process.invoke_after(std::min(next_wakeup, throttle_delay()));
+}
+
+void Downloader::expire_requests() {
+	auto request_timeout = std::chrono::seconds(Config::get()->global_get("p2p_request_timeout").asUInt64());
+	auto now = std::chrono::steady_clock::now();
+
+	/* Timeout is the same for all requests, so the queue is ordered by deadline.
+	 * Entries of completed requests are left in the queue and skipped here. */
+	while(!request_deadlines_.empty()) {
+		auto& entry = request_deadlines_.front();
+
+		auto chunk = entry.chunk.lock();
+		auto remote = entry.remote.lock();
+		if(chunk && remote) {
+			auto range = chunk->requests.equal_range(remote);
+			auto request_it = std::find_if(range.first, range.second, [&entry](const MissingChunk::requests_t::value_type& request){
+				return request.second.offset == entry.offset && request.second.started == entry.started;
+			});
+
+			if(request_it != range.second) {
+				if(entry.started + request_timeout > now) break;
+
+				auto remote_it = remotes_.find(remote);
+				if(remote_it != remotes_.end()) {
+					remote_it->second.timeouts++;
+					update_window(remote_it->first, remote_it->second);
+				}
+				cancel_request(chunk, request_it);
+			}
 		}
+		request_deadlines_.pop_front();
 	}
-	return false;
+}
+
+void Downloader::fill_windows() {
+	// Remotes with a free window, and the number of their chunks, the queue walk has not passed yet
+	std::map<std::shared_ptr<RemoteFolder>, size_t> candidates;
+	for(auto& remote : remotes_)
+		if(remote.second.owned_chunks > 0 && can_request(remote.first))
+			candidates.insert({remote.first, remote.second.owned_chunks});
+	if(candidates.empty()) return;
+
+	// Number of partially downloaded chunks is limited to bound open files and memory buffers
+	for(auto it = partial_chunks_.begin(); it != partial_chunks_.end();) {
+		if(!(*it)->started())
+			it = partial_chunks_.erase(it);
+		else
+			++it;
+	}
+	size_t partial_chunks_limit = Config::get()->global_get("p2p_download_partial_chunks").asUInt();
+
+	// Try to choose chunk to request. The walk ends, when every remote has no window or no chunks further in the queue
+	bool partial_limit_reached = false;
+	download_queue_.for_each([&, this](const std::shared_ptr<MissingChunk>& missing_chunk) {
+		bool started = missing_chunk->started();
+		if(!started && partial_chunks_.size() >= partial_chunks_limit && !download_queue_.immediate(missing_chunk)) {
+			partial_limit_reached = true;   // Only started chunks may be requested further on, these are in partial_chunks_
+			return false;
+		}
+
+		bool requested = false;
+		while(request_block(missing_chunk))
+			requested = true;
+		if(requested && !started) partial_chunks_.insert(missing_chunk);
+
+		for(auto& owner_remote : missing_chunk->owned_by) {
+			auto candidate_it = candidates.find(owner_remote.first);
+			if(candidate_it != candidates.end() && (--candidate_it->second == 0 || !can_request(owner_remote.first)))
+				candidates.erase(candidate_it);
+		}
+		return !candidates.empty();
+	});
+
+	if(partial_limit_reached) {
+		for(auto& missing_chunk : partial_chunks_) {
+			if(candidates.empty()) break;
+			while(request_block(missing_chunk));
+
+			for(auto candidate_it = candidates.begin(); candidate_it != candidates.end();)
+				candidate_it = can_request(candidate_it->first) ? std::next(candidate_it) : candidates.erase(candidate_it);
+		}
+	}
+
+	// Endgame: the last blocks are requested from several remotes, so a sync is not held by the slowest one
+	bool endgame = missing_chunks_.size() <= Config::get()->global_get("p2p_download_endgame_chunks").asUInt();
+	if(endgame != endgame_) {
+		endgame_ = endgame;
+		if(endgame_) LOGD("Entering endgame with " << missing_chunks_.size() << " missing chunks");
+	}
+	if(endgame_) {
+		download_queue_.for_each([this](const std::shared_ptr<MissingChunk>& missing_chunk) {
+			while(request_duplicate(missing_chunk));
+			return true;
+		});
+	}
+}
+
+bool Downloader::request_block(std::shared_ptr<MissingChunk> chunk) {
+	// Try to choose a remote to request this block from
+	auto remote = find_node_for_request(chunk);
+	if(remote == nullptr) return false;
+
+	// Rebuild request map to determine, which block to download now.
+	AvailabilityMap<uint32_t> request_map = chunk->file_map();
+	for(auto& request : chunk->requests)
+		request_map.insert({request.second.offset, request.second.size});
+
+	// Request, actually
+	if(request_map.full()) return false;
+
+	MissingChunk::BlockRequest request;
+	request.offset = request_map.begin()->first;
+	request.size = std::min(request_map.begin()->second, remotes_.at(remote).block_size);
+	request.started = std::chrono::steady_clock::now();
+
+	remote->request_block(chunk->ct_hash_, request.offset, request.size);
+	add_request(chunk, remote, request);
+	return true;
 }
 
 std::shared_ptr<RemoteFolder> Downloader::find_node_for_request(std::shared_ptr<MissingChunk> chunk) {
 	//LOGFUNC();
 
-	auto missing_chunk_it = missing_chunks_.find(chunk->ct_hash_);
-	if(missing_chunk_it == missing_chunks_.end()) return nullptr;
+	float fallback = fallback_throughput();
+
+	std::shared_ptr<RemoteFolder> best_remote;
+	double best_delivery = std::numeric_limits<double>::max();
+	for(auto& owner_remote : chunk->owned_by) {
+		if(!can_request(owner_remote.first)) continue;
+
+		double delivery = expected_delivery(owner_remote.first, remotes_.at(owner_remote.first), fallback);
+		if(delivery < best_delivery) {
+			best_delivery = delivery;
+			best_remote = owner_remote.first;
+		}
+	}
+	return best_remote;
+}
+
+bool Downloader::request_duplicate(std::shared_ptr<MissingChunk> chunk) {
+	float fallback = fallback_throughput();
 
-	auto missing_chunk_ptr = missing_chunk_it->second;
+	for(auto& request : chunk->requests) {
+		uint32_t offset = request.second.offset, size = request.second.size;
 
-	for(auto owner_remote : missing_chunk_ptr->owned_by)
-		if(owner_remote.first->ready() && !owner_remote.first->peer_choking()) return owner_remote.first; // TODO: implement more smart peer selection algorithm, based on peer weights.
+		// Remotes, this block is already requested from
+		std::set<std::shared_ptr<RemoteFolder>> requested_from;
+		for(auto& other_request : chunk->requests)
+			if(other_request.second.offset == offset && other_request.second.size == size)
+				requested_from.insert(other_request.first);
+		if(requested_from.size() >= ENDGAME_MAX_REQUESTS) continue;
+
+		std::shared_ptr<RemoteFolder> best_remote;
+		double best_delivery = std::numeric_limits<double>::max();
+		for(auto& owner_remote : chunk->owned_by) {
+			if(requested_from.count(owner_remote.first) || !can_request(owner_remote.first)) continue;
+
+			double delivery = expected_delivery(owner_remote.first, remotes_.at(owner_remote.first), fallback);
+			if(delivery < best_delivery) {
+				best_delivery = delivery;
+				best_remote = owner_remote.first;
+			}
+		}
+		if(!best_remote) continue;
+
+		MissingChunk::BlockRequest duplicate;
+		duplicate.offset = offset;
+		duplicate.size = size;
+		duplicate.started = std::chrono::steady_clock::now();
+
+		best_remote->request_block(chunk->ct_hash_, offset, size);
+		add_request(chunk, best_remote, duplicate);
+		return true;  // Requests map is modified, iteration must not continue
+	}
+	return false;
+}
+
+/* Request bookkeeping */
+void Downloader::add_request(std::shared_ptr<MissingChunk> chunk, std::shared_ptr<RemoteFolder> remote, const MissingChunk::BlockRequest& request) {
+	auto& state = remotes_.at(remote);
+	if(state.outstanding == 0) {
+		// New busy period, throughput is not sampled while idle
+		state.sample_started = request.started;
+		state.sample_bytes = 0;
+	}
+	state.outstanding += request.size;
+	chunk->requests.insert({remote, request});
+
+	request_deadlines_.push_back({chunk, remote, request.offset, request.started});
+	inflight_requests_++;
+}
 
-	return nullptr;
+MissingChunk::requests_t::iterator Downloader::remove_request(std::shared_ptr<MissingChunk> chunk, MissingChunk::requests_t::iterator request_it) {
+	auto remote_it = remotes_.find(request_it->first);
+	if(remote_it != remotes_.end())
+		remote_it->second.outstanding -= std::min(remote_it->second.outstanding, uint64_t(request_it->second.size));
+	inflight_requests_--;
+	return chunk->requests.erase(request_it);
 }
 
-size_t Downloader::requests_overall() const {
-	size_t requests_overall_result = 0;
-	for(auto& missing_chunk : missing_chunks_)
-		requests_overall_result += missing_chunk.second->requests.size();
-	return requests_overall_result;
+MissingChunk::requests_t::iterator Downloader::cancel_request(std::shared_ptr<MissingChunk> chunk, MissingChunk::requests_t::iterator request_it) {
+	request_it->first->cancel_block(chunk->ct_hash_, request_it->second.offset, request_it->second.size);
+	return remove_request(chunk, request_it);
+}
+
+void Downloader::cancel_requests(std::shared_ptr<MissingChunk> chunk) {
+	for(auto request_it = chunk->requests.begin(); request_it != chunk->requests.end();)
+		request_it = cancel_request(chunk, request_it);
+}
+
+void Downloader::remove_requests(std::shared_ptr<MissingChunk> chunk, std::shared_ptr<RemoteFolder> remote) {
+	auto range = chunk->requests.equal_range(remote);
+	for(auto request_it = range.first; request_it != range.second;)
+		request_it = remove_request(chunk, request_it);
+}
+
+void Downloader::remove_requests(std::shared_ptr<MissingChunk> chunk) {
+	for(auto request_it = chunk->requests.begin(); request_it != chunk->requests.end();)
+		request_it = remove_request(chunk, request_it);
+}
+
+/* Node management */
+float Downloader::fallback_throughput() const {
+	// Remotes, that have not delivered anything yet, are assumed to be as fast as the fastest known one, so they get probed.
+	float fallback = 0;
+	for(auto& state : remotes_ | boost::adaptors::map_values)
+		fallback = std::max(fallback, state.throughput);
+	return fallback;
+}
+
+bool Downloader::can_request(std::shared_ptr<RemoteFolder> remote) const {
+	auto remote_it = remotes_.find(remote);
+	if(remote_it == remotes_.end()) return false;
+
+	const RemoteState& state = remote_it->second;
+	return remote->ready() && !remote->peer_choking()
+		&& state.failures < MAX_VERIFICATION_FAILURES
+		&& state.outstanding < state.window
+		&& remote->download_bucket().delay() == std::chrono::steady_clock::duration::zero();    // Download rate limit
+}
+
+std::chrono::steady_clock::duration Downloader::throttle_delay() const {
+	auto delay = std::chrono::steady_clock::duration::max();
+	for(auto& remote : remotes_) {
+		if(!remote.first->ready() || remote.first->peer_choking() || remote.second.outstanding >= remote.second.window) continue;
+
+		auto remote_delay = remote.first->download_bucket().delay();
+		if(remote_delay > std::chrono::steady_clock::duration::zero())
+			delay = std::min(delay, remote_delay);
+	}
+	return delay;
+}
+
+/* Estimated time (in seconds) for a new block to arrive from this remote.
+ * Outstanding requests are counted, so blocks of the same chunk naturally spread across several fast remotes. */
+double Downloader::expected_delivery(std::shared_ptr<RemoteFolder> remote, const RemoteState& state, float fallback_throughput) const {
+	float throughput = state.throughput > 0 ? state.throughput : fallback_throughput;
+	if(throughput <= 0) throughput = state.window;  // Nothing is known at all, assume the whole window in a second
+
+	auto rtt = std::chrono::duration_cast<std::chrono::steady_clock::duration>(remote->rtt());
+	if(rtt == rtt.zero() || state.min_latency < rtt) rtt = state.min_latency;
+	double rtt_seconds = rtt == rtt.max() ? 0 : std::chrono::duration<double>(rtt).count();
+
+	double delivery = double(state.outstanding + state.block_size) / throughput + rtt_seconds;
+	return delivery * (1 + state.failures + state.timeouts);
+}
+
+void Downloader::update_window(std::shared_ptr<RemoteFolder> remote, RemoteState& state) {
+	uint32_t min_block_size = Config::get()->global_get("p2p_block_size").asUInt();
+	uint32_t max_block_size = std::min(Config::get()->global_get("p2p_max_block_size").asUInt(), uint32_t(MAX_BLOCK_SIZE));
+	uint64_t min_window = uint64_t(Config::get()->global_get("p2p_download_slots").asUInt()) * min_block_size;
+	uint64_t max_window = Config::get()->global_get("p2p_download_max_window").asUInt64();
+
+	// Base RTT: ping is measured with no blocks in flight, block latency may include queueing
+	auto rtt = std::chrono::duration_cast<std::chrono::steady_clock::duration>(remote->rtt());
+	if(rtt == rtt.zero() || state.min_latency < rtt) rtt = state.min_latency;
+	double bdp = state.min_latency == state.min_latency.max() ? 0 : state.throughput * std::chrono::duration<double>(rtt).count();
+
+	// Twice the bandwidth-delay product, so throughput is able to grow
+	state.window = std::min(std::max(uint64_t(2 * bdp), min_window), std::max(max_window, min_window));
+	state.block_size = std::min(std::max(uint32_t(bdp / 8), min_block_size), std::max(max_block_size, min_block_size));
+
+	RemoteStats stats;
+	stats.window = state.window;
+	stats.outstanding = state.outstanding;
+	stats.block_size = state.block_size;
+	stats.throughput = state.throughput;
+	stats.rtt = std::chrono::duration_cast<std::chrono::milliseconds>(rtt == rtt.max() ? rtt.zero() : rtt);
+	stats.timeouts = state.timeouts;
+
+	std::lock_guard<std::mutex> lk(remote_stats_mtx_);
+	remote_stats_[remote] = stats;
+}
+
+void Downloader::update_throughput(std::shared_ptr<RemoteFolder> remote, RemoteState& state, uint32_t size, std::chrono::steady_clock::time_point started) {
+	auto now = std::chrono::steady_clock::now();
+	state.min_latency = std::min(state.min_latency, now - started);
+	if(state.timeouts > 0) state.timeouts--;
+
+	state.sample_bytes += size;
+	auto sample_duration = now - state.sample_started;
+	if(sample_duration >= std::chrono::milliseconds(250)) {
+		float sample = float(state.sample_bytes) / std::chrono::duration<float>(sample_duration).count();
+		state.throughput = state.throughput == 0 ? sample : state.throughput * 0.75f + sample * 0.25f;
+
+		state.sample_started = now;
+		state.sample_bytes = 0;
+	}
+	update_window(remote, state);
 }
 
 } /* namespace librevault */
@@ -32,56 +32,70 @@
 #include "util/blob.h"
 #include "util/file_util.h"
 #include "util/log.h"
+#include "util/monitored_strand.h"
 #include "util/network.h"
 #include "util/periodic_process.h"
-#include <boost/bimap.hpp>
-#include <boost/bimap/multiset_of.hpp>
-#include <boost/bimap/unordered_set_of.hpp>
+#include "util/shared_buffer.h"
+#include "util/scoped_async_queue.h"
+#include <cryptopp/cryptlib.h>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 #define CLUSTERED_COEFFICIENT 10.0f
-#define IMMEDIATE_COEFFICIENT 20.0f
+#define COMPLETION_COEFFICIENT 8.0f    // Less than rarity difference in small swarms, so nearly complete files don't starve rare chunks
+#define COMPLETION_LEVELS 4
 #define RARITY_COEFFICIENT 25.0f
 
+#define MAX_VERIFICATION_FAILURES 3
+#define ENDGAME_MAX_REQUESTS 3  // Maximum number of remotes, a single block is requested from in endgame
+#define MAX_BLOCK_SIZE 8388608  // Block reply must fit into WebSocket message size limit (10 MiB)
+
 namespace librevault {
 
 class FolderParams;
 class MetaStorage;
 class ChunkStorage;
 
-/* GlobalFilePool is a singleton class, used to open/close files automatically to reduce simultaneously open file descriptors */
-class GlobalFilePool {
+/* ChunkBufferPool keeps memory buffers of small chunks for reuse. Thread-safe, as complete chunks are released on the bulk io_service */
+class ChunkBufferPool {
 public:
-	static GlobalFilePool* get_instance() {
-		static GlobalFilePool* instance;
-		if(!instance)
-			instance = new GlobalFilePool();
-		return instance;
-	}
-
-	std::shared_ptr<file_wrapper> get_file(const boost::filesystem::path& chunk_path);
-	void release_file(const boost::filesystem::path& chunk_path);
+	std::shared_ptr<blob> get_buffer(uint32_t size);
+	void put_buffer(std::shared_ptr<blob> buffer);
 
 private:
-	std::map<boost::filesystem::path, std::weak_ptr<file_wrapper>> cache_;
-	std::list<std::shared_ptr<file_wrapper>> opened_files_;
-
-	void retain_file(boost::filesystem::path chunk_path, std::shared_ptr<file_wrapper> retained_file);
-	bool overflow() {return opened_files_.size() > 100;}    // TODO: in config
+	std::mutex free_buffers_mtx_;
+	std::list<std::shared_ptr<blob>> free_buffers_;
+	bool overflow() {return free_buffers_.size() > 16;}
 };
 
 /* MissingChunk constructs a chunk in a file. If complete(), then an encrypted chunk is located in  */
 struct MissingChunk {
-	MissingChunk(const boost::filesystem::path& system_path, blob ct_hash, uint32_t size);
+	// If buffer_pool is set, then the chunk is assembled in memory and written to file only when complete.
+	// File writes are queued to disk_queue, so the event loop keeps only in-memory state.
+	MissingChunk(const boost::filesystem::path& system_path, blob ct_hash, uint32_t size, Meta::StrongHashType strong_hash_type, ScopedAsyncQueue& disk_queue, ChunkBufferPool* buffer_pool = nullptr);
+	~MissingChunk();
 
-	// File-related accessors
-	boost::filesystem::path release_chunk();
+	// File-related accessors. Must be called from disk_queue, when the chunk is complete
+	boost::filesystem::path release_chunk();   // Throws and sets disk_failed, if the chunk couldn't be written
+	bool verify_stored();   // Hashes the whole chunk
+	bool disk_failed() const {return *disk_failed_;}
 
 	// Content-related accessors
-	void put_block(uint32_t offset, const blob& content);
+	void put_block(uint32_t offset, const shared_buffer& content);
+	bool verify_hashed();   // Checks hash of a complete chunk, computed incrementally, as blocks arrive. Inconclusive, if false.
+	void reset();   // Discards all received blocks
 
 	// Size-related functions
 	uint64_t size() const {return file_map_.size_original();}
 	bool complete() const {return file_map_.full();}
+	bool started() const {return !file_map_.empty() || !requests.empty();}
 
 	// AvailabilityMap accessors
 	AvailabilityMap<uint32_t>::const_iterator begin() {return file_map_.begin();}
@@ -94,39 +108,78 @@ struct MissingChunk {
 		uint32_t size;
 		std::chrono::steady_clock::time_point started;
 	};
-	std::unordered_multimap<std::shared_ptr<RemoteFolder>, BlockRequest> requests;
+	using requests_t = std::unordered_multimap<std::shared_ptr<RemoteFolder>, BlockRequest>;
+	requests_t requests;
 	std::unordered_map<std::shared_ptr<RemoteFolder>, std::shared_ptr<RemoteFolder::InterestGuard>> owned_by;
+	std::set<std::shared_ptr<RemoteFolder>> contributors;   // Remotes, which sent blocks of this chunk
+	std::set<blob> files;   // path_id of files, which contain this chunk
 
 	const blob ct_hash_;
 
 private:
 	AvailabilityMap<uint32_t> file_map_;
 	boost::filesystem::path this_chunk_path_;
+	boost::filesystem::path this_journal_path_;   // Received block ranges, used to resume download after restart
+	bool allocated_ = false;    // File is created on the first received block
+	uint64_t journal_size_ = 0;
+
+	ChunkBufferPool* buffer_pool_;
+	std::shared_ptr<blob> buffer_;
+
+	ScopedAsyncQueue& disk_queue_;
+	std::shared_ptr<std::atomic<bool>> disk_failed_ = std::make_shared<std::atomic<bool>>(false);  // Set by a failed write, cleared by reset
+
+	bool load_journal();
+	void create_journal();
+	void allocate();
+
+	/* Incremental verification */
+	const Meta::StrongHashType strong_hash_type_;
+	std::unique_ptr<CryptoPP::HashTransformation> hasher_;
+	uint32_t hashed_offset_ = 0;
+	std::map<uint32_t, shared_buffer> pending_blocks_;  // Out-of-order blocks, waiting to be hashed
+
+	void hash_block(const uint8_t* data, size_t size);
+	void feed_hasher(uint32_t offset, const shared_buffer& content);
 };
 
+/* WeightedDownloadQueue orders missing chunks by weight.
+ * Chunks with equal flags and owner count share a bucket, so the global remote count is applied to buckets
+ * only, when the queue is iterated. Buckets keep chunks in insertion order.
+ * Immediate chunks precede all others and are kept in the order they were marked in. */
 class WeightedDownloadQueue {
 	struct Weight {
-		bool clustered = false;
-		bool immediate = false;
-
+		bool clustered = false; // Chunk belongs to a file, that is partially present
+		unsigned completion = 0;    // Quantized fraction of that file, which is present, [0; COMPLETION_LEVELS)
 		size_t owned_by = 0;
-		size_t remotes_count = 0;
 
-		float value() const;
-		bool operator<(const Weight& b) const {return value() > b.value();}
-		bool operator==(const Weight& b) const {return value() == b.value();}
-		bool operator!=(const Weight& b) const {return !(*this == b);}
+		float value(size_t remotes_count) const;
+		bool operator<(const Weight& b) const {return std::tie(clustered, completion, owned_by) < std::tie(b.clustered, b.completion, b.owned_by);}
+	};
+	using bucket_t = std::list<std::shared_ptr<MissingChunk>>;
+
+	struct ChunkPosition {
+		Weight weight;
+		uint64_t immediate_seq = 0;   // 0 if chunk is not immediate
+		std::map<Weight, bucket_t>::iterator bucket;
+		bucket_t::iterator position;
 	};
-	using weight_ordered_chunks_t = boost::bimap<
-		boost::bimaps::unordered_set_of<std::shared_ptr<MissingChunk>>,
-		boost::bimaps::multiset_of<Weight>
-	>;
-	using queue_left_value = weight_ordered_chunks_t::left_value_type;
-	using queue_right_value = weight_ordered_chunks_t::right_value_type;
-	weight_ordered_chunks_t weight_ordered_chunks_;
+	using positions_t = std::unordered_map<std::shared_ptr<MissingChunk>, ChunkPosition>;
+
+	std::map<Weight, bucket_t> buckets_;
+	std::map<uint64_t, std::shared_ptr<MissingChunk>> immediate_chunks_;
+	uint64_t last_immediate_seq_ = 0;
+	positions_t chunk_positions_;
+	size_t remotes_count_ = 0;
+
+	mutable std::vector<std::map<Weight, bucket_t>::const_iterator> ordered_buckets_;   // Cached bucket order, rebuilt lazily
+	mutable bool ordered_buckets_valid_ = false;
 
-	Weight get_current_weight(std::shared_ptr<MissingChunk> chunk);
-	void reweight_chunk(std::shared_ptr<MissingChunk> chunk, Weight new_weight);
+	void reweight_chunk(positions_t::iterator position_it, Weight new_weight);
+	void place_chunk(ChunkPosition& position, std::shared_ptr<MissingChunk> chunk);
+	void unplace_chunk(ChunkPosition& position);
+
+	const std::vector<std::map<Weight, bucket_t>::const_iterator>& ordered_buckets() const;
 
 public:
 	void add_chunk(std::shared_ptr<MissingChunk> chunk);
@@ -135,49 +188,166 @@ public:
 	void set_overall_remotes_count(size_t count);
 	void set_chunk_remotes_count(std::shared_ptr<MissingChunk> chunk, size_t count);
 
-	void mark_clustered(std::shared_ptr<MissingChunk> chunk);
+	void set_chunk_completion(std::shared_ptr<MissingChunk> chunk, bool clustered, unsigned completion);
 	void mark_immediate(std::shared_ptr<MissingChunk> chunk);
-
-	std::list<std::shared_ptr<MissingChunk>> chunks() const;
+	void unmark_immediate(std::shared_ptr<MissingChunk> chunk);
+
+	size_t size() const {return chunk_positions_.size();}
+	size_t immediate_size() const {return immediate_chunks_.size();}
+	bool immediate(std::shared_ptr<MissingChunk> chunk) const;
+
+	/* Calls func for chunks from the most wanted to the least wanted, until it returns false.
+	 * Chunks, that are not owned by any remote, are skipped. The queue must not be modified from func. */
+	template <class Func>
+	void for_each(Func func) const {
+		for(auto& immediate_chunk : immediate_chunks_) {
+			if(chunk_positions_.at(immediate_chunk.second).weight.owned_by == 0) continue;
+			if(!func(immediate_chunk.second)) return;
+		}
+		for(auto& bucket_it : ordered_buckets()) {
+			if(bucket_it->first.owned_by == 0) continue;
+			for(auto& chunk : bucket_it->second)
+				if(!func(chunk)) return;
+		}
+	}
 };
 
 class Downloader {
 	LOG_SCOPE("Downloader");
 public:
-	Downloader(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, io_service& ios);
+	struct RemoteStats {
+		uint64_t window = 0;
+		uint64_t outstanding = 0;
+		uint32_t block_size = 0;
+		float throughput = 0;
+		std::chrono::milliseconds rtt = std::chrono::milliseconds(0);
+		unsigned timeouts = 0;
+	};
+
+	Downloader(const FolderParams& params, MetaStorage& meta_storage, ChunkStorage& chunk_storage, monitored_strand& serial_strand, io_service& bulk_ios);
 	~Downloader();
 
 	void notify_local_meta(const SignedMeta& smeta, const bitfield_type& bitfield);
-	void notify_local_chunk(const blob& ct_hash, bool mark_clustered = true);
+	void notify_local_chunk(const blob& ct_hash);
 
-	void notify_remote_meta(std::shared_ptr<RemoteFolder> remote, const Meta::PathRevision& revision, bitfield_type bitfield);
+	void notify_remote_meta(std::shared_ptr<RemoteFolder> remote, const Meta& meta, bitfield_type bitfield);
 	void notify_remote_chunk(std::shared_ptr<RemoteFolder> remote, const blob& ct_hash);
 
 	void handle_choke(std::shared_ptr<RemoteFolder> remote);
 	void handle_unchoke(std::shared_ptr<RemoteFolder> remote);
 
-	void put_block(const blob& ct_hash, uint32_t offset, const blob& data, std::shared_ptr<RemoteFolder> from);
+	void put_block(const blob& ct_hash, uint32_t offset, const shared_buffer& data, std::shared_ptr<RemoteFolder> from);
 
+	// Messages from remotes, that are not added (or already erased), are ignored
+	void add_remote(std::shared_ptr<RemoteFolder> remote);
 	void erase_remote(std::shared_ptr<RemoteFolder> remote);
 
+	/* Chunks of prioritized files are downloaded before everything else, sequentially */
+	void prioritize(const std::list<SignedMeta>& smetas);
+	void clear_priority();
+
+	RemoteStats remote_stats(std::shared_ptr<RemoteFolder> remote) const;   // Thread-safe
+	size_t inflight_requests() const {return inflight_requests_;}  // Thread-safe
+	size_t prioritized_chunks() const {return prioritized_chunks_;}  // Thread-safe
+
+	struct FileStats {
+		size_t incomplete = 0;  // Files, that are partially present
+		size_t peak_incomplete = 0;
+		size_t completed = 0;   // Files, that were completed by this Downloader
+	};
+	FileStats file_stats() const;   // Thread-safe
+
 private:
 	const FolderParams& params_;
 	MetaStorage& meta_storage_;
 	ChunkStorage& chunk_storage_;
+	monitored_strand& serial_strand_;
 
+	ChunkBufferPool buffer_pool_;
 	std::map<blob, std::shared_ptr<MissingChunk>> missing_chunks_;
 	WeightedDownloadQueue download_queue_;
+	std::set<std::shared_ptr<MissingChunk>> partial_chunks_;  // Chunks, that may be started. Pruned lazily.
+
+	/* File progress. Chunks of files, which are close to completion, are preferred, so fewer files stay incomplete */
+	struct FileProgress {
+		size_t chunks = 0;
+		std::set<std::shared_ptr<MissingChunk>> missing;
+
+		bool incomplete() const {return !missing.empty() && missing.size() < chunks;}
+		unsigned completion() const {return unsigned((chunks - missing.size()) * COMPLETION_LEVELS / chunks);}
+	};
+	std::map<blob, FileProgress> files_;
+
+	FileStats file_stats_;
+	mutable std::mutex file_stats_mtx_;
 
-	size_t requests_overall() const;
+	void remove_file(const blob& path_id);
+	void update_file(const blob& path_id, FileProgress& progress, bool was_incomplete, unsigned old_completion);
+	void update_chunk_completion(std::shared_ptr<MissingChunk> chunk);
+
+	/* Disk work. Writes, verification and moving complete chunks into ChunkStorage are done in order, off the event loop */
+	ScopedAsyncQueue disk_queue_;
+	ScopedAsyncQueue serial_queue_; // Results of disk work are handled here, on serial_strand_
+	void finish_chunk(std::shared_ptr<MissingChunk> chunk);
+	void handle_write_error(std::shared_ptr<MissingChunk> chunk);
 
 	/* Request process */
 	PeriodicProcess periodic_maintain_;
 	void maintain_requests(PeriodicProcess& process);
-	bool request_one();
+	void expire_requests();
+	void fill_windows();
+	bool request_block(std::shared_ptr<MissingChunk> chunk);
+	bool request_duplicate(std::shared_ptr<MissingChunk> chunk);
+	bool endgame_ = false;
 	std::shared_ptr<RemoteFolder> find_node_for_request(std::shared_ptr<MissingChunk> chunk);
 
+	/* Request bookkeeping */
+	void add_request(std::shared_ptr<MissingChunk> chunk, std::shared_ptr<RemoteFolder> remote, const MissingChunk::BlockRequest& request);
+	MissingChunk::requests_t::iterator remove_request(std::shared_ptr<MissingChunk> chunk, MissingChunk::requests_t::iterator request_it);
+	MissingChunk::requests_t::iterator cancel_request(std::shared_ptr<MissingChunk> chunk, MissingChunk::requests_t::iterator request_it);
+	void cancel_requests(std::shared_ptr<MissingChunk> chunk);
+	void remove_requests(std::shared_ptr<MissingChunk> chunk, std::shared_ptr<RemoteFolder> remote);
+	void remove_requests(std::shared_ptr<MissingChunk> chunk);
+
+	struct RequestDeadline {
+		std::weak_ptr<MissingChunk> chunk;
+		std::weak_ptr<RemoteFolder> remote;
+		uint32_t offset;
+		std::chrono::steady_clock::time_point started;
+	};
+	std::deque<RequestDeadline> request_deadlines_; // Ordered by request time
+	std::atomic<size_t> inflight_requests_ = {0};
+	std::atomic<size_t> prioritized_chunks_ = {0};
+
 	/* Node management */
-	std::set<std::shared_ptr<RemoteFolder>> remotes_;
+	struct RemoteState {
+		unsigned failures = 0;  // Number of corrupted chunks, this remote contributed to
+		unsigned timeouts = 0;  // Number of recently timed out requests
+		size_t owned_chunks = 0;    // Missing chunks, this remote has. Bounds the queue walk, when its window is free
+
+		/* Request window, sized by bandwidth-delay product */
+		uint64_t outstanding = 0;   // Bytes requested, but not received yet
+		uint64_t window = 0;
+		uint32_t block_size = 0;
+		float throughput = 0;   // Delivered bytes per second, smoothed
+		std::chrono::steady_clock::duration min_latency = std::chrono::steady_clock::duration::max();
+
+		uint64_t sample_bytes = 0;
+		std::chrono::steady_clock::time_point sample_started;
+	};
+	std::map<std::shared_ptr<RemoteFolder>, RemoteState> remotes_;
+
+	bool can_request(std::shared_ptr<RemoteFolder> remote) const;
+	std::chrono::steady_clock::duration throttle_delay() const; // Time until a remote, blocked by rate limit, may be requested from
+	float fallback_throughput() const;
+	double expected_delivery(std::shared_ptr<RemoteFolder> remote, const RemoteState& state, float fallback_throughput) const;
+	void update_window(std::shared_ptr<RemoteFolder> remote, RemoteState& state);
+	void update_throughput(std::shared_ptr<RemoteFolder> remote, RemoteState& state, uint32_t size, std::chrono::steady_clock::time_point started);
+
+	std::map<std::shared_ptr<RemoteFolder>, RemoteStats> remote_stats_;
+	mutable std::mutex remote_stats_mtx_;
+
+	void handle_corrupted_chunk(std::shared_ptr<MissingChunk> missing_chunk);
 };
 
 } /* namespace librevault */
@@ -37,27 +37,41 @@
 
 namespace librevault {
 
-MetaDownloader::MetaDownloader(MetaStorage& meta_storage, Downloader& downloader) :
+MetaDownloader::MetaDownloader(MetaStorage& meta_storage, Downloader& downloader, monitored_strand& serial_strand, io_service& bulk_ios) :
 	meta_storage_(meta_storage),
-	downloader_(downloader) {
+	downloader_(downloader),
+	serial_strand_(serial_strand),
+	serial_queue_(serial_strand.get_io_service(), serial_strand.strand()),
+	bulk_queue_(bulk_ios) {
 	LOGFUNC();
 }
 
 void MetaDownloader::handle_have_meta(std::shared_ptr<RemoteFolder> origin, const Meta::PathRevision& revision, const bitfield_type& bitfield) {
-	if(meta_storage_.index->have_meta(revision))
-		downloader_.notify_remote_meta(origin, revision, bitfield);
-	else if(meta_storage_.index->put_allowed(revision))
-		origin->request_meta(revision);
-	else
-		LOGD("Remote node notified us about an expired Meta");
+	if(!origin) return;    // Already disconnected
+	bulk_queue_.invoke_post([this, origin, revision, bitfield]{
+		try {
+			if(meta_storage_.index->have_meta(revision)) {
+				auto smeta = meta_storage_.index->get_meta(revision);
+				serial_queue_.invoke_post([this, origin, smeta, bitfield]{downloader_.notify_remote_meta(origin, smeta.meta(), bitfield);});
+			}else if(meta_storage_.index->put_allowed(revision))
+				serial_strand_.post([origin, revision]{origin->request_meta(revision);});
+			else
+				LOGD("Remote node notified us about an expired Meta");
+		}catch(AbstractFolder::no_such_meta& e){
+			LOGD("Remote node notified us about an expired Meta");   // Newer revision was put in the meantime
+		}
+	});
 }
 
 void MetaDownloader::handle_meta_reply(std::shared_ptr<RemoteFolder> origin, const SignedMeta& smeta, const bitfield_type& bitfield) {
-	if(meta_storage_.index->put_allowed(smeta.meta().path_revision())) {
-		meta_storage_.index->put_meta(smeta);
-		downloader_.notify_remote_meta(origin, smeta.meta().path_revision(), bitfield);
-	}else
-		LOGD("Remote node posted to us about an expired Meta");
+	if(!origin) return;    // Already disconnected
+	bulk_queue_.invoke_post([this, origin, smeta, bitfield]{
+		if(meta_storage_.index->put_allowed(smeta.meta().path_revision())) {
+			meta_storage_.index->put_meta(smeta);
+			serial_queue_.invoke_post([this, origin, smeta, bitfield]{downloader_.notify_remote_meta(origin, smeta.meta(), bitfield);});
+		}else
+			LOGD("Remote node posted to us about an expired Meta");
+	});
 }
 
 } /* namespace librevault */
@@ -28,6 +28,9 @@
  */
 #pragma once
 #include "util/log_scope.h"
+#include "util/monitored_strand.h"
+#include "util/network.h"
+#include "util/scoped_async_queue.h"
 #include <librevault/SignedMeta.h>
 #include <librevault/util/bitfield_convert.h>
 #include <memory>
@@ -41,7 +44,7 @@ class Downloader;
 class MetaDownloader {
 	LOG_SCOPE("MetaDownloader");
 public:
-	MetaDownloader(MetaStorage& meta_storage, Downloader& downloader);
+	MetaDownloader(MetaStorage& meta_storage, Downloader& downloader, monitored_strand& serial_strand, io_service& bulk_ios);
 
 	/* Message handlers */
 	void handle_have_meta(std::shared_ptr<RemoteFolder> origin, const Meta::PathRevision& revision, const bitfield_type& bitfield);
@@ -50,6 +53,12 @@ public:
 private:
 	MetaStorage& meta_storage_;
 	Downloader& downloader_;
+	monitored_strand& serial_strand_;
+
+	// Index is queried and updated here, Downloader is notified from serial_queue_.
+	// bulk_queue_ is destroyed first, so notifications, that it posts, are drained by serial_queue_ after it
+	ScopedAsyncQueue serial_queue_;
+	ScopedAsyncQueue bulk_queue_;
 };
 
 } /* namespace librevault */
@@ -34,11 +34,12 @@
 #include "folder/RemoteFolder.h"
 
 #include "util/log.h"
+#include <list>
 
 namespace librevault {
 
-MetaUploader::MetaUploader(MetaStorage& meta_storage, ChunkStorage& chunk_storage) :
-	meta_storage_(meta_storage), chunk_storage_(chunk_storage) {
+MetaUploader::MetaUploader(MetaStorage& meta_storage, ChunkStorage& chunk_storage, monitored_strand& serial_strand, io_service& bulk_ios) :
+	meta_storage_(meta_storage), chunk_storage_(chunk_storage), serial_strand_(serial_strand), bulk_queue_(bulk_ios) {
 	LOGFUNC();
 }
 
@@ -49,17 +50,28 @@ void MetaUploader::broadcast_meta(std::set<std::shared_ptr<RemoteFolder>> remote
 }
 
 void MetaUploader::handle_handshake(std::shared_ptr<RemoteFolder> remote) {
-	for(auto& meta : meta_storage_.index->get_meta()) {
-		remote->post_have_meta(meta.meta().path_revision(), chunk_storage_.make_bitfield(meta.meta()));
-	}
+	bulk_queue_.invoke_post([this, remote]{
+		std::list<std::pair<Meta::PathRevision, bitfield_type>> have_meta;
+		for(auto& meta : meta_storage_.index->get_meta())
+			have_meta.push_back({meta.meta().path_revision(), chunk_storage_.make_bitfield(meta.meta())});
+
+		serial_strand_.post([remote, have_meta]{
+			for(auto& revision_bitfield : have_meta)
+				remote->post_have_meta(revision_bitfield.first, revision_bitfield.second);
+		});
+	});
 }
 
 void MetaUploader::handle_meta_request(std::shared_ptr<RemoteFolder> origin, const Meta::PathRevision& revision) {
-	try {
-		origin->post_meta(meta_storage_.index->get_meta(revision), chunk_storage_.make_bitfield(meta_storage_.index->get_meta(revision).meta()));
-	}catch(AbstractFolder::no_such_meta& e){
-		LOGW("Requested nonexistent Meta");
-	}
+	bulk_queue_.invoke_post([this, origin, revision]{
+		try {
+			auto smeta = meta_storage_.index->get_meta(revision);
+			auto bitfield = chunk_storage_.make_bitfield(smeta.meta());
+			serial_strand_.post([origin, smeta, bitfield]{origin->post_meta(smeta, bitfield);});
+		}catch(AbstractFolder::no_such_meta& e){
+			LOGW("Requested nonexistent Meta");
+		}
+	});
 }
 
 } /* namespace librevault */
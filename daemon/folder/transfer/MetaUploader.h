@@ -28,6 +28,9 @@
  */
 #pragma once
 #include "util/log_scope.h"
+#include "util/monitored_strand.h"
+#include "util/network.h"
+#include "util/scoped_async_queue.h"
 #include <librevault/Meta.h>
 #include <librevault/util/bitfield_convert.h>
 #include <memory>
@@ -42,7 +45,7 @@ class ChunkStorage;
 class MetaUploader {
 	LOG_SCOPE("MetaUploader");
 public:
-	MetaUploader(MetaStorage& meta_storage, ChunkStorage& chunk_storage);
+	MetaUploader(MetaStorage& meta_storage, ChunkStorage& chunk_storage, monitored_strand& serial_strand, io_service& bulk_ios);
 
 	void broadcast_meta(std::set<std::shared_ptr<RemoteFolder>> remotes, const Meta::PathRevision& revision, const bitfield_type& bitfield);
 
@@ -53,6 +56,10 @@ public:
 private:
 	MetaStorage& meta_storage_;
 	ChunkStorage& chunk_storage_;
+	monitored_strand& serial_strand_;
+
+	// Metas are read and bitfields are computed here, replies are sent from serial_strand_
+	ScopedAsyncQueue bulk_queue_;
 };
 
 } /* namespace librevault */
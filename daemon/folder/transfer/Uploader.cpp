@@ -28,16 +28,38 @@
  */
 #include "Uploader.h"
 
+#include "control/Config.h"
 #include "folder/chunk/ChunkStorage.h"
+#include "folder/meta/Index.h"
+#include "folder/meta/MetaStorage.h"
 #include "folder/RemoteFolder.h"
 
 #include "util/log.h"
+#include <boost/range/adaptor/map.hpp>
+#include <algorithm>
+#include <list>
 
 namespace librevault {
 
-Uploader::Uploader(ChunkStorage& chunk_storage) :
-	chunk_storage_(chunk_storage) {
+Uploader::Uploader(ChunkStorage& chunk_storage, MetaStorage& meta_storage, monitored_strand& serial_strand, io_service& bulk_ios) :
+	chunk_storage_(chunk_storage), meta_storage_(meta_storage), serial_strand_(serial_strand),
+	bulk_queue_(bulk_ios), serial_queue_(serial_strand.get_io_service(), serial_strand.strand()),
+	random_engine_(std::random_device()()),
+	choke_process_(serial_strand.get_io_service(), serial_strand.strand(), [this](PeriodicProcess& process){choke_round(process);}) {
 	LOGFUNC();
+	choke_process_.invoke_after(CHOKE_INTERVAL);
+}
+
+Uploader::~Uploader() {
+	stopping_ = true;
+	choke_process_.wait();
+
+	// Handlers of both queues post to each other. Only the ones, that were running before stopping_ was set, may post more,
+	// so the second round drains the last of them.
+	for(int round = 0; round < 2; round++) {
+		bulk_queue_.wait();
+		serial_queue_.wait();
+	}
 }
 
 void Uploader::broadcast_chunk(std::set<std::shared_ptr<RemoteFolder>> remotes, const blob& ct_hash) {
@@ -48,33 +70,382 @@ void Uploader::broadcast_chunk(std::set<std::shared_ptr<RemoteFolder>> remotes,
 
 void Uploader::handle_interested(std::shared_ptr<RemoteFolder> remote) {
 	LOGFUNC();
+	if(!remote) return;
 
-	// TODO: write good choking algorithm.
-	remote->unchoke();
+	auto& state = peers_[remote];
+	state.interested = true;
+
+	// Free slots are given away right away, otherwise remote waits for the next choke round
+	if(remote->am_choking() && unchoked_count() < Config::get()->global_get("p2p_upload_slots").asUInt())
+		apply_choke(remote, state, true, false);
 }
 void Uploader::handle_not_interested(std::shared_ptr<RemoteFolder> remote) {
 	LOGFUNC();
+	if(!remote) return;
+
+	auto& state = peers_[remote];
+	state.interested = false;
+	apply_choke(remote, state, false, false);
+}
+
+/* Choking */
+size_t Uploader::unchoked_count() const {
+	size_t count = 0;
+	for(auto& peer : peers_)
+		if(!peer.first->am_choking()) count++;
+	return count;
+}
+
+void Uploader::apply_choke(std::shared_ptr<RemoteFolder> remote, PeerState& state, bool unchoke, bool optimistic) {
+	if(unchoke && remote->am_choking())
+		remote->unchoke();
+	else if(!unchoke && !remote->am_choking())
+		remote->choke();
+
+	state.stats.unchoked = unchoke;
+	state.stats.optimistic = optimistic;
+
+	std::lock_guard<std::mutex> lk(peer_stats_mtx_);
+	peer_stats_[remote] = state.stats;
+}
+
+/* Every round, upload slots are given to the interested remotes, that reciprocate best.
+ * Remotes in local network are preferred, as they don't consume internet bandwidth. When we are not downloading anything,
+ * remotes, that download from us faster, are preferred instead. One slot is given to a random remote, rotated every few rounds. */
+void Uploader::choke_round(PeriodicProcess& process) {
+	auto now = std::chrono::steady_clock::now();
+	float round_seconds = std::max(std::chrono::duration<float>(now - last_round_).count(), 1.0f);
+	last_round_ = now;
+
+	// Measure rates
+	bool downloading = false;
+	for(auto& peer : peers_) {
+		uint64_t up_bytes = peer.first->up_bytes_blocks(), down_bytes = peer.first->down_bytes_blocks();
+		peer.second.stats.up_rate = float(up_bytes - peer.second.last_up_bytes) / round_seconds;
+		peer.second.stats.down_rate = float(down_bytes - peer.second.last_down_bytes) / round_seconds;
+		peer.second.last_up_bytes = up_bytes;
+		peer.second.last_down_bytes = down_bytes;
+
+		downloading |= peer.second.stats.down_rate > 0;
+	}
+
+	std::vector<std::shared_ptr<RemoteFolder>> candidates;
+	for(auto& peer : peers_)
+		if(peer.second.interested && peer.first->ready()) candidates.push_back(peer.first);
+
+	std::stable_sort(candidates.begin(), candidates.end(), [&, this](const std::shared_ptr<RemoteFolder>& a, const std::shared_ptr<RemoteFolder>& b){
+		if(a->local() != b->local()) return a->local();
+		auto& stats_a = peers_.at(a).stats;
+		auto& stats_b = peers_.at(b).stats;
+		return downloading ? stats_a.down_rate > stats_b.down_rate : stats_a.up_rate > stats_b.up_rate;
+	});
+
+	size_t slots = std::max(Config::get()->global_get("p2p_upload_slots").asUInt(), 1u);
+	size_t regular_slots = candidates.size() > slots ? slots - 1 : slots;  // Reserve one slot for optimistic unchoke, if there is competition
+
+	std::set<std::shared_ptr<RemoteFolder>> unchoked(candidates.begin(), candidates.begin() + std::min(regular_slots, candidates.size()));
+
+	// Optimistic unchoke
+	std::shared_ptr<RemoteFolder> optimistic;
+	if(unchoked.size() < candidates.size()) {
+		optimistic = optimistic_unchoke_.lock();
+		auto optimistic_it = peers_.find(optimistic);
+		if(optimistic_it == peers_.end() || round_ % OPTIMISTIC_UNCHOKE_ROUNDS == 0 || unchoked.count(optimistic) || !optimistic_it->second.interested) {
+			std::uniform_int_distribution<size_t> distribution(unchoked.size(), candidates.size()-1);
+			optimistic = candidates[distribution(random_engine_)];
+		}
+		unchoked.insert(optimistic);
+	}
+	optimistic_unchoke_ = optimistic;
+	round_++;
+
+	for(auto& peer : peers_)
+		apply_choke(peer.first, peer.second, unchoked.count(peer.first) > 0, peer.first == optimistic);
 
-	// TODO: write good choking algorithm.
-	remote->choke();
+	expire_pinned();
+
+	process.invoke_after(CHOKE_INTERVAL);
+}
+
+Uploader::PeerStats Uploader::peer_stats(std::shared_ptr<RemoteFolder> remote) const {
+	std::lock_guard<std::mutex> lk(peer_stats_mtx_);
+	auto it = peer_stats_.find(remote);
+	return it != peer_stats_.end() ? it->second : PeerStats();
+}
+
+Uploader::CacheStats Uploader::cache_stats() const {
+	CacheStats stats;
+	stats.pinned = pinned_count_;
+	stats.prefetched = prefetched_count_;
+	stats.prefetch_hits = prefetch_hits_;
+	return stats;
 }
 
 void Uploader::handle_block_request(std::shared_ptr<RemoteFolder> origin, const blob& ct_hash, uint32_t offset, uint32_t size) {
-	try {
-		if(!origin->am_choking() && origin->peer_interested()) {
-			origin->post_block(ct_hash, offset, get_block(ct_hash, offset, size));
+	if(!origin) return;
+
+	auto& queue = pending_requests_[origin];
+	queue.requests.push_back({ct_hash, offset, size});
+	schedule_serving(origin, queue);
+}
+
+void Uploader::handle_block_cancel(std::shared_ptr<RemoteFolder> origin, const blob& ct_hash, uint32_t offset, uint32_t size) {
+	auto queue_it = pending_requests_.find(origin);
+	if(queue_it == pending_requests_.end()) return;
+
+	auto& queue = queue_it->second;
+	for(auto request_it = queue.requests.begin(); request_it != queue.requests.end(); ++request_it) {
+		if(request_it->offset == offset && request_it->size == size && request_it->ct_hash == ct_hash) {
+			queue.requests.erase(request_it);
+			break;
 		}
-	}catch(AbstractFolder::no_such_chunk& e){
-		LOGW("Requested nonexistent block");
 	}
+	// Empty queue with serve_request already posted is left in place, serve_request will erase it
+	if(queue.requests.empty() && !queue.scheduled)
+		pending_requests_.erase(queue_it);
 }
 
-blob Uploader::get_block(const blob& ct_hash, uint32_t offset, uint32_t size) {
-	auto chunk = chunk_storage_.get_chunk(ct_hash);
-	if(offset < chunk.size() && size <= chunk.size()-offset)
-		return blob(chunk.begin()+offset, chunk.begin()+offset+size);
+void Uploader::handle_send_ready(std::shared_ptr<RemoteFolder> remote) {
+	auto queue_it = pending_requests_.find(remote);
+	if(queue_it != pending_requests_.end())
+		schedule_serving(remote, queue_it->second);
+}
+
+void Uploader::erase_remote(std::shared_ptr<RemoteFolder> remote) {
+	pending_requests_.erase(remote);
+	read_positions_.erase(remote);
+	waiting_for_slot_.erase(remote);
+	peers_.erase(remote);
+	if(optimistic_unchoke_.lock() == remote)
+		optimistic_unchoke_.reset();
+
+	for(auto it = pinned_chunks_.begin(); it != pinned_chunks_.end();) {
+		it->second.readers.erase(remote);
+		if(it->second.readers.empty() && !it->second.loading)
+			it = pinned_chunks_.erase(it);
+		else
+			++it;
+	}
+	pinned_count_ = pinned_chunks_.size();
+	wake_waiting();
+
+	std::lock_guard<std::mutex> lk(peer_stats_mtx_);
+	peer_stats_.erase(remote);
+}
+
+void Uploader::schedule_serving(std::shared_ptr<RemoteFolder> remote, RequestQueue& queue) {
+	if(queue.scheduled || queue.requests.empty()) return;
+	if(stopping_) return;
+	queue.scheduled = true;
+	serial_queue_.invoke_post([this, remote]{serve_request(remote);});
+}
+
+void Uploader::serve_request(std::shared_ptr<RemoteFolder> remote) {
+	auto queue_it = pending_requests_.find(remote);
+	if(queue_it == pending_requests_.end()) return;
+
+	auto& queue = queue_it->second;
+	queue.scheduled = false;
+	if(queue.requests.empty()) {
+		pending_requests_.erase(queue_it);
+		return;
+	}
+
+	// Slow remotes are not fed more blocks, than they can take. Serving is resumed by handle_send_ready
+	if(remote->congested()) return;
+
+	// Serving is resumed by handle_chunk_loaded, so the serial thread is not blocked by disk reads
+	auto chunk = pin_chunk(queue.requests.front().ct_hash, remote);
+	if(!chunk) {
+		waiting_for_slot_.insert(remote);   // Resumed by wake_waiting
+		return;
+	}
+	if(chunk->loading) return;
+
+	BlockRequest request = std::move(queue.requests.front());
+	queue.requests.pop_front();
+
+	std::shared_ptr<blob> data = chunk->data;
+	if(data && request.offset < data->size() && request.size <= data->size()-request.offset) {
+		if(!remote->am_choking() && remote->peer_interested())
+			remote->post_block(request.ct_hash, request.offset, shared_buffer(data, data->data()+request.offset, request.size));
+		track_read(remote, request, data->size());
+	}else{
+		LOGW("Requested nonexistent block");
+		unpin_chunk(request.ct_hash, remote);
+	}
+
+	if(queue.requests.empty())
+		pending_requests_.erase(queue_it);
 	else
-		throw AbstractFolder::no_such_chunk();
+		schedule_serving(remote, queue);
+
+	// Chunk of this remote may be not needed anymore, so waiting remotes may take its slot
+	wake_waiting();
+}
+
+/* Chunk cache */
+Uploader::PinnedChunk* Uploader::pin_chunk(const blob& ct_hash, std::shared_ptr<RemoteFolder> remote) {
+	auto it = pinned_chunks_.find(ct_hash);
+	if(it == pinned_chunks_.end()) {
+		if(pinned_chunks_.size() >= std::max(Config::get()->global_get("p2p_upload_cache_chunks").asUInt(), 1u) && !free_slot())
+			return nullptr;
+
+		it = pinned_chunks_.emplace(ct_hash, PinnedChunk()).first;
+		pinned_count_ = pinned_chunks_.size();
+		load_chunk(ct_hash);
+	}else if(it->second.prefetched && it->second.data && remote) {
+		it->second.prefetched = false;
+		prefetch_hits_++;
+	}
+
+	if(remote)
+		it->second.readers.insert(remote);
+	it->second.last_access = std::chrono::steady_clock::now();
+	return &it->second;
+}
+
+void Uploader::unpin_chunk(const blob& ct_hash, std::shared_ptr<RemoteFolder> remote) {
+	auto it = pinned_chunks_.find(ct_hash);
+	if(it == pinned_chunks_.end()) return;
+
+	it->second.readers.erase(remote);
+	if(it->second.readers.empty() && !it->second.loading) {
+		pinned_chunks_.erase(it);
+		pinned_count_ = pinned_chunks_.size();
+		wake_waiting();
+	}
+}
+
+/* Drops the least recently used chunk, which is loaded and is not the next one to be read by any of its readers.
+ * Readers, that come back to it later, load it again. */
+bool Uploader::free_slot() {
+	auto victim = pinned_chunks_.end();
+	for(auto it = pinned_chunks_.begin(); it != pinned_chunks_.end(); ++it) {
+		if(it->second.loading) continue;
+
+		bool needed = std::any_of(it->second.readers.begin(), it->second.readers.end(), [&, this](const std::shared_ptr<RemoteFolder>& reader){
+			auto queue_it = pending_requests_.find(reader);
+			return queue_it != pending_requests_.end() && !queue_it->second.requests.empty() && queue_it->second.requests.front().ct_hash == it->first;
+		});
+		if(needed) continue;
+
+		// Chunks, that were prefetched, but not read, go first
+		if(victim == pinned_chunks_.end() || std::make_tuple(!it->second.prefetched, it->second.last_access) < std::make_tuple(!victim->second.prefetched, victim->second.last_access))
+			victim = it;
+	}
+	if(victim == pinned_chunks_.end()) return false;
+
+	pinned_chunks_.erase(victim);
+	pinned_count_ = pinned_chunks_.size();
+	return true;
+}
+
+void Uploader::wake_waiting() {
+	auto waiting = std::move(waiting_for_slot_);
+	waiting_for_slot_.clear();
+	for(auto& remote : waiting) {
+		auto queue_it = pending_requests_.find(remote);
+		if(queue_it != pending_requests_.end())
+			schedule_serving(remote, queue_it->second);
+	}
+}
+
+void Uploader::load_chunk(const blob& ct_hash) {
+	pinned_chunks_[ct_hash].loading = true;
+	if(stopping_) return;
+
+	bulk_queue_.invoke_post([this, ct_hash]{
+		std::shared_ptr<blob> data;
+		try {
+			data = chunk_storage_.get_chunk_ptr(ct_hash);
+		}catch(AbstractFolder::no_such_chunk& e) {}
+
+		if(stopping_) return;
+		serial_queue_.invoke_post([this, ct_hash, data]{handle_chunk_loaded(ct_hash, data);});
+	});
+}
+
+void Uploader::handle_chunk_loaded(const blob& ct_hash, std::shared_ptr<blob> data) {
+	auto it = pinned_chunks_.find(ct_hash);
+	if(it == pinned_chunks_.end()) return;
+
+	it->second.loading = false;
+	it->second.data = data;
+	it->second.last_access = std::chrono::steady_clock::now();
+
+	if(it->second.readers.empty()) {
+		pinned_chunks_.erase(it);
+		pinned_count_ = pinned_chunks_.size();
+		wake_waiting();
+		return;
+	}
+
+	for(auto& reader : it->second.readers) {
+		auto queue_it = pending_requests_.find(reader);
+		if(queue_it != pending_requests_.end())
+			schedule_serving(reader, queue_it->second);
+	}
+}
+
+/* A remote, that reads a chunk block after block, is likely to read the next chunks of the same file in the same way.
+ * Chunk is unpinned for the remote, when it reads the last block of it. */
+void Uploader::track_read(std::shared_ptr<RemoteFolder> remote, const BlockRequest& request, size_t chunk_size) {
+	auto& position = read_positions_[remote];
+	bool sequential = position.ct_hash == request.ct_hash && position.end == request.offset;
+	if(position.ct_hash != request.ct_hash) {
+		position.ct_hash = request.ct_hash;
+		position.prefetched = false;
+	}
+	position.end = request.offset + request.size;
+
+	if(position.end >= chunk_size)
+		unpin_chunk(request.ct_hash, remote);
+
+	if(sequential && !position.prefetched) {
+		position.prefetched = true;
+		prefetch_after(request.ct_hash, remote);
+	}
+}
+
+void Uploader::prefetch_after(const blob& ct_hash, std::shared_ptr<RemoteFolder> remote) {
+	if(pinned_chunks_.size() >= Config::get()->global_get("p2p_upload_cache_chunks").asUInt()) return;
+
+	if(stopping_) return;
+
+	bulk_queue_.invoke_post([this, ct_hash, remote]{
+		std::list<blob> next_chunks;
+		for(auto& smeta : meta_storage_.index->containing_chunk(ct_hash)) {
+			auto& chunks = smeta.meta().chunks();
+			auto chunk_it = std::find_if(chunks.begin(), chunks.end(), [&](const Meta::Chunk& chunk){return chunk.ct_hash == ct_hash;});
+			for(unsigned i = 0; i < PREFETCH_CHUNKS && chunk_it != chunks.end() && ++chunk_it != chunks.end(); i++)
+				if(chunk_storage_.have_chunk(chunk_it->ct_hash))
+					next_chunks.push_back(chunk_it->ct_hash);
+			if(!next_chunks.empty()) break;
+		}
+		if(next_chunks.empty() || stopping_) return;
+
+		serial_queue_.invoke_post([this, next_chunks, remote]{
+			size_t max_pinned = Config::get()->global_get("p2p_upload_cache_chunks").asUInt();
+			for(auto& next_ct_hash : next_chunks) {
+				if(pinned_chunks_.count(next_ct_hash) || pinned_chunks_.size() >= max_pinned) continue;
+				pin_chunk(next_ct_hash, remote)->prefetched = true;
+				prefetched_count_++;
+			}
+		});
+	});
+}
+
+void Uploader::expire_pinned() {
+	auto expired_before = std::chrono::steady_clock::now() - PINNED_CHUNK_TTL;
+	for(auto it = pinned_chunks_.begin(); it != pinned_chunks_.end();) {
+		if(!it->second.loading && it->second.last_access < expired_before)
+			it = pinned_chunks_.erase(it);
+		else
+			++it;
+	}
+	pinned_count_ = pinned_chunks_.size();
+	wake_waiting();
 }
 
 } /* namespace librevault */
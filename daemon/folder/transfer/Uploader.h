@@ -29,18 +29,34 @@
 #pragma once
 #include "util/log_scope.h"
 #include "util/blob.h"
+#include "util/monitored_strand.h"
+#include "util/network.h"
+#include "util/periodic_process.h"
+#include "util/scoped_async_queue.h"
+#include <atomic>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <set>
 
+#define CHOKE_INTERVAL std::chrono::seconds(10)
+#define OPTIMISTIC_UNCHOKE_ROUNDS 3 // Optimistic unchoke is rotated every 3 choke rounds
+#define PREFETCH_CHUNKS 2   // Chunks of the same Meta, loaded ahead of a sequential reader
+#define PINNED_CHUNK_TTL std::chrono::seconds(30)   // Pinned chunks, that are not read by anyone, are dropped after that
+
 namespace librevault {
 
 class RemoteFolder;
 class ChunkStorage;
+class MetaStorage;
 
 class Uploader {
 	LOG_SCOPE("Uploader");
 public:
-	Uploader(ChunkStorage& chunk_storage);
+	Uploader(ChunkStorage& chunk_storage, MetaStorage& meta_storage, monitored_strand& serial_strand, io_service& bulk_ios);
+	~Uploader();
 
 	void broadcast_chunk(std::set<std::shared_ptr<RemoteFolder>> remotes, const blob& ct_hash);
 
@@ -49,11 +65,106 @@ public:
 	void handle_not_interested(std::shared_ptr<RemoteFolder> remote);
 
 	void handle_block_request(std::shared_ptr<RemoteFolder> origin, const blob& ct_hash, uint32_t offset, uint32_t size);
+	void handle_block_cancel(std::shared_ptr<RemoteFolder> origin, const blob& ct_hash, uint32_t offset, uint32_t size);
+	void handle_send_ready(std::shared_ptr<RemoteFolder> remote);
+
+	void erase_remote(std::shared_ptr<RemoteFolder> remote);
+
+	struct PeerStats {
+		bool unchoked = false;
+		bool optimistic = false;
+		float up_rate = 0;      // Block bytes per second, uploaded to this remote during last choke round
+		float down_rate = 0;    // Block bytes per second, downloaded from this remote during last choke round
+	};
+	PeerStats peer_stats(std::shared_ptr<RemoteFolder> remote) const;  // Thread-safe
+
+	struct CacheStats {
+		size_t pinned = 0;
+		uint64_t prefetched = 0;
+		uint64_t prefetch_hits = 0;
+	};
+	CacheStats cache_stats() const;  // Thread-safe
 
 private:
 	ChunkStorage& chunk_storage_;
+	MetaStorage& meta_storage_;
+	monitored_strand& serial_strand_;
+
+	// Handlers, that capture this, are run through these, so ~Uploader can wait for them
+	ScopedAsyncQueue bulk_queue_;
+	ScopedAsyncQueue serial_queue_;
+	std::atomic<bool> stopping_ = {false};  // No new handlers are posted after it is set
+
+	/* Choking */
+	struct PeerState {
+		bool interested = false;
+		uint64_t last_up_bytes = 0;
+		uint64_t last_down_bytes = 0;
+		PeerStats stats;
+	};
+	std::map<std::shared_ptr<RemoteFolder>, PeerState> peers_;
+	std::weak_ptr<RemoteFolder> optimistic_unchoke_;
+	unsigned round_ = 0;
+	std::chrono::steady_clock::time_point last_round_ = std::chrono::steady_clock::now();
+	std::mt19937 random_engine_;
+
+	mutable std::mutex peer_stats_mtx_;
+	std::map<std::shared_ptr<RemoteFolder>, PeerStats> peer_stats_;
+
+	PeriodicProcess choke_process_;
+	void choke_round(PeriodicProcess& process);
+	void apply_choke(std::shared_ptr<RemoteFolder> remote, PeerState& state, bool unchoke, bool optimistic);
+	size_t unchoked_count() const;
+
+	/* Requests are queued and served one at a time, so a cancel, that arrives in the meantime, drops the reply */
+	struct BlockRequest {
+		blob ct_hash;
+		uint32_t offset;
+		uint32_t size;
+	};
+	struct RequestQueue {
+		std::deque<BlockRequest> requests;
+		bool scheduled = false; // serve_request is posted. Not set, while the queue waits for its chunk to load or for the remote to drain
+	};
+	std::map<std::shared_ptr<RemoteFolder>, RequestQueue> pending_requests_;
+
+	void schedule_serving(std::shared_ptr<RemoteFolder> remote, RequestQueue& queue);
+	void serve_request(std::shared_ptr<RemoteFolder> remote);
+
+	/* Chunk cache. Chunks are loaded on bulk_queue_ and stay pinned, until all their readers finish reading them.
+	 * Sequential readers get next chunks of the same Meta loaded in advance.
+	 * At most p2p_upload_cache_chunks are pinned. When it is reached, a chunk, that no reader needs right now, is dropped,
+	 * or the request waits until a chunk is unpinned. */
+	struct PinnedChunk {
+		std::shared_ptr<blob> data; // Empty, if chunk is not loaded (yet)
+		bool loading = false;
+		bool prefetched = false;    // Loaded in advance, and not read yet
+		std::set<std::shared_ptr<RemoteFolder>> readers;
+		std::chrono::steady_clock::time_point last_access;
+	};
+	std::map<blob, PinnedChunk> pinned_chunks_;
+
+	struct ReadPosition {
+		blob ct_hash;
+		uint32_t end = 0;
+		bool prefetched = false;    // Prefetch is already triggered for this chunk
+	};
+	std::map<std::shared_ptr<RemoteFolder>, ReadPosition> read_positions_;
+	std::set<std::shared_ptr<RemoteFolder>> waiting_for_slot_;
+
+	std::atomic<size_t> pinned_count_ = {0};
+	std::atomic<uint64_t> prefetched_count_ = {0};
+	std::atomic<uint64_t> prefetch_hits_ = {0};
 
-	blob get_block(const blob& ct_hash, uint32_t offset, uint32_t size);
+	PinnedChunk* pin_chunk(const blob& ct_hash, std::shared_ptr<RemoteFolder> remote);    // nullptr, if there is no free slot
+	void unpin_chunk(const blob& ct_hash, std::shared_ptr<RemoteFolder> remote);
+	bool free_slot();
+	void wake_waiting();
+	void load_chunk(const blob& ct_hash);
+	void handle_chunk_loaded(const blob& ct_hash, std::shared_ptr<blob> data);
+	void track_read(std::shared_ptr<RemoteFolder> remote, const BlockRequest& request, size_t chunk_size);
+	void prefetch_after(const blob& ct_hash, std::shared_ptr<RemoteFolder> remote);
+	void expire_pinned();
 };
 
 } /* namespace librevault */
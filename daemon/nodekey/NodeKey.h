@@ -46,6 +46,9 @@ public:
 	const private_key_t& private_key() const {return private_key_;}
 	const blob& public_key() const {return public_key_;}
 
+	X509* x509() const {return x509_;}
+	EVP_PKEY* openssl_pkey() const {return openssl_pkey_;}
+
 private:
 	private_key_t private_key_;
 	blob public_key_;
@@ -52,6 +52,17 @@ BandwidthCounter::Stats BandwidthCounter::heartbeat() {
 	return stats;
 }
 
+BandwidthCounter::Stats BandwidthCounter::totals() const {
+	Stats stats = {};
+
+	stats.down_bytes_ = down_bytes_;
+	stats.down_bytes_blocks_ = down_bytes_blocks_;
+	stats.up_bytes_ = up_bytes_;
+	stats.up_bytes_blocks_ = up_bytes_blocks_;
+
+	return stats;
+}
+
 void BandwidthCounter::add_down(uint64_t bytes) {
 	down_bytes_ += bytes;
 	down_bytes_last_ += bytes;
@@ -54,6 +54,7 @@ public:
 	BandwidthCounter();
 
 	Stats heartbeat();
+	Stats totals() const;   // Transferred bytes only, doesn't affect bandwidth measurement
 
 	void add_down(uint64_t bytes);
 	void add_down_blocks(uint64_t bytes);
@@ -0,0 +1,46 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "BandwidthLimiter.h"
+#include "control/Config.h"
+
+namespace librevault {
+
+BandwidthLimiter::BandwidthLimiter() :
+	upload_(std::make_shared<TokenBucket>(nullptr, Config::get()->global_get("p2p_upload_limit").asUInt64())),
+	download_(std::make_shared<TokenBucket>(nullptr, Config::get()->global_get("p2p_download_limit").asUInt64())) {
+
+	config_connection_ = Config::get()->config_changed.connect([this](const std::string& key, Json::Value value){
+		if(key == "p2p_upload_limit")
+			upload_->set_rate(value.asUInt64());
+		else if(key == "p2p_download_limit")
+			download_->set_rate(value.asUInt64());
+	});
+}
+
+} /* namespace librevault */
@@ -0,0 +1,54 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "util/TokenBucket.h"
+#include <boost/signals2/connection.hpp>
+
+namespace librevault {
+
+/* BandwidthLimiter holds root token buckets, which limit overall P2P traffic. Limits follow "p2p_upload_limit"
+ * and "p2p_download_limit" globals. Folders and peers make their own buckets, chained to these. */
+class BandwidthLimiter {
+public:
+	static BandwidthLimiter* get() {
+		static BandwidthLimiter* instance = new BandwidthLimiter();  // Thread-safe. Never destroyed, so it outlives Config signals
+		return instance;
+	}
+
+	std::shared_ptr<TokenBucket> upload() const {return upload_;}
+	std::shared_ptr<TokenBucket> download() const {return download_;}
+
+private:
+	BandwidthLimiter();
+
+	std::shared_ptr<TokenBucket> upload_, download_;
+	boost::signals2::scoped_connection config_connection_;
+};
+
+} /* namespace librevault */
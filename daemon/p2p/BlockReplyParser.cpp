@@ -0,0 +1,197 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "BlockReplyParser.h"
+#include "util/log.h"
+#include <librevault/protocol/V1Parser.h>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+namespace librevault {
+
+namespace {
+
+enum FastParserState {UNVERIFIED, VERIFIED, DISABLED};
+std::atomic<int> fast_parser_state(UNVERIFIED);
+std::atomic<int> fast_generator_state(UNVERIFIED);
+
+bool read_varint(const uint8_t*& pos, const uint8_t* end, uint64_t& value) {
+	value = 0;
+	for(unsigned shift = 0; shift < 64 && pos != end; shift += 7) {
+		uint8_t byte = *pos++;
+		value |= uint64_t(byte & 0x7F) << shift;
+		if(!(byte & 0x80)) return true;
+	}
+	return false;
+}
+
+void write_varint(blob& out, uint64_t value) {
+	while(value >= 0x80) {
+		out.push_back(uint8_t(value) | 0x80);
+		value >>= 7;
+	}
+	out.push_back(uint8_t(value));
+}
+
+} /* anonymous namespace */
+
+BlockReplyParser::BlockReply BlockReplyParser::parse(const shared_buffer& message) const {
+	if(fast_parser_state == DISABLED)
+		return parse_fallback(message);
+
+	BlockReply reply;
+	if(!parse_fast(message, reply))
+		return parse_fallback(message);   // Let V1Parser decide, what is wrong with the message
+
+	if(fast_parser_state == UNVERIFIED) {
+		BlockReply expected = parse_fallback(message);
+		bool equal = reply.ct_hash == expected.ct_hash && reply.offset == expected.offset
+			&& reply.content.size() == expected.content.size() && std::equal(reply.content.begin(), reply.content.end(), expected.content.begin());
+
+		fast_parser_state = equal ? VERIFIED : DISABLED;
+		if(!equal) {
+			LOGW("Zero-copy parser disagrees with V1Parser, falling back to V1Parser");
+			return expected;
+		}
+	}
+	return reply;
+}
+
+bool BlockReplyParser::parse_fast(const shared_buffer& message, BlockReply& reply) const {
+	if(message.empty() || message[0] != V1Parser::BLOCK_REPLY) return false;
+
+	const uint8_t* pos = message.begin() + 1;
+	const uint8_t* end = message.end();
+
+	bool have_content = false;
+	while(pos != end) {
+		uint64_t key, value;
+		if(!read_varint(pos, end, key)) return false;
+
+		switch(key & 0x07) {
+			case 0: // varint
+				if(!read_varint(pos, end, value)) return false;
+				if((key >> 3) == 2) {
+					if(value > std::numeric_limits<uint32_t>::max()) return false;
+					reply.offset = uint32_t(value);
+				}
+				break;
+			case 2: // length-delimited
+				if(!read_varint(pos, end, value) || value > uint64_t(end - pos)) return false;
+				if((key >> 3) == 1)
+					reply.ct_hash.assign(pos, pos + value);
+				else if((key >> 3) == 3) {
+					reply.content = message.slice(pos - message.begin(), value);
+					have_content = true;
+				}
+				pos += value;
+				break;
+			case 1: // 64-bit
+				if(end - pos < 8) return false;
+				pos += 8;
+				break;
+			case 5: // 32-bit
+				if(end - pos < 4) return false;
+				pos += 4;
+				break;
+			default:
+				return false;
+		}
+	}
+	return have_content;
+}
+
+BlockReplyParser::BlockReply BlockReplyParser::parse_fallback(const shared_buffer& message) const {
+	auto message_struct = V1Parser().parse_BlockReply(message.to_blob());
+
+	BlockReply reply;
+	reply.ct_hash = std::move(message_struct.ct_hash);
+	reply.offset = message_struct.offset;
+	reply.content = shared_buffer(std::move(message_struct.content));
+	return reply;
+}
+
+BlockReplyParser::EncodedBlockReply BlockReplyParser::gen(const blob& ct_hash, uint32_t offset, const shared_buffer& content) const {
+	if(fast_generator_state == DISABLED)
+		return gen_fallback(ct_hash, offset, content);
+
+	EncodedBlockReply encoded;
+	encoded.header = gen_header(ct_hash, offset, content.size());
+	encoded.content = content;
+	encoded.block_size = content.size();
+
+	if(fast_generator_state == UNVERIFIED) {
+		V1Parser::BlockReply message_struct;
+		message_struct.ct_hash = ct_hash;
+		message_struct.offset = offset;
+		message_struct.content = content.to_blob();
+		blob expected = V1Parser().gen_BlockReply(message_struct);
+
+		bool equal = expected.size() == encoded.size()
+			&& std::equal(encoded.header.begin(), encoded.header.end(), expected.begin())
+			&& std::equal(encoded.content.begin(), encoded.content.end(), expected.begin() + encoded.header.size());
+
+		fast_generator_state = equal ? VERIFIED : DISABLED;
+		if(!equal) {
+			LOGW("Zero-copy generator disagrees with V1Parser, falling back to V1Parser");
+			encoded.header = std::move(expected);
+			encoded.content = shared_buffer();
+		}
+	}
+	return encoded;
+}
+
+blob BlockReplyParser::gen_header(const blob& ct_hash, uint32_t offset, size_t content_size) const {
+	blob header;
+	header.reserve(1 + 1+10+ct_hash.size() + 1+5 + 1+10);
+
+	header.push_back(V1Parser::BLOCK_REPLY);
+	write_varint(header, (1 << 3) | 2);    // ct_hash
+	write_varint(header, ct_hash.size());
+	header.insert(header.end(), ct_hash.begin(), ct_hash.end());
+	write_varint(header, (2 << 3) | 0);    // offset
+	write_varint(header, offset);
+	write_varint(header, (3 << 3) | 2);    // content, the data itself goes after the header
+	write_varint(header, content_size);
+	return header;
+}
+
+BlockReplyParser::EncodedBlockReply BlockReplyParser::gen_fallback(const blob& ct_hash, uint32_t offset, const shared_buffer& content) const {
+	V1Parser::BlockReply message_struct;
+	message_struct.ct_hash = ct_hash;
+	message_struct.offset = offset;
+	message_struct.content = content.to_blob();
+
+	EncodedBlockReply encoded;
+	encoded.header = V1Parser().gen_BlockReply(message_struct);
+	encoded.block_size = content.size();
+	return encoded;
+}
+
+} /* namespace librevault */
@@ -0,0 +1,67 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "util/blob.h"
+#include "util/log_scope.h"
+#include "util/shared_buffer.h"
+
+namespace librevault {
+
+/* BlockReplyParser decodes BLOCK_REPLY without copying the block content: the content is returned as a slice of the received message.
+ * It reads the protobuf encoding directly, so the first parsed message is also parsed by V1Parser and compared. If they disagree,
+ * or the message is not understood, V1Parser is used.
+ * Outgoing BLOCK_REPLY is encoded the same way: only the header is generated, the content is appended to it by the transport. */
+class BlockReplyParser {
+	LOG_SCOPE("BlockReplyParser");
+public:
+	struct BlockReply {
+		blob ct_hash;
+		uint32_t offset = 0;
+		shared_buffer content;
+	};
+
+	struct EncodedBlockReply {
+		blob header;            // Everything before the content
+		shared_buffer content;  // Sent right after the header
+		size_t block_size = 0;  // Size of the block itself, for rate limiting
+		size_t size() const {return header.size() + content.size();}
+	};
+
+	BlockReply parse(const shared_buffer& message) const;
+	EncodedBlockReply gen(const blob& ct_hash, uint32_t offset, const shared_buffer& content) const;
+
+private:
+	bool parse_fast(const shared_buffer& message, BlockReply& reply) const;
+	BlockReply parse_fallback(const shared_buffer& message) const;
+
+	blob gen_header(const blob& ct_hash, uint32_t offset, size_t content_size) const;
+	EncodedBlockReply gen_fallback(const blob& ct_hash, uint32_t offset, const shared_buffer& content) const;
+};
+
+} /* namespace librevault */
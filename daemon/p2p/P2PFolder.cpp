@@ -28,6 +28,7 @@
  */
 #include "P2PFolder.h"
 #include "WSService.h"
+#include "BandwidthLimiter.h"
 #include "control/Config.h"
 #include "folder/FolderGroup.h"
 #include "folder/FolderService.h"
@@ -42,14 +43,31 @@ P2PFolder::P2PFolder(P2PProvider& provider, WSService& ws_service, NodeKey& node
 	provider_(provider),
 	ws_service_(ws_service),
 	node_key_(node_key),
-	ping_process_(ios, [this](PeriodicProcess& process){send_ping(); process.invoke_after(std::chrono::seconds(60), PeriodicProcess::NO_RESET_TIMER);}),
-	timeout_process_(ios, [this](PeriodicProcess& process){LOGFUNC();ws_service_.close(conn_.connection_handle, "Connection lost");}) {
+	strand_(ios),
+	block_timer_(ios),
+	ping_process_(ios, strand_, [this](PeriodicProcess& process){send_ping(); process.invoke_after(std::chrono::seconds(60), PeriodicProcess::NO_RESET_TIMER);}),
+	timeout_process_(ios, strand_, [this](PeriodicProcess& process){LOGFUNC();ws_service_.close(conn_.connection_handle, "Connection lost");}) {
 
 	std::ostringstream os; os << conn_.remote_endpoint;
 	name_ = os.str();
 	LOGD("Created");
 
-	group_ = folder_service.get_group(conn_.hash);
+	auto group = folder_service.get_group(conn_.hash);
+	group_ = group;
+
+	send_high_watermark_ = Config::get()->global_get("p2p_send_buffer_high").asUInt64();
+	send_low_watermark_ = send_high_watermark_ / 2;
+
+	upload_bucket_ = std::make_shared<TokenBucket>(group ? group->upload_bucket() : BandwidthLimiter::get()->upload(),
+		Config::get()->global_get("p2p_upload_limit_peer").asUInt64());
+	download_bucket_ = std::make_shared<TokenBucket>(group ? group->download_bucket() : BandwidthLimiter::get()->download(),
+		Config::get()->global_get("p2p_download_limit_peer").asUInt64());
+	limits_connection_ = Config::get()->config_changed.connect([this](const std::string& key, Json::Value value){
+		if(key == "p2p_upload_limit_peer")
+			upload_bucket_->set_rate(value.asUInt64());
+		else if(key == "p2p_download_limit_peer")
+			download_bucket_->set_rate(value.asUInt64());
+	});
 }
 
 P2PFolder::~P2PFolder() {
@@ -65,8 +83,90 @@ blob P2PFolder::remote_token() {
 }
 
 void P2PFolder::send_message(const blob& message) {
+	upload_bucket_->charge(message.size(), false);
+	transmit(message);
+}
+
+void P2PFolder::transmit(const blob& message) {
 	counter_.add_up(message.size());
-	ws_service_.send_message(conn_.connection_handle, message);
+	if(conn_.multiplexed)
+		ws_service_.send_channel_message(conn_.connection_handle, conn_.channel, message);
+	else
+		ws_service_.send_message(conn_.connection_handle, message);
+}
+
+void P2PFolder::transmit(const BlockReplyParser::EncodedBlockReply& message) {
+	counter_.add_up(message.size());
+	if(conn_.multiplexed)
+		ws_service_.send_channel_message(conn_.connection_handle, conn_.channel, message.header, message.content);
+	else
+		ws_service_.send_message(conn_.connection_handle, message.header, message.content);
+}
+
+void P2PFolder::send_blocks() {
+	bool drained = false;
+	{
+		std::unique_lock<std::mutex> lk(block_queue_mtx_);
+		for(;;) {
+			size_t buffered = ws_service_.buffered_amount(conn_.connection_handle);
+			if(congested_ && queued_bytes_ + buffered < send_low_watermark_) {
+				congested_ = false;
+				drained = true;
+			}
+
+			if(block_queue_.empty()) {
+				if(congested_)
+					wait_blocks(SEND_POLL_INTERVAL);   // Nothing to send, but the transport is still draining
+				else
+					block_sending_ = false;
+				break;
+			}
+			if(buffered >= send_high_watermark_) {
+				wait_blocks(SEND_POLL_INTERVAL);
+				break;
+			}
+
+			auto& message = block_queue_.front();
+			if(!block_reserved_) {
+				block_reserved_ = true;
+				upload_bucket_->charge(message.size() - message.block_size, false);
+				auto delay = upload_bucket_->reserve(message.block_size, true);
+				if(delay > std::chrono::steady_clock::duration::zero()) {
+					wait_blocks(delay);
+					break;
+				}
+			}
+
+			transmit(message);
+			counter_.add_up_blocks(message.block_size);
+
+			queued_bytes_ -= message.size();
+			block_queue_.pop_front();
+			block_reserved_ = false;
+		}
+	}
+	if(drained)
+		send_ready();
+}
+
+void P2PFolder::wait_blocks(std::chrono::steady_clock::duration delay) {
+	block_timer_.expires_from_now(delay);
+	block_timer_.async_wait(strand_.wrap([this, self = std::weak_ptr<RemoteFolder>(shared_from_this())](const boost::system::error_code& ec){
+		if(ec == boost::asio::error::operation_aborted) return;
+		if(auto self_ptr = self.lock())
+			send_blocks();
+	}));
+}
+
+P2PFolder::SendQueueStats P2PFolder::send_queue_stats() {
+	SendQueueStats stats;
+	stats.buffered = ws_service_.buffered_amount(conn_.connection_handle);
+
+	std::unique_lock<std::mutex> lk(block_queue_mtx_);
+	stats.blocks = block_queue_.size();
+	stats.bytes = queued_bytes_;
+	stats.congested = congested_;
+	return stats;
 }
 
 void P2PFolder::perform_handshake() {
@@ -177,18 +277,23 @@ void P2PFolder::request_block(const blob& ct_hash, uint32_t offset, uint32_t len
 		<< " offset=" << offset
 		<< " length=" << length);
 }
-void P2PFolder::post_block(const blob& ct_hash, uint32_t offset, const blob& block) {
-	V1Parser::BlockReply message;
-	message.ct_hash = ct_hash;
-	message.offset = offset;
-	message.content = block;
-	send_message(parser_.gen_BlockReply(message));
-
-	counter_.add_up_blocks(block.size());
+void P2PFolder::post_block(const blob& ct_hash, uint32_t offset, const shared_buffer& block) {
+	auto message = block_reply_parser_.gen(ct_hash, offset, block);
 
 	LOGD("==> BLOCK_REPLY:"
 		<< " ct_hash=" << ct_hash_readable(ct_hash)
 		<< " offset=" << offset);
+
+	{
+		std::unique_lock<std::mutex> lk(block_queue_mtx_);
+		queued_bytes_ += message.size();
+		if(queued_bytes_ + ws_service_.buffered_amount(conn_.connection_handle) >= send_high_watermark_)
+			congested_ = true;
+		block_queue_.push_back(std::move(message));
+		if(block_sending_) return;  // Will be sent after previous blocks
+		block_sending_ = true;
+	}
+	send_blocks();
 }
 void P2PFolder::cancel_block(const blob& ct_hash, uint32_t offset, uint32_t length) {
 	V1Parser::BlockCancel message;
@@ -202,10 +307,18 @@ void P2PFolder::cancel_block(const blob& ct_hash, uint32_t offset, uint32_t leng
 		<< " length=" << length);
 }
 
-void P2PFolder::handle_message(const blob& message_raw) {
-	V1Parser::message_type message_type = parser_.parse_MessageType(message_raw);
+void P2PFolder::handle_message(const shared_buffer& message) {
+	counter_.add_down(message.size());
+
+	// Blocks are passed down as views into the received message, other messages are small enough to be copied
+	if(ready() && !message.empty() && message[0] == V1Parser::BLOCK_REPLY) {
+		handle_BlockReply(message);
+		return;
+	}
 
-	counter_.add_down(message_raw.size());
+	blob message_raw = message.to_blob();
+	V1Parser::message_type message_type = parser_.parse_MessageType(message_raw);
+	download_bucket_->charge(message_raw.size(), false);
 
 	if(ready()) {
 		switch(message_type) {
@@ -219,7 +332,6 @@ void P2PFolder::handle_message(const blob& message_raw) {
 			case V1Parser::META_REPLY: handle_MetaReply(message_raw); break;
 			case V1Parser::META_CANCEL: handle_MetaCancel(message_raw); break;
 			case V1Parser::BLOCK_REQUEST: handle_BlockRequest(message_raw); break;
-			case V1Parser::BLOCK_REPLY: handle_BlockReply(message_raw); break;
 			case V1Parser::BLOCK_CANCEL: handle_BlockCancel(message_raw); break;
 			default: throw protocol_error();
 		}
@@ -326,7 +438,6 @@ void P2PFolder::handle_MetaReply(const blob& message_raw) {
 	recv_meta_reply(message_struct.smeta, message_struct.bitfield);
 }
 void P2PFolder::handle_MetaCancel(const blob& message_raw) {
-#   warning "Not implemented yet"
 	LOGFUNC();
 
 	auto message_struct = parser_.parse_MetaCancel(message_raw);
@@ -348,20 +459,21 @@ void P2PFolder::handle_BlockRequest(const blob& message_raw) {
 
 	recv_block_request(message_struct.ct_hash, message_struct.offset, message_struct.length);
 }
-void P2PFolder::handle_BlockReply(const blob& message_raw) {
+void P2PFolder::handle_BlockReply(const shared_buffer& message_raw) {
 	LOGFUNC();
 
-	auto message_struct = parser_.parse_BlockReply(message_raw);
+	auto message_struct = block_reply_parser_.parse(message_raw);
 	LOGD("<== BLOCK_REPLY:"
 		<< " ct_hash=" << ct_hash_readable(message_struct.ct_hash)
 		<< " offset=" << message_struct.offset);
 
 	counter_.add_down_blocks(message_struct.content.size());
+	download_bucket_->charge(message_struct.content.size(), true);
+	download_bucket_->charge(message_raw.size() - message_struct.content.size(), false);
 
 	recv_block_reply(message_struct.ct_hash, message_struct.offset, message_struct.content);
 }
 void P2PFolder::handle_BlockCancel(const blob& message_raw) {
-#   warning "Not implemented yet"
 	LOGFUNC();
 
 	auto message_struct = parser_.parse_BlockCancel(message_raw);
@@ -373,12 +485,33 @@ void P2PFolder::handle_BlockCancel(const blob& message_raw) {
 	recv_block_cancel(message_struct.ct_hash, message_struct.offset, message_struct.length);
 }
 
+bool P2PFolder::local() const {
+	address addr = remote_endpoint().address();
+	if(addr.is_v6() && addr.to_v6().is_v4_mapped())
+		addr = addr.to_v6().to_v4();
+
+	if(addr.is_v4()) {
+		auto bytes = addr.to_v4().to_bytes();
+		return bytes[0] == 10 || bytes[0] == 127
+			|| (bytes[0] == 172 && (bytes[1] & 0xF0) == 16)
+			|| (bytes[0] == 192 && bytes[1] == 168)
+			|| (bytes[0] == 169 && bytes[1] == 254);
+	}else{
+		auto addr_v6 = addr.to_v6();
+		return addr_v6.is_loopback() || addr_v6.is_link_local() || (addr_v6.to_bytes()[0] & 0xFE) == 0xFC;   // fc00::/7 Unique local
+	}
+}
+
 void P2PFolder::bump_timeout() {
 	timeout_process_.invoke_after(std::chrono::seconds(120), PeriodicProcess::RESET_TIMER);
 }
 
 void P2PFolder::send_ping() {
 	auto ms_since_epoch = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch());
+
+	// Channels of one connection get the same pongs, so it is enough, that one of them pings
+	if(conn_.multiplexed && ms_since_epoch - std::chrono::milliseconds(last_pong_) < std::chrono::seconds(60)) return;
+
 	ws_service_.ping(conn_.connection_handle, std::to_string(ms_since_epoch.count()));
 }
 
@@ -388,11 +521,12 @@ void P2PFolder::handle_ping(std::string payload) {
 
 void P2PFolder::handle_pong(std::string payload) {
 	bump_timeout();
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch());
+	last_pong_ = now.count();
 	try {
-		auto now = std::chrono::steady_clock::now().time_since_epoch();
 		std::chrono::milliseconds ms_payload(stol(payload));
 		if(now - ms_payload > std::chrono::milliseconds(0))
-			rtt_ = std::chrono::duration_cast<std::chrono::milliseconds>(now - ms_payload);
+			rtt_ = (now - ms_payload).count();
 	}catch(std::exception& e){}
 }
 
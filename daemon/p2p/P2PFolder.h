@@ -31,10 +31,20 @@
 #include "P2PProvider.h"
 #include "WSService.h"
 #include "BandwidthCounter.h"
+#include "BlockReplyParser.h"
 #include "util/periodic_process.h"
+#include "util/TokenBucket.h"
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/signals2/connection.hpp>
+#include <atomic>
+#include <deque>
+#include <mutex>
 #include <librevault/protocol/V1Parser.h>
 #include <websocketpp/common/connection_hdl.hpp>
 
+#define SEND_POLL_INTERVAL std::chrono::milliseconds(10) // Transport is checked that often, while it is full
+
 namespace librevault {
 
 class FolderGroup;
@@ -63,10 +73,26 @@ public:
 	const blob& remote_pubkey() const {return conn_.remote_pubkey;}
 	const tcp_endpoint& remote_endpoint() const {return conn_.remote_endpoint;}
 	const WSService::connection::role_type role() const {return conn_.role;}
+	bool multiplexed() const {return conn_.multiplexed;}
+	uint16_t channel() const {return conn_.channel;}
 	const std::string& client_name() const {return client_name_;}
 	const std::string& user_agent() const {return user_agent_;}
 	std::shared_ptr<FolderGroup> folder_group() const {return std::shared_ptr<FolderGroup>(group_);}
 	BandwidthCounter::Stats heartbeat_stats() {return counter_.heartbeat();}
+	uint64_t down_bytes_blocks() const {return counter_.totals().down_bytes_blocks_;}
+	uint64_t up_bytes_blocks() const {return counter_.totals().up_bytes_blocks_;}
+	bool local() const;
+
+	const TokenBucket& upload_bucket() const {return *upload_bucket_;}
+	const TokenBucket& download_bucket() const {return *download_bucket_;}
+
+	struct SendQueueStats {
+		size_t blocks = 0;      // Block replies, waiting in our queue
+		size_t bytes = 0;       // Their size
+		size_t buffered = 0;    // Bytes, already passed to the transport, but not sent
+		bool congested = false;
+	};
+	SendQueueStats send_queue_stats();  // Thread-safe
 
 	blob local_token();
 	blob remote_token();
@@ -77,6 +103,8 @@ public:
 	// Handshake
 	void perform_handshake();
 	bool ready() const {return is_handshaken_;}
+	bool congested() const {return congested_;}
+	std::chrono::milliseconds rtt() const {return std::chrono::milliseconds(rtt_);}   // Thread-safe
 
 	/* Message senders */
 	void choke();
@@ -92,25 +120,49 @@ public:
 	void cancel_meta(const Meta::PathRevision& revision);
 
 	void request_block(const blob& ct_hash, uint32_t offset, uint32_t size);
-	void post_block(const blob& ct_hash, uint32_t offset, const blob& block);
+	void post_block(const blob& ct_hash, uint32_t offset, const shared_buffer& block);
 	void cancel_block(const blob& ct_hash, uint32_t offset, uint32_t size);
 
 protected:
 	const WSService::connection conn_;
 	std::weak_ptr<FolderGroup> group_;
 
-	void handle_message(const blob& message);
+	void handle_message(const shared_buffer& message);
 
 private:
 	P2PProvider& provider_;
 	WSService& ws_service_;
 	NodeKey& node_key_;
 
+	// Handlers of this connection are serialized on it, while the connections are served by many threads
+	boost::asio::io_service::strand strand_;
+
 	V1Parser parser_;   // Protocol parser
-	bool is_handshaken_ = false;
+	BlockReplyParser block_reply_parser_;
+	std::atomic<bool> is_handshaken_ = {false};
 
 	BandwidthCounter counter_;
 
+	/* Rate limiting and backpressure. Blocks wait for their turn, other messages are charged, but sent right away.
+	 * Blocks are also held back, while the transport has more than send_high_watermark_ bytes buffered, so control messages
+	 * don't queue up behind them. Remote is reported congested, until our queue and the transport drain below the low watermark. */
+	std::shared_ptr<TokenBucket> upload_bucket_, download_bucket_;
+	boost::signals2::scoped_connection limits_connection_;
+
+	std::mutex block_queue_mtx_;
+	std::deque<BlockReplyParser::EncodedBlockReply> block_queue_;   // Content stays in the uploader's chunk until sent
+	bool block_sending_ = false;
+	bool block_reserved_ = false;   // Front of block_queue_ is already charged
+	size_t queued_bytes_ = 0;
+	size_t send_high_watermark_, send_low_watermark_;
+	std::atomic<bool> congested_ = {false};
+	boost::asio::steady_timer block_timer_;
+
+	void send_blocks();
+	void wait_blocks(std::chrono::steady_clock::duration delay);
+	void transmit(const blob& message);
+	void transmit(const BlockReplyParser::EncodedBlockReply& message);
+
 	// These needed primarily for UI
 	std::string client_name_;
 	std::string user_agent_;
@@ -125,7 +177,9 @@ private:
 	void handle_ping(std::string payload);
 	void handle_pong(std::string payload);
 
-	std::chrono::milliseconds rtt_;
+	// Written on the connection strand, read by the folder's transfer threads
+	std::atomic<int64_t> rtt_ = {0};   // Milliseconds
+	std::atomic<int64_t> last_pong_ = {0};    // Milliseconds of steady_clock
 
 	/* Message handlers */
 	void handle_Handshake(const blob& message_raw);
@@ -143,7 +197,7 @@ private:
 	void handle_MetaCancel(const blob& message_raw);
 
 	void handle_BlockRequest(const blob& message_raw);
-	void handle_BlockReply(const blob& message_raw);
+	void handle_BlockReply(const shared_buffer& message_raw);
 	void handle_BlockCancel(const blob& message_raw);
 };
 
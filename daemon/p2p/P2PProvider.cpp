@@ -28,10 +28,12 @@
  */
 #include "P2PProvider.h"
 #include "P2PFolder.h"
+#include "control/Config.h"
 #include "folder/FolderGroup.h"
 #include "nat/PortMappingService.h"
 #include "nodekey/NodeKey.h"
 
+#include "RawService.h"
 #include "WSServer.h"
 #include "WSClient.h"
 
@@ -40,6 +42,7 @@ namespace librevault {
 P2PProvider::P2PProvider(NodeKey& node_key, PortMappingService& port_mapping, FolderService& folder_service) :
 	ios_("P2PProvider"), node_key_(node_key) {
 	LOGFUNC();
+	raw_service_ = std::make_unique<RawService>(ios_.ios(), *this, port_mapping, node_key, folder_service);
 	ws_server_ = std::make_unique<WSServer>(ios_.ios(), *this, port_mapping, node_key, folder_service);
 	ws_client_ = std::make_unique<WSClient>(ios_.ios(), *this, node_key, folder_service);
 	LOGFUNCEND();
@@ -51,8 +54,23 @@ P2PProvider::~P2PProvider() {
 	LOGFUNCEND();
 }
 
+void P2PProvider::run() {
+	// Every connection is served on its own strand, so connections are spread over the threads
+	unsigned threads = Config::get()->global_get("p2p_threads").asUInt();
+	ios_.start(threads ? threads : std::max(std::thread::hardware_concurrency(), 1u));
+}
+
 void P2PProvider::add_node(DiscoveryService::ConnectCredentials node_cred, std::shared_ptr<FolderGroup> group_ptr) {
-	ws_client_->connect(node_cred, group_ptr);
+	// One connection to a node carries all folders, shared with it, if the node supports that
+	if(raw_service_->open_channel(node_cred, group_ptr) || ws_client_->open_channel(node_cred, group_ptr) || ws_server_->open_channel(node_cred, group_ptr))
+		return;
+
+	// Raw connection is preferred, if the node told us about it. If it fails, we are back here, and it is forgotten
+	tcp_endpoint raw_endpoint;
+	if(find_raw_endpoint(node_cred, raw_endpoint))
+		raw_service_->connect(raw_endpoint, node_cred, group_ptr);
+	else
+		ws_client_->connect(node_cred, group_ptr);
 }
 
 void P2PProvider::mark_loopback(const tcp_endpoint& endpoint) {
@@ -70,4 +88,38 @@ bool P2PProvider::is_loopback(const blob& pubkey) {
 	return node_key_.public_key() == pubkey;
 }
 
+uint16_t P2PProvider::raw_port() {
+	return raw_service_->public_port();
+}
+
+void P2PProvider::mark_raw_endpoint(const blob& pubkey, const tcp_endpoint& endpoint, const tcp_endpoint& raw_endpoint) {
+	std::unique_lock<std::mutex> lk(raw_endpoints_mtx_);
+	raw_endpoints_by_pubkey_[pubkey] = raw_endpoint;
+	raw_endpoints_by_endpoint_[endpoint] = raw_endpoint;
+	LOGD("Node " << endpoint << " accepts raw connections on " << raw_endpoint);
+}
+
+void P2PProvider::forget_raw_endpoint(const tcp_endpoint& raw_endpoint) {
+	std::unique_lock<std::mutex> lk(raw_endpoints_mtx_);
+	for(auto it = raw_endpoints_by_pubkey_.begin(); it != raw_endpoints_by_pubkey_.end();)
+		it = it->second == raw_endpoint ? raw_endpoints_by_pubkey_.erase(it) : std::next(it);
+	for(auto it = raw_endpoints_by_endpoint_.begin(); it != raw_endpoints_by_endpoint_.end();)
+		it = it->second == raw_endpoint ? raw_endpoints_by_endpoint_.erase(it) : std::next(it);
+}
+
+bool P2PProvider::find_raw_endpoint(const DiscoveryService::ConnectCredentials& node_cred, tcp_endpoint& raw_endpoint) {
+	std::unique_lock<std::mutex> lk(raw_endpoints_mtx_);
+	auto pubkey_it = raw_endpoints_by_pubkey_.find(node_cred.pubkey);
+	if(!node_cred.pubkey.empty() && pubkey_it != raw_endpoints_by_pubkey_.end()) {
+		raw_endpoint = pubkey_it->second;
+		return true;
+	}
+	auto endpoint_it = raw_endpoints_by_endpoint_.find(node_cred.endpoint);
+	if(node_cred.endpoint != tcp_endpoint() && endpoint_it != raw_endpoints_by_endpoint_.end()) {
+		raw_endpoint = endpoint_it->second;
+		return true;
+	}
+	return false;
+}
+
 } /* namespace librevault */
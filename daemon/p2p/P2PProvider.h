@@ -30,6 +30,7 @@
 #include <discovery/DiscoveryService.h>
 #include <util/network.h>
 #include <util/log_scope.h>
+#include <map>
 #include <set>
 #include <mutex>
 
@@ -37,6 +38,7 @@ namespace librevault {
 
 class WSServer;
 class WSClient;
+class RawService;
 
 class PortMappingService;
 class NodeKey;
@@ -49,7 +51,7 @@ public:
 	P2PProvider(NodeKey& node_key, PortMappingService& port_mapping, FolderService& folder_service);
 	virtual ~P2PProvider();
 
-	void run() {ios_.start(1);}
+	void run();
 	void stop() {ios_.stop();}
 
 	void add_node(DiscoveryService::ConnectCredentials node_cred, std::shared_ptr<FolderGroup> group_ptr);
@@ -59,6 +61,11 @@ public:
 	bool is_loopback(const tcp_endpoint& endpoint);
 	bool is_loopback(const blob& pubkey);
 
+	/* Raw connections */
+	uint16_t raw_port();
+	void mark_raw_endpoint(const blob& pubkey, const tcp_endpoint& endpoint, const tcp_endpoint& raw_endpoint);
+	void forget_raw_endpoint(const tcp_endpoint& raw_endpoint);
+
 private:
 	multi_io_service ios_;
 	NodeKey& node_key_;
@@ -66,10 +73,18 @@ private:
 	/* WebSocket sockets */
 	std::unique_ptr<WSServer> ws_server_;
 	std::unique_ptr<WSClient> ws_client_;
+	std::unique_ptr<RawService> raw_service_;
 
 	/* Loopback detection */
 	std::set<tcp_endpoint> loopback_blacklist_;
 	std::mutex loopback_blacklist_mtx_;
+
+	/* Raw connections. Endpoints are learned from WebSocket servers, by their public key and WebSocket endpoint */
+	std::map<blob, tcp_endpoint> raw_endpoints_by_pubkey_;
+	std::map<tcp_endpoint, tcp_endpoint> raw_endpoints_by_endpoint_;
+	std::mutex raw_endpoints_mtx_;
+
+	bool find_raw_endpoint(const DiscoveryService::ConnectCredentials& node_cred, tcp_endpoint& raw_endpoint);
 };
 
 } /* namespace librevault */
@@ -0,0 +1,381 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "RawService.h"
+#include "control/Config.h"
+#include "folder/FolderGroup.h"
+#include "folder/FolderService.h"
+#include "nat/PortMappingService.h"
+#include "util/parse_url.h"
+#include <util/log.h>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+
+namespace librevault {
+
+RawService::RawService(io_service& ios, P2PProvider& provider, PortMappingService& port_mapping, NodeKey& node_key, FolderService& folder_service) :
+		WSService(ios, provider, node_key, folder_service), port_mapping_(port_mapping) {
+	auto listen = Config::get()->global_get("p2p_raw_listen").asString();
+	if(listen.empty()) return;
+
+	url bind_url = url(listen);
+	auto endpoint = tcp_endpoint(address::from_string(bind_url.host), bind_url.port);
+
+	acceptor_ = std::make_unique<boost::asio::ip::tcp::acceptor>(ios_);
+	acceptor_->open(endpoint.protocol());
+	acceptor_->set_option(boost::asio::socket_base::reuse_address(true));
+	acceptor_->bind(endpoint);
+	acceptor_->listen();
+	accept();
+
+	LOGI("Listening for raw connections on " << acceptor_->local_endpoint());
+
+	// Port mapping
+	port_mapping_.add_port_mapping("raw", {acceptor_->local_endpoint().port(), SOCK_STREAM}, "Librevault raw");
+}
+
+RawService::~RawService() {
+	if(acceptor_)
+		port_mapping_.remove_port_mapping("raw");
+}
+
+uint16_t RawService::public_port() {
+	if(!acceptor_) return 0;
+
+	uint16_t mapped_port = port_mapping_.get_port_mapping("raw");
+	return mapped_port ? mapped_port : acceptor_->local_endpoint().port();
+}
+
+std::shared_ptr<RawService::raw_connection> RawService::raw(websocketpp::connection_hdl hdl) {
+	return std::static_pointer_cast<raw_connection>(hdl.lock());
+}
+
+void RawService::accept() {
+	auto conn = std::make_shared<raw_connection>(ios_, shared_ssl_ctx());
+	conn->role = connection::SERVER;
+
+	acceptor_->async_accept(conn->socket.lowest_layer(), [this, conn](const boost::system::error_code& ec){
+		if(ec == boost::asio::error::operation_aborted) return;
+		if(!ec) {
+			boost::system::error_code endpoint_ec;
+			conn->endpoint = conn->socket.lowest_layer().remote_endpoint(endpoint_ec);
+			conn->strand.dispatch([this, conn]{start(conn);});
+		}
+		accept();
+	});
+}
+
+void RawService::connect(const tcp_endpoint& raw_endpoint, DiscoveryService::ConnectCredentials node_credentials, std::shared_ptr<FolderGroup> group_ptr) {
+	LOGFUNC();
+
+	if(provider_.is_loopback(raw_endpoint) || (!node_credentials.pubkey.empty() && provider_.is_loopback(node_credentials.pubkey))) {
+		LOGD("Refusing to connect to loopback node: " << raw_endpoint);
+		return;
+	}
+	if(!node_credentials.pubkey.empty() && group_ptr->have_p2p_dir(node_credentials.pubkey)) {
+		LOGD("Refusing to connect to existing node: " << raw_endpoint);
+		return;
+	}
+
+	auto conn = std::make_shared<raw_connection>(ios_, shared_ssl_ctx());
+	conn->role = connection::CLIENT;
+	conn->endpoint = raw_endpoint;
+
+	add_assignment(websocketpp::connection_hdl(conn), [&](connection& assigned){
+		assigned.hash = group_ptr->hash();
+		assigned.dialed = node_credentials;
+	});
+
+	LOGD("Added node " << raw_endpoint);
+
+	conn->socket.lowest_layer().async_connect(raw_endpoint, conn->strand.wrap([this, conn](const boost::system::error_code& ec){
+		if(ec)
+			fail(conn, ec);
+		else
+			start(conn);
+	}));
+}
+
+void RawService::start(std::shared_ptr<raw_connection> conn) {
+	on_tcp_pre_init(websocketpp::connection_hdl(conn));
+	arm_timer(conn, RAW_HANDSHAKE_TIMEOUT);
+
+	auto handshake_type = conn->role == connection::CLIENT ? boost::asio::ssl::stream_base::client : boost::asio::ssl::stream_base::server;
+	conn->socket.async_handshake(handshake_type, conn->strand.wrap(std::bind(&RawService::handle_handshake, this, conn, std::placeholders::_1)));
+}
+
+void RawService::handle_handshake(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec) {
+	if(ec) {
+		fail(conn, ec);
+		return;
+	}
+
+	websocketpp::connection_hdl hdl(conn);
+	try {
+		on_tcp_post_init(hdl);
+	}catch(std::exception& e) {
+		LOGFUNC() << " e:" << e.what();
+		fail(conn, boost::asio::error::access_denied);
+		return;
+	}
+
+	on_open(hdl);
+	read_frame(conn);
+}
+
+/* Reading */
+void RawService::read_frame(std::shared_ptr<raw_connection> conn) {
+	boost::asio::async_read(conn->socket, boost::asio::buffer(conn->read_header),
+		conn->strand.wrap(std::bind(&RawService::handle_header, this, conn, std::placeholders::_1)));
+}
+
+void RawService::handle_header(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec) {
+	if(ec) {
+		fail(conn, ec);
+		return;
+	}
+
+	auto& header = conn->read_header;
+	uint32_t size = uint32_t(header[0]) << 24 | uint32_t(header[1]) << 16 | uint32_t(header[2]) << 8 | uint32_t(header[3]);
+	if(size > RAW_MAX_FRAME_SIZE) {
+		fail(conn, boost::asio::error::message_size);
+		return;
+	}
+
+	// Payload is read into its own buffer, so messages can be passed down without copying
+	conn->read_payload = std::make_shared<blob>(size);
+	boost::asio::async_read(conn->socket, boost::asio::buffer(*conn->read_payload),
+		conn->strand.wrap(std::bind(&RawService::handle_payload, this, conn, std::placeholders::_1)));
+}
+
+void RawService::handle_payload(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec) {
+	if(ec) {
+		fail(conn, ec);
+		return;
+	}
+
+	websocketpp::connection_hdl hdl(conn);
+	auto payload = std::move(conn->read_payload);
+
+	conn->last_frame = std::chrono::steady_clock::now();
+	if(!conn->active) {
+		conn->active = true;
+		arm_timer(conn, RAW_IDLE_TIMEOUT / 2);
+	}
+	switch(conn->read_header[4]) {
+		case MESSAGE:
+			on_message(hdl, shared_buffer(payload, payload->data(), payload->size()));
+			break;
+		case PING:
+			if(on_ping(hdl, std::string(payload->begin(), payload->end())))
+				pong(hdl, std::string(payload->begin(), payload->end()));
+			break;
+		case PONG:
+			on_pong(hdl, std::string(payload->begin(), payload->end()));
+			break;
+		case CLOSE:
+			LOGD("Connection closed by remote: " << std::string(payload->begin(), payload->end()));
+			fail(conn, boost::asio::error::eof);
+			return;
+		default:;   // May be sent by newer versions
+	}
+
+	read_frame(conn);
+}
+
+/* Writing */
+void RawService::send_frame(websocketpp::connection_hdl hdl, frame_type type, blob header, shared_buffer content, bool last) {
+	auto conn = raw(hdl);
+	if(!conn) return;
+
+	raw_connection::frame frame;
+	uint32_t size = header.size() + content.size();
+	frame.prefix = {{uint8_t(size >> 24), uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size), type}};
+	frame.header = std::move(header);
+	frame.content = std::move(content);
+	frame.last = last;
+
+	std::unique_lock<std::mutex> lk(conn->write_mtx);
+	if(conn->closed || (!conn->write_queue.empty() && conn->write_queue.back().last)) return;
+
+	conn->buffered += frame.prefix.size() + size;
+	conn->write_queue.push_back(std::move(frame));
+	if(conn->writing) return;   // Will be written after previous frames
+	conn->writing = true;
+	conn->strand.post([this, conn]{write_frame(conn);});
+}
+
+void RawService::write_frame(std::shared_ptr<raw_connection> conn) {
+	std::vector<boost::asio::const_buffer> buffers;
+	{
+		// Front frame is not touched by others, until it is written
+		std::unique_lock<std::mutex> lk(conn->write_mtx);
+		auto& frame = conn->write_queue.front();
+		buffers.push_back(boost::asio::buffer(frame.prefix));
+		buffers.push_back(boost::asio::buffer(frame.header));
+		buffers.push_back(boost::asio::buffer(frame.content.data(), frame.content.size()));
+	}
+
+	boost::asio::async_write(conn->socket, buffers,
+		conn->strand.wrap(std::bind(&RawService::handle_write, this, conn, std::placeholders::_1)));
+}
+
+void RawService::handle_write(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec) {
+	if(ec) {
+		fail(conn, ec);
+		return;
+	}
+
+	bool last, more;
+	{
+		std::unique_lock<std::mutex> lk(conn->write_mtx);
+		auto& frame = conn->write_queue.front();
+		conn->buffered -= frame.prefix.size() + frame.header.size() + frame.content.size();
+		last = frame.last;
+		conn->write_queue.pop_front();
+
+		more = !last && !conn->write_queue.empty();
+		conn->writing = more;
+	}
+
+	if(last)
+		fail(conn, boost::asio::error::eof);
+	else if(more)
+		write_frame(conn);
+}
+
+void RawService::fail(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec) {
+	{
+		std::unique_lock<std::mutex> lk(conn->write_mtx);
+		if(conn->closed) return;
+		conn->closed = true;
+		conn->ec = ec;
+	}
+	LOGD("Connection to " << conn->endpoint << " closed: " << ec.message());
+
+	boost::system::error_code close_ec;
+	conn->timer.cancel(close_ec);
+	conn->socket.lowest_layer().close(close_ec);
+
+	// If we couldn't reach the node this way, its folders are connected by WebSocket
+	websocketpp::connection_hdl hdl(conn);
+	std::vector<std::pair<DiscoveryService::ConnectCredentials, std::weak_ptr<FolderGroup>>> fallback;
+	{
+		std::lock_guard<std::mutex> lk(ws_assignment_mtx_);
+		auto conn_it = ws_assignment_.find(hdl);
+		if(conn->role == connection::CLIENT && conn_it != ws_assignment_.end() && !conn_it->second.open) {
+			fallback.emplace_back(conn_it->second.dialed, folder_service_.get_group(conn_it->second.hash));
+			fallback.insert(fallback.end(), conn_it->second.pending.begin(), conn_it->second.pending.end());
+		}
+	}
+
+	on_disconnect(hdl);
+
+	if(!fallback.empty()) {
+		provider_.forget_raw_endpoint(conn->endpoint);
+		for(auto& pending_group : fallback)
+			if(auto group_ptr = pending_group.second.lock())
+				provider_.add_node(pending_group.first, group_ptr);
+	}
+}
+
+/* Deadlines */
+void RawService::arm_timer(std::shared_ptr<raw_connection> conn, std::chrono::steady_clock::duration timeout) {
+	conn->timer.expires_from_now(timeout);
+	conn->timer.async_wait(conn->strand.wrap(std::bind(&RawService::handle_timer, this, conn, std::placeholders::_1)));
+}
+
+void RawService::handle_timer(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec) {
+	if(ec == boost::asio::error::operation_aborted || conn->closed) return;
+	auto now = std::chrono::steady_clock::now();
+	if(conn->timer.expires_at() > now) return;  // Rearmed, while this handler was queued
+
+	auto idle = now - conn->last_frame;
+	if(!conn->active || idle >= RAW_IDLE_TIMEOUT) {
+		fail(conn, boost::asio::error::timed_out);
+		return;
+	}
+
+	// Pong is a frame too, so a live remote doesn't hit the deadline
+	if(idle >= RAW_IDLE_TIMEOUT / 2) {
+		auto ms_since_epoch = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch());
+		ping(websocketpp::connection_hdl(conn), std::to_string(ms_since_epoch.count()));
+	}
+	arm_timer(conn, RAW_IDLE_TIMEOUT / 2);
+}
+
+/* Handlers */
+void RawService::on_tcp_pre_init(websocketpp::connection_hdl hdl) {
+	LOGFUNC();
+	auto conn = raw(hdl);
+	prepare_connection(hdl, conn->role, conn->socket.native_handle(), conn->endpoint);
+}
+
+void RawService::on_tcp_post_init(websocketpp::connection_hdl hdl) {
+	LOGFUNC();
+	auto conn = raw(hdl);
+	establish_connection(hdl, conn->socket.native_handle(), conn->endpoint);
+}
+
+/* Actions */
+void RawService::send_message(websocketpp::connection_hdl hdl, const blob& message) {
+	send_frame(hdl, MESSAGE, message);
+}
+
+void RawService::send_message(websocketpp::connection_hdl hdl, const blob& header, const shared_buffer& content) {
+	// Content is written to the socket right from the view, it is kept alive until then
+	send_frame(hdl, MESSAGE, header, content);
+}
+
+void RawService::ping(websocketpp::connection_hdl hdl, std::string message) {
+	send_frame(hdl, PING, blob(message.begin(), message.end()));
+}
+
+void RawService::pong(websocketpp::connection_hdl hdl, std::string message) {
+	send_frame(hdl, PONG, blob(message.begin(), message.end()));
+}
+
+void RawService::close(websocketpp::connection_hdl hdl, const std::string& reason) {
+	LOGFUNC();
+	send_frame(hdl, CLOSE, blob(reason.begin(), reason.end()), shared_buffer(), true);
+}
+
+size_t RawService::buffered_amount(websocketpp::connection_hdl hdl) {
+	auto conn = raw(hdl);
+	if(!conn) return 0;
+
+	std::unique_lock<std::mutex> lk(conn->write_mtx);
+	return conn->buffered;
+}
+
+std::string RawService::errmsg(websocketpp::connection_hdl hdl) {
+	auto conn = raw(hdl);
+	return std::string("asio: ") + (conn ? conn->ec.message() : std::string());
+}
+
+} /* namespace librevault */
@@ -0,0 +1,130 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "WSService.h"
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+#include <array>
+#include <deque>
+
+#define RAW_MAX_FRAME_SIZE (10 * 1024 * 1024)
+#define RAW_HANDSHAKE_TIMEOUT std::chrono::seconds(10)  // TLS handshake and the first frame
+#define RAW_IDLE_TIMEOUT std::chrono::seconds(120)  // Remote is pinged after a half of it
+
+namespace librevault {
+
+class PortMappingService;
+
+/* Raw TLS transport. Frames are a big-endian 32-bit payload length and a type byte, followed by the payload.
+ * There is no HTTP upgrade, no masking and payloads are written straight from the caller's buffers.
+ * Connections are always multiplexed: folders are opened as channels, the same way as on "librevault-mux" WebSocket connections.
+ * The listening port is advertised to WebSocket clients in a response header, so they use it next time they connect. */
+class RawService : public WSService {
+	LOG_SCOPE("RawService");
+public:
+	RawService(io_service& ios, P2PProvider& provider, PortMappingService& port_mapping, NodeKey& node_key, FolderService& folder_service);
+	virtual ~RawService();
+
+	void connect(const tcp_endpoint& raw_endpoint, DiscoveryService::ConnectCredentials node_credentials, std::shared_ptr<FolderGroup> group_ptr);
+
+	uint16_t public_port();  // 0, if raw connections are not accepted
+
+	/* Actions */
+	void send_message(websocketpp::connection_hdl hdl, const blob& message) override;
+	void send_message(websocketpp::connection_hdl hdl, const blob& header, const shared_buffer& content) override;
+	void ping(websocketpp::connection_hdl hdl, std::string message) override;
+	void pong(websocketpp::connection_hdl hdl, std::string message) override;
+
+private:
+	enum frame_type : uint8_t {MESSAGE = 0, PING = 1, PONG = 2, CLOSE = 3};
+
+	struct raw_connection {
+		raw_connection(io_service& ios, std::shared_ptr<ssl_context> ssl_ctx) : ssl_ctx(std::move(ssl_ctx)), socket(ios, *this->ssl_ctx), strand(ios), timer(ios) {}
+
+		std::shared_ptr<ssl_context> ssl_ctx;
+		ssl_socket socket;
+		boost::asio::io_service::strand strand;   // All socket operations and handlers
+		connection::role_type role;
+		tcp_endpoint endpoint;
+		bool closed = false;
+		boost::system::error_code ec;
+
+		boost::asio::steady_timer timer;    // Handshake, then idle deadline
+		bool active = false;    // Received a frame
+		std::chrono::steady_clock::time_point last_frame;
+
+		std::array<uint8_t, 5> read_header;
+		std::shared_ptr<blob> read_payload;
+
+		struct frame {
+			std::array<uint8_t, 5> prefix;
+			blob header;
+			shared_buffer content;
+			bool last = false;  // Connection is closed after this frame
+		};
+		std::mutex write_mtx;
+		std::deque<frame> write_queue;  // Front is being written
+		bool writing = false;
+		size_t buffered = 0;
+	};
+
+	PortMappingService& port_mapping_;
+	std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor_;
+
+	std::shared_ptr<raw_connection> raw(websocketpp::connection_hdl hdl);
+
+	void accept();
+	void start(std::shared_ptr<raw_connection> conn);
+	void handle_handshake(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec);
+
+	void read_frame(std::shared_ptr<raw_connection> conn);
+	void handle_header(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec);
+	void handle_payload(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec);
+
+	void send_frame(websocketpp::connection_hdl hdl, frame_type type, blob header, shared_buffer content = shared_buffer(), bool last = false);
+	void write_frame(std::shared_ptr<raw_connection> conn);
+	void handle_write(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec);
+
+	void fail(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec);
+
+	void arm_timer(std::shared_ptr<raw_connection> conn, std::chrono::steady_clock::duration timeout);
+	void handle_timer(std::shared_ptr<raw_connection> conn, const boost::system::error_code& ec);
+
+	/* Handlers */
+	void on_tcp_pre_init(websocketpp::connection_hdl hdl) override;
+	void on_tcp_post_init(websocketpp::connection_hdl hdl) override;
+
+	/* Actions */
+	std::string subprotocol(websocketpp::connection_hdl hdl) override {return subprotocol_mux_;}
+	void close(websocketpp::connection_hdl hdl, const std::string& reason) override;
+	size_t buffered_amount(websocketpp::connection_hdl hdl) override;
+	std::string errmsg(websocketpp::connection_hdl hdl) override;
+};
+
+} /* namespace librevault */
@@ -41,10 +41,10 @@ WSClient::WSClient(io_service& ios, P2PProvider& provider, NodeKey& node_key, Fo
 	ws_client_.set_max_message_size(10 * 1024 * 1024);
 
 	// Handlers
-	ws_client_.set_tcp_pre_init_handler(std::bind(&WSClient::on_tcp_pre_init, this, std::placeholders::_1, connection::CLIENT));
+	ws_client_.set_tcp_pre_init_handler(std::bind(&WSClient::on_tcp_pre_init, this, std::placeholders::_1));
 	ws_client_.set_tls_init_handler(std::bind(&WSClient::on_tls_init, this, std::placeholders::_1));
 	ws_client_.set_tcp_post_init_handler(std::bind(&WSClient::on_tcp_post_init, this, std::placeholders::_1));
-	ws_client_.set_open_handler(std::bind(&WSClient::on_open, this, std::placeholders::_1));
+	ws_client_.set_open_handler(std::bind(&WSClient::on_open_internal, this, std::placeholders::_1));
 	ws_client_.set_message_handler(std::bind(&WSClient::on_message_internal, this, std::placeholders::_1, std::placeholders::_2));
 	ws_client_.set_fail_handler(std::bind(&WSClient::on_disconnect, this, std::placeholders::_1));
 	ws_client_.set_close_handler(std::bind(&WSClient::on_disconnect, this, std::placeholders::_1));
@@ -89,8 +89,10 @@ void WSClient::connect(DiscoveryService::ConnectCredentials node_credentials, st
 	}
 
 	// Assign websocketpp connection_hdl to internal P2PFolder connection
-	connection& conn = ws_assignment_[websocketpp::connection_hdl(connection_ptr)];
-	conn.hash = group_ptr->hash();
+	add_assignment(websocketpp::connection_hdl(connection_ptr), [&](connection& conn){
+		conn.hash = group_ptr->hash();
+		conn.dialed = node_credentials;
+	});
 
 	LOGD("Added node " << std::string(node_credentials.url));
 
@@ -114,8 +116,25 @@ bool WSClient::already_have(const DiscoveryService::ConnectCredentials& node_cre
 	return false;
 }
 
+void WSClient::on_open_internal(websocketpp::connection_hdl hdl) {
+	// Server accepts raw connections, so they are used next time we connect to it
+	std::string raw_port = ws_client_.get_con_from_hdl(hdl)->get_response_header(raw_port_header_);
+	if(!raw_port.empty()) {
+		try {
+			connection conn = assignment(hdl);
+			provider_.mark_raw_endpoint(conn.remote_pubkey, conn.remote_endpoint, tcp_endpoint(conn.remote_endpoint.address(), std::stoi(raw_port)));
+		}catch(std::exception& e) {
+			LOGD("Wrong " << raw_port_header_ << ": " << raw_port);
+		}
+	}
+
+	on_open(hdl);
+}
+
 void WSClient::on_message_internal(websocketpp::connection_hdl hdl, client::message_ptr message_ptr) {
-	on_message(hdl, message_ptr->get_payload());
+	// Payload is not copied, the message is kept alive by the views into it
+	const std::string& payload = message_ptr->get_payload();
+	on_message(hdl, shared_buffer(message_ptr, (const uint8_t*)payload.data(), payload.size()));
 }
 
 std::string WSClient::dir_hash_to_query(const blob& dir_hash) {
@@ -127,6 +146,15 @@ void WSClient::send_message(websocketpp::connection_hdl hdl, const blob& message
 	ws_client_.get_con_from_hdl(hdl)->send(message.data(), message.size());
 }
 
+void WSClient::send_message(websocketpp::connection_hdl hdl, const blob& header, const shared_buffer& content) {
+	LOGFUNC();
+	// Payload is assembled right in the outgoing message, content is copied once
+	auto message = std::make_shared<client::message_type>(nullptr, websocketpp::frame::opcode::binary, header.size() + content.size());
+	message->append_payload(header.data(), header.size());
+	message->append_payload(content.data(), content.size());
+	ws_client_.get_con_from_hdl(hdl)->send(message);
+}
+
 void WSClient::ping(websocketpp::connection_hdl hdl, std::string message) {
 	LOGFUNC();
 	ws_client_.get_con_from_hdl(hdl)->ping(message);
@@ -47,6 +47,7 @@ public:
 
 	/* Actions */
 	void send_message(websocketpp::connection_hdl hdl, const blob& message) override;
+	void send_message(websocketpp::connection_hdl hdl, const blob& header, const shared_buffer& content) override;
 	void ping(websocketpp::connection_hdl hdl, std::string message) override;
 	void pong(websocketpp::connection_hdl hdl, std::string message) override;
 
@@ -54,7 +55,9 @@ private:
 	client ws_client_;
 
 	/* Handlers */
+	void on_tcp_pre_init(websocketpp::connection_hdl hdl) override { WSService::on_tcp_pre_init(ws_client_, hdl, connection::CLIENT); }
 	void on_tcp_post_init(websocketpp::connection_hdl hdl) override { WSService::on_tcp_post_init(ws_client_, hdl); }
+	void on_open_internal(websocketpp::connection_hdl hdl);
 	void on_message_internal(websocketpp::connection_hdl hdl, client::message_ptr message_ptr);
 
 	/* Util */
@@ -64,6 +67,12 @@ private:
 	void close(websocketpp::connection_hdl hdl, const std::string& reason) override {
 		WSService::close(ws_client_, hdl, reason);
 	}
+	std::string subprotocol(websocketpp::connection_hdl hdl) override {
+		return WSService::subprotocol(ws_client_, hdl);
+	}
+	size_t buffered_amount(websocketpp::connection_hdl hdl) override {
+		return WSService::buffered_amount(ws_client_, hdl);
+	}
 	std::string errmsg(websocketpp::connection_hdl hdl) override;
 
 	bool is_loopback(const DiscoveryService::ConnectCredentials& node_credentials);
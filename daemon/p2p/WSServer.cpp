@@ -49,7 +49,7 @@ WSServer::WSServer(io_service& ios, P2PProvider& provider, PortMappingService& p
 	ws_server_.set_max_message_size(10 * 1024 * 1024);
 
 	// Handlers
-	ws_server_.set_tcp_pre_init_handler(std::bind(&WSServer::on_tcp_pre_init, this, std::placeholders::_1, connection::SERVER));
+	ws_server_.set_tcp_pre_init_handler(std::bind(&WSServer::on_tcp_pre_init, this, std::placeholders::_1));
 	ws_server_.set_tls_init_handler(std::bind(&WSServer::on_tls_init, this, std::placeholders::_1));
 	ws_server_.set_tcp_post_init_handler(std::bind(&WSServer::on_tcp_post_init, this, std::placeholders::_1));
 	ws_server_.set_validate_handler(std::bind(&WSServer::on_validate, this, std::placeholders::_1));
@@ -90,19 +90,29 @@ bool WSServer::on_validate(websocketpp::connection_hdl hdl) {
 
 	// Query validation
 	LOGD("Query: " << connection_ptr->get_uri()->get_resource());
-	ws_assignment_[hdl].hash = query_to_dir_hash(connection_ptr->get_uri()->get_resource());
+	blob hash = query_to_dir_hash(connection_ptr->get_uri()->get_resource());
+	with_assignment(hdl, [&](connection& conn){conn.hash = hash;});
 
-	// Subprotocol management
+	// Subprotocol management. Multiplexing is preferred, if the client supports it
 	auto subprotocols = connection_ptr->get_requested_subprotocols();
-	if(std::find(subprotocols.begin(), subprotocols.end(), subprotocol_) != subprotocols.end()) {
-		connection_ptr->select_subprotocol(subprotocol_);
-		return true;
-	}else
-		return false;
+	for(auto subprotocol : {subprotocol_mux_, subprotocol_}) {
+		if(std::find(subprotocols.begin(), subprotocols.end(), subprotocol) != subprotocols.end()) {
+			connection_ptr->select_subprotocol(subprotocol);
+
+			// Raw connections are multiplexed, so only clients, that can multiplex, are told about them
+			uint16_t raw_port = provider_.raw_port();
+			if(raw_port && subprotocol == subprotocol_mux_)
+				connection_ptr->append_header(raw_port_header_, std::to_string(raw_port));
+			return true;
+		}
+	}
+	return false;
 }
 
 void WSServer::on_message_internal(websocketpp::connection_hdl hdl, server::message_ptr message_ptr) {
-	on_message(hdl, message_ptr->get_payload());
+	// Payload is not copied, the message is kept alive by the views into it
+	const std::string& payload = message_ptr->get_payload();
+	on_message(hdl, shared_buffer(message_ptr, (const uint8_t*)payload.data(), payload.size()));
 }
 
 blob WSServer::query_to_dir_hash(const std::string& query) {
@@ -114,6 +124,15 @@ void WSServer::send_message(websocketpp::connection_hdl hdl, const blob& message
 	ws_server_.get_con_from_hdl(hdl)->send(message.data(), message.size());
 }
 
+void WSServer::send_message(websocketpp::connection_hdl hdl, const blob& header, const shared_buffer& content) {
+	LOGFUNC();
+	// Payload is assembled right in the outgoing message, content is copied once
+	auto message = std::make_shared<server::message_type>(nullptr, websocketpp::frame::opcode::binary, header.size() + content.size());
+	message->append_payload(header.data(), header.size());
+	message->append_payload(content.data(), content.size());
+	ws_server_.get_con_from_hdl(hdl)->send(message);
+}
+
 void WSServer::ping(websocketpp::connection_hdl hdl, std::string message) {
 	LOGFUNC();
 	ws_server_.get_con_from_hdl(hdl)->ping(message);
@@ -48,6 +48,9 @@ protected:
 	mutable server ws_server_;
 
 	/* Handlers */
+	void on_tcp_pre_init(websocketpp::connection_hdl hdl) override {
+		WSService::on_tcp_pre_init(ws_server_, hdl, connection::SERVER);
+	}
 	void on_tcp_post_init(websocketpp::connection_hdl hdl) override {
 		WSService::on_tcp_post_init(ws_server_, hdl);
 	}
@@ -59,11 +62,18 @@ protected:
 
 	/* Actions */
 	void send_message(websocketpp::connection_hdl hdl, const blob& message) override;
+	void send_message(websocketpp::connection_hdl hdl, const blob& header, const shared_buffer& content) override;
 	void ping(websocketpp::connection_hdl hdl, std::string message) override;
 	void pong(websocketpp::connection_hdl hdl, std::string message) override;
 	void close(websocketpp::connection_hdl hdl, const std::string& reason) override {
 		WSService::close(ws_server_, hdl, reason);
 	}
+	std::string subprotocol(websocketpp::connection_hdl hdl) override {
+		return WSService::subprotocol(ws_server_, hdl);
+	}
+	size_t buffered_amount(websocketpp::connection_hdl hdl) override {
+		return WSService::buffered_amount(ws_server_, hdl);
+	}
 	std::string errmsg(websocketpp::connection_hdl hdl) override;
 };
 
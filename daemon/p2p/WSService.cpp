@@ -30,15 +30,17 @@
 #include "WSServer.h"
 #include "WSClient.h"
 #include "P2PFolder.h"
-#include "control/Paths.h"
 #include "folder/FolderGroup.h"
 #include "folder/FolderService.h"
+#include "nodekey/NodeKey.h"
 #include <util/log.h>
-#include <codecvt>
+#include <cstring>
 
 namespace librevault {
 
 const char* WSService::subprotocol_ = "librevault";
+const char* WSService::subprotocol_mux_ = "librevault-mux";
+const char* WSService::raw_port_header_ = "X-Librevault-Raw-Port";
 
 WSService::WSService(io_service& ios, P2PProvider& provider, NodeKey& node_key, FolderService& folder_service) : ios_(ios), provider_(provider), node_key_(node_key), folder_service_(folder_service) {}
 
@@ -56,13 +58,51 @@ std::shared_ptr<ssl_context> WSService::make_ssl_ctx() {
 	);
 
 	ssl_ctx_ptr->set_verify_mode(boost::asio::ssl::verify_peer | boost::asio::ssl::verify_fail_if_no_peer_cert);
-	ssl_ctx_ptr->use_certificate_file(Paths::get()->cert_path.string(std::codecvt_utf8_utf16<wchar_t>()), ssl_context::pem);
-	ssl_ctx_ptr->use_private_key_file(Paths::get()->key_path.string(std::codecvt_utf8_utf16<wchar_t>()), ssl_context::pem);
+	ssl_ctx_ptr->set_verify_callback(std::bind(&WSService::on_tls_verify, this, std::placeholders::_1, std::placeholders::_2));
+	if(SSL_CTX_use_certificate(ssl_ctx_ptr->native_handle(), node_key_.x509()) != 1
+		|| SSL_CTX_use_PrivateKey(ssl_ctx_ptr->native_handle(), node_key_.openssl_pkey()) != 1)
+		throw connection_error("Certificate error");
 	SSL_CTX_set_cipher_list(ssl_ctx_ptr->native_handle(), "ECDH-ECDSA-AES256-GCM-SHA384:ECDH-ECDSA-AES256-SHA384:ECDH-ECDSA-AES128-GCM-SHA256:ECDH-ECDSA-AES128-SHA256");
 
+	// Session resumption. Session tickets are enabled by OpenSSL by default, server-side cache serves peers without them
+	SSL_CTX_set_session_cache_mode(ssl_ctx_ptr->native_handle(), SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(ssl_ctx_ptr->native_handle(), (const unsigned char*)subprotocol_, std::strlen(subprotocol_));
+	SSL_CTX_set_timeout(ssl_ctx_ptr->native_handle(), TLS_SESSION_TIMEOUT);
+
 	return ssl_ctx_ptr;
 }
 
+void WSService::save_session(const tcp_endpoint& endpoint, SSL* ssl) {
+	std::shared_ptr<SSL_SESSION> session(SSL_get1_session(ssl), SSL_SESSION_free);
+	if(!session) return;
+
+	std::unique_lock<std::mutex> lk(ssl_ctx_mtx_);
+	if(client_sessions_.size() >= TLS_CLIENT_SESSIONS && client_sessions_.count(endpoint) == 0)
+		client_sessions_.erase(client_sessions_.begin());
+	client_sessions_[endpoint] = std::move(session);
+}
+
+void WSService::count_handshake(std::chrono::steady_clock::duration latency, bool resumed) {
+	auto latency_us = std::chrono::duration_cast<std::chrono::microseconds>(latency);
+
+	std::unique_lock<std::mutex> lk(handshake_stats_mtx_);
+	handshakes_++;
+	if(resumed) resumed_handshakes_++;
+	handshake_latency_total_ += latency_us;
+	handshake_latency_max_ = std::max(handshake_latency_max_, latency_us);
+}
+
+WSService::HandshakeStats WSService::handshake_stats() const {
+	std::unique_lock<std::mutex> lk(handshake_stats_mtx_);
+	HandshakeStats stats;
+	stats.handshakes = handshakes_;
+	stats.resumed = resumed_handshakes_;
+	if(handshakes_)
+		stats.average_latency = handshake_latency_total_ / handshakes_;
+	stats.max_latency = handshake_latency_max_;
+	return stats;
+}
+
 blob WSService::pubkey_from_cert(X509* x509) {
 	std::runtime_error e("Certificate error");
 
@@ -84,25 +124,50 @@ blob WSService::pubkey_from_cert(X509* x509) {
 	return raw_public;
 }
 
-void WSService::on_tcp_pre_init(websocketpp::connection_hdl hdl, connection::role_type role) {
-	LOGFUNC();
+WSService::connection WSService::assignment(websocketpp::connection_hdl hdl) {
+	return with_assignment(hdl, [](connection& conn){return conn;});
+}
+
+std::shared_ptr<P2PFolder> WSService::assigned_folder(websocketpp::connection_hdl hdl) {
+	return std::shared_ptr<P2PFolder>(with_assignment(hdl, [](connection& conn){return conn.folder;}));
+}
 
-	connection& conn = ws_assignment_[hdl];
-	conn.connection_handle = hdl;
-	conn.role = role;
+std::vector<std::shared_ptr<P2PFolder>> WSService::assigned_folders(websocketpp::connection_hdl hdl) {
+	std::lock_guard<std::mutex> lk(ws_assignment_mtx_);
+	std::vector<std::shared_ptr<P2PFolder>> folders;
 
-	ws_assignment_.insert({hdl, conn});
+	auto conn_it = ws_assignment_.find(hdl);
+	if(conn_it == ws_assignment_.end()) return folders;
+
+	if(auto folder = conn_it->second.folder.lock())
+		folders.push_back(folder);
+	for(auto& channel : conn_it->second.channels)
+		if(auto folder = channel.second.lock())
+			folders.push_back(folder);
+	return folders;
+}
+
+void WSService::erase_assignment(websocketpp::connection_hdl hdl) {
+	std::lock_guard<std::mutex> lk(ws_assignment_mtx_);
+	ws_assignment_.erase(hdl);
 }
 
 std::shared_ptr<ssl_context> WSService::on_tls_init(websocketpp::connection_hdl hdl) {
 	LOGFUNC();
+	return shared_ssl_ctx();
+}
 
-	auto ssl_ctx_ptr = make_ssl_ctx();
-	ssl_ctx_ptr->set_verify_callback(std::bind(&WSService::on_tls_verify, this, hdl, std::placeholders::_1, std::placeholders::_2));
-	return ssl_ctx_ptr;
+std::shared_ptr<ssl_context> WSService::shared_ssl_ctx() {
+	std::unique_lock<std::mutex> lk(ssl_ctx_mtx_);
+	if(!ssl_ctx_ || ssl_ctx_pubkey_ != node_key_.public_key()) {
+		ssl_ctx_ = make_ssl_ctx();
+		ssl_ctx_pubkey_ = node_key_.public_key();
+		client_sessions_.clear();   // These were established with the previous certificate
+	}
+	return ssl_ctx_;
 }
 
-bool WSService::on_tls_verify(websocketpp::connection_hdl hdl, bool preverified, boost::asio::ssl::verify_context& ctx) {
+bool WSService::on_tls_verify(bool preverified, boost::asio::ssl::verify_context& ctx) {
 	LOGFUNC();
 
 	// FIXME: Hey, just returning `true` isn't good enough, yes?
@@ -112,9 +177,47 @@ bool WSService::on_tls_verify(websocketpp::connection_hdl hdl, bool preverified,
 void WSService::on_open(websocketpp::connection_hdl hdl) {
 	LOGFUNC();
 
-	connection& conn = ws_assignment_[hdl];
-	auto new_folder = std::make_shared<P2PFolder>(provider_, *this, node_key_, folder_service_, conn, ios_);
-	conn.folder = new_folder;
+	if(subprotocol(hdl) == subprotocol_mux_) {
+		std::vector<std::pair<DiscoveryService::ConnectCredentials, std::weak_ptr<FolderGroup>>> pending;
+		try {
+			with_assignment(hdl, [&, this](connection& conn){
+				conn.open = true;
+				conn.multiplexed = true;
+				if(conn.role == connection::CLIENT)
+					pending.emplace_back(conn.dialed, folder_service_.get_group(conn.hash));
+				pending.insert(pending.end(), conn.pending.begin(), conn.pending.end());
+				conn.pending.clear();
+			});
+		}catch(connection_error& e) {
+			return;
+		}
+		LOGD("Multiplexed connection opened");
+
+		for(auto& pending_group : pending)
+			if(auto group_ptr = pending_group.second.lock())
+				open_channel(hdl, group_ptr);
+		return;
+	}
+
+	std::vector<std::pair<DiscoveryService::ConnectCredentials, std::weak_ptr<FolderGroup>>> pending;
+	std::shared_ptr<P2PFolder> new_folder;
+	try {
+		with_assignment(hdl, [&, this](connection& conn){
+			conn.open = true;
+			pending.swap(conn.pending);
+
+			new_folder = std::make_shared<P2PFolder>(provider_, *this, node_key_, folder_service_, conn, ios_);
+			conn.folder = new_folder;
+		});
+	}catch(connection_error& e) {
+		return;
+	}
+	const connection& conn = new_folder->conn_;   // Copy, owned by the folder
+
+	// Remote doesn't support multiplexing, so folders, that waited for this connection, need their own
+	for(auto& pending_group : pending)
+		if(auto group_ptr = pending_group.second.lock())
+			provider_.add_node(pending_group.first, group_ptr);
 
 	auto group_ptr = folder_service_.get_group(conn.hash);
 	if(group_ptr) {
@@ -133,12 +236,24 @@ void WSService::on_open(websocketpp::connection_hdl hdl) {
 	}
 }
 
-void WSService::on_message(websocketpp::connection_hdl hdl, const std::string& message_raw) {
+void WSService::on_message(websocketpp::connection_hdl hdl, shared_buffer message) {
 	LOGFUNC();
 
 	try {
-		blob message_blob = blob(message_raw.begin(), message_raw.end());
-		std::shared_ptr<P2PFolder>(ws_assignment_[hdl].folder)->handle_message(message_blob);
+		if(with_assignment(hdl, [](connection& conn){return conn.multiplexed;})) {
+			handle_channel_message(hdl, message);
+			return;
+		}
+
+		auto folder = assigned_folder(hdl);
+		folder->strand_.dispatch([this, hdl, folder, message]{
+			try {
+				folder->handle_message(message);
+			}catch(std::exception& e) {
+				LOGFUNC() << " e:" << e.what();
+				close(hdl, e.what());
+			}
+		});
 	}catch(std::exception& e) {
 		LOGFUNC() << " e:" << e.what();
 		close(hdl, e.what());
@@ -148,68 +263,341 @@ void WSService::on_message(websocketpp::connection_hdl hdl, const std::string& m
 void WSService::on_disconnect(websocketpp::connection_hdl hdl) {
 	LOGFUNC() << " e:" << errmsg(hdl);
 
-	try {
-		auto p2p_folder_ptr = std::shared_ptr<P2PFolder>(ws_assignment_[hdl].folder);
-		auto folder_group = p2p_folder_ptr->folder_group();
+	for(auto& folder : assigned_folders(hdl))
+		detach_folder(folder);
+
+	erase_assignment(hdl);
+}
 
-		folder_group->detach(p2p_folder_ptr);
+void WSService::detach_folder(std::shared_ptr<P2PFolder> folder) {
+	try {
+		folder->folder_group()->detach(folder);
 	}catch(const std::bad_weak_ptr& e){
 		LOGFUNC() << " bad pointer, what:" << e.what();
 	}
-
-	ws_assignment_.erase(hdl);
 }
 
+/* Pings are per connection, so every channel gets them */
 bool WSService::on_ping(websocketpp::connection_hdl hdl, std::string message) {
-	try {
-		std::shared_ptr<P2PFolder>(ws_assignment_[hdl].folder)->handle_ping(message);
+	for(auto& folder : assigned_folders(hdl))
+		folder->strand_.dispatch([folder, message]{folder->handle_ping(message);});
+	return true;
+}
+
+void WSService::on_pong(websocketpp::connection_hdl hdl, std::string message) {
+	for(auto& folder : assigned_folders(hdl))
+		folder->strand_.dispatch([folder, message]{folder->handle_pong(message);});
+}
+
+/* Multiplexing */
+bool WSService::connected_to(const connection& conn, const DiscoveryService::ConnectCredentials& node_credentials) const {
+	if(!node_credentials.pubkey.empty() && (conn.remote_pubkey == node_credentials.pubkey || conn.dialed.pubkey == node_credentials.pubkey))
 		return true;
-	}catch(std::exception& e) {
-		LOGFUNC() << " e:" << e.what();
-		close(hdl, e.what());
-		return false;
+	if(node_credentials.endpoint != tcp_endpoint() && (conn.remote_endpoint == node_credentials.endpoint || conn.dialed.endpoint == node_credentials.endpoint))
+		return true;
+	return false;
+}
+
+bool WSService::open_channel(const DiscoveryService::ConnectCredentials& node_credentials, std::shared_ptr<FolderGroup> group_ptr) {
+	websocketpp::connection_hdl hdl;
+	{
+		std::lock_guard<std::mutex> lk(ws_assignment_mtx_);
+		for(auto& conn : ws_assignment_) {
+			if(!connected_to(conn.second, node_credentials)) continue;
+
+			if(conn.second.open && conn.second.multiplexed) {
+				hdl = conn.first;
+				break;
+			}
+			if(!conn.second.open && conn.second.role == connection::CLIENT) {
+				// Connection is being established, the folder will be opened along with the one, it was established for
+				conn.second.pending.emplace_back(node_credentials, group_ptr);
+				return true;
+			}
+		}
 	}
+	if(hdl.expired()) return false;
+
+	open_channel(hdl, group_ptr);
+	return true;
 }
 
-void WSService::on_pong(websocketpp::connection_hdl hdl, std::string message) {
+void WSService::open_channel(websocketpp::connection_hdl hdl, std::shared_ptr<FolderGroup> group_ptr) {
+	std::shared_ptr<P2PFolder> new_folder;
+	uint16_t channel;
 	try {
-		std::shared_ptr<P2PFolder>(ws_assignment_[hdl].folder)->handle_pong(message);
-	}catch(std::exception& e) {
-		LOGFUNC() << " e:" << e.what();
-		close(hdl, e.what());
+		with_assignment(hdl, [&, this](connection& conn){
+			if(group_ptr->have_p2p_dir(conn.remote_pubkey)) return;  // Opened already, maybe by the remote
+
+			// Channels of this side have the same parity, as next_channel. Zero is reserved for control messages
+			for(channel = conn.next_channel; channel == 0 || conn.channels.count(channel); channel += 2);
+			conn.next_channel = channel + 2;
+
+			new_folder = std::make_shared<P2PFolder>(provider_, *this, node_key_, folder_service_, channel_connection(conn, channel, group_ptr->hash(), connection::CLIENT), ios_);
+			conn.channels[channel] = new_folder;
+		});
+	}catch(connection_error& e) {
+		return; // Disconnected in the meantime
+	}
+	if(!new_folder) return;
+
+	try {
+		group_ptr->attach(new_folder);
+	}catch(std::exception& e){
+		erase_channel(hdl, channel);
+		return;
+	}
+	if(!has_channel(hdl, channel)) {
+		detach_folder(new_folder);  // Disconnected, while it was being attached, so on_disconnect missed it
+		return;
+	}
+
+	LOGD("Channel " << channel << " opened to: " << new_folder->name());
+	send_control(hdl, MUX_OPEN, channel, group_ptr->hash());
+	new_folder->perform_handshake();
+}
+
+void WSService::handle_open(websocketpp::connection_hdl hdl, uint16_t channel, const blob& hash) {
+	auto group_ptr = folder_service_.get_group(hash);
+	if(!group_ptr) {
+		send_control(hdl, MUX_CLOSE, channel);
+		return;
+	}
+
+	auto new_folder = with_assignment(hdl, [&, this](connection& conn){
+		if(channel % 2 == conn.next_channel % 2 || conn.channels.count(channel))
+			throw connection_error("Channel is already in use");
+		return std::make_shared<P2PFolder>(provider_, *this, node_key_, folder_service_, channel_connection(conn, channel, hash, connection::SERVER), ios_);
+	});
+
+	try {
+		group_ptr->attach(new_folder);
+	}catch(std::exception& e){
+		// Both nodes may open a channel for the folder at once. Both keep the channel, opened by the node with the lower pubkey
+		uint16_t own_channel = colliding_channel(hdl, hash);
+		if(!own_channel || node_key_.public_key() < new_folder->remote_pubkey()) {
+			send_control(hdl, MUX_CLOSE, channel);
+			return;
+		}
+
+		close_channel(hdl, own_channel, "Remote opened the same folder");
+		try {
+			group_ptr->attach(new_folder);
+		}catch(std::exception& e){
+			send_control(hdl, MUX_CLOSE, channel);
+			return;
+		}
+	}
+
+	try {
+		with_assignment(hdl, [&](connection& conn){conn.channels[channel] = new_folder;});
+	}catch(connection_error& e) {
+		detach_folder(new_folder);  // Disconnected, while it was being attached
+		return;
+	}
+	LOGD("Channel " << channel << " accepted from: " << new_folder->name());
+}
+
+void WSService::close_channel(websocketpp::connection_hdl hdl, uint16_t channel, const std::string& reason) {
+	auto folder = erase_channel(hdl, channel);
+	if(!folder) return;
+
+	LOGD("Closing channel " << channel << " to: " << folder->name() << " reason: " << reason);
+	send_control(hdl, MUX_CLOSE, channel);
+	detach_folder(folder);
+}
+
+std::shared_ptr<P2PFolder> WSService::erase_channel(websocketpp::connection_hdl hdl, uint16_t channel) {
+	std::lock_guard<std::mutex> lk(ws_assignment_mtx_);
+
+	auto conn_it = ws_assignment_.find(hdl);
+	if(conn_it == ws_assignment_.end()) return nullptr;
+	auto channel_it = conn_it->second.channels.find(channel);
+	if(channel_it == conn_it->second.channels.end()) return nullptr;
+
+	auto folder = channel_it->second.lock();
+	conn_it->second.channels.erase(channel_it);
+	return folder;
+}
+
+uint16_t WSService::colliding_channel(websocketpp::connection_hdl hdl, const blob& hash) {
+	std::lock_guard<std::mutex> lk(ws_assignment_mtx_);
+
+	auto conn_it = ws_assignment_.find(hdl);
+	if(conn_it == ws_assignment_.end()) return 0;
+	for(auto& channel : conn_it->second.channels) {
+		if(channel.first % 2 != conn_it->second.next_channel % 2) continue;    // Opened by the remote
+		auto folder = channel.second.lock();
+		if(folder && folder->conn_.hash == hash) return channel.first;
+	}
+	return 0;
+}
+
+bool WSService::has_channel(websocketpp::connection_hdl hdl, uint16_t channel) {
+	std::lock_guard<std::mutex> lk(ws_assignment_mtx_);
+
+	auto conn_it = ws_assignment_.find(hdl);
+	return conn_it != ws_assignment_.end() && conn_it->second.channels.count(channel);
+}
+
+WSService::connection WSService::channel_connection(const connection& conn, uint16_t channel, const blob& hash, connection::role_type role) const {
+	connection channel_conn;
+	channel_conn.connection_handle = conn.connection_handle;
+	channel_conn.role = role;
+	channel_conn.remote_pubkey = conn.remote_pubkey;
+	channel_conn.remote_endpoint = conn.remote_endpoint;
+	channel_conn.hash = hash;
+	channel_conn.open = true;
+	channel_conn.multiplexed = true;
+	channel_conn.channel = channel;
+	return channel_conn;
+}
+
+void WSService::handle_channel_message(websocketpp::connection_hdl hdl, const shared_buffer& message) {
+	if(message.size() < 2) throw connection_error("Malformed message");
+	uint16_t channel = uint16_t(message[0] << 8 | message[1]);
+	shared_buffer payload = message.slice(2, message.size() - 2);
+
+	if(channel == 0) {
+		handle_control(hdl, payload);
+		return;
+	}
+
+	auto folder = with_assignment(hdl, [&](connection& conn){
+		auto channel_it = conn.channels.find(channel);
+		return channel_it != conn.channels.end() ? channel_it->second.lock() : std::shared_ptr<P2PFolder>();
+	});
+	if(!folder) return; // Channel was closed, while this message was in flight
+
+	// Errors in one folder don't affect other channels
+	folder->strand_.dispatch([this, hdl, channel, folder, payload]{
+		try {
+			folder->handle_message(payload);
+		}catch(std::exception& e) {
+			LOGFUNC() << " e:" << e.what();
+			close_channel(hdl, channel, e.what());
+		}
+	});
+}
+
+void WSService::handle_control(websocketpp::connection_hdl hdl, const shared_buffer& message) {
+	if(message.size() < 3) throw connection_error("Malformed control message");
+	uint16_t channel = uint16_t(message[1] << 8 | message[2]);
+	if(channel == 0) throw connection_error("Malformed control message");
+
+	switch(message[0]) {
+		case MUX_OPEN:
+			handle_open(hdl, channel, blob(message.begin() + 3, message.end()));
+			break;
+		case MUX_CLOSE:
+			if(auto folder = erase_channel(hdl, channel))
+				detach_folder(folder);
+			break;
+		default:
+			LOGD("Unknown control message: " << (int)message[0]);   // May be sent by newer versions
 	}
 }
 
+void WSService::send_control(websocketpp::connection_hdl hdl, mux_message_type type, uint16_t channel, const blob& hash) {
+	blob message = {type, uint8_t(channel >> 8), uint8_t(channel)};
+	message.insert(message.end(), hash.begin(), hash.end());
+	send_channel_message(hdl, 0, message);
+}
+
+void WSService::send_channel_message(websocketpp::connection_hdl hdl, uint16_t channel, const blob& message) {
+	blob channel_message = {uint8_t(channel >> 8), uint8_t(channel)};
+	channel_message.insert(channel_message.end(), message.begin(), message.end());
+	send_message(hdl, channel_message);
+}
+
+void WSService::send_channel_message(websocketpp::connection_hdl hdl, uint16_t channel, const blob& header, const shared_buffer& content) {
+	blob channel_header = {uint8_t(channel >> 8), uint8_t(channel)};
+	channel_header.insert(channel_header.end(), header.begin(), header.end());
+	send_message(hdl, channel_header, content);
+}
+
+void WSService::prepare_connection(websocketpp::connection_hdl hdl, connection::role_type role, SSL* ssl, const tcp_endpoint& remote_endpoint) {
+	add_assignment(hdl, [&](connection& conn){
+		conn.connection_handle = hdl;
+		conn.role = role;
+		conn.next_channel = role == connection::CLIENT ? 1 : 2;
+		conn.handshake_started = std::chrono::steady_clock::now();
+	});
+
+	// Offer the session of the previous connection to this endpoint, so the handshake is abbreviated
+	if(role == connection::CLIENT && remote_endpoint != tcp_endpoint()) {
+		std::unique_lock<std::mutex> lk(ssl_ctx_mtx_);
+		auto session_it = client_sessions_.find(remote_endpoint);
+		if(session_it != client_sessions_.end())
+			SSL_set_session(ssl, session_it->second.get());
+	}
+}
+
+void WSService::establish_connection(websocketpp::connection_hdl hdl, SSL* ssl, const tcp_endpoint& remote_endpoint) {
+	// Validate SSL certificate
+	X509* x509 = SSL_get_peer_certificate(ssl);
+	if(!x509) throw connection_error("Certificate error");
+
+	// Detect loopback
+	blob remote_pubkey;
+	try {
+		remote_pubkey = pubkey_from_cert(x509);
+	}catch(...) {
+		X509_free(x509);
+		throw;
+	}
+	X509_free(x509);
+
+	connection::role_type role;
+	std::chrono::steady_clock::time_point handshake_started;
+	with_assignment(hdl, [&](connection& conn){
+		conn.remote_pubkey = remote_pubkey;
+		conn.remote_endpoint = remote_endpoint;
+		role = conn.role;
+		handshake_started = conn.handshake_started;
+	});
+
+	// TLS handshake is complete at this point
+	count_handshake(std::chrono::steady_clock::now() - handshake_started, SSL_session_reused(ssl) == 1);
+	if(role == connection::CLIENT)
+		save_session(remote_endpoint, ssl);
+
+	if(provider_.is_loopback(remote_pubkey) || provider_.is_loopback(remote_endpoint)) {
+		provider_.mark_loopback(remote_endpoint);
+		throw connection_error("Loopback detected");
+	}
+}
+
+template<class WSClass>
+void WSService::on_tcp_pre_init(WSClass& c, websocketpp::connection_hdl hdl, connection::role_type role) {
+	LOGFUNC();
+
+	auto connection_ptr = c.get_con_from_hdl(hdl);
+	boost::system::error_code ec;
+	tcp_endpoint remote_endpoint = connection_ptr->get_raw_socket().remote_endpoint(ec);
+	prepare_connection(hdl, role, connection_ptr->get_socket().native_handle(), ec ? tcp_endpoint() : remote_endpoint);
+}
+
 template<class WSClass>
 void WSService::on_tcp_post_init(WSClass& c, websocketpp::connection_hdl hdl) {
 	LOGFUNC();
 
 	auto connection_ptr = c.get_con_from_hdl(hdl);
-	if(!c.is_server())
+	if(!c.is_server()) {
+		connection_ptr->add_subprotocol(subprotocol_mux_);
 		connection_ptr->add_subprotocol(subprotocol_);
+	}
 
 	try {
-		// Validate SSL certificate
-		X509* x509 = SSL_get_peer_certificate(connection_ptr->get_socket().native_handle());
-		if(!x509) throw connection_error("Certificate error");
-
-		// Detect loopback
-		connection& conn = ws_assignment_[hdl];
-		conn.remote_pubkey = pubkey_from_cert(x509);
-		conn.remote_endpoint = connection_ptr->get_raw_socket().remote_endpoint();
-
-		X509_free(x509);
-
-		if(provider_.is_loopback(conn.remote_pubkey) || provider_.is_loopback(conn.remote_endpoint)) {
-			provider_.mark_loopback(conn.remote_endpoint);
-			throw connection_error("Loopback detected");
-		}
+		establish_connection(hdl, connection_ptr->get_socket().native_handle(), connection_ptr->get_raw_socket().remote_endpoint());
 	}catch(std::exception& e) {
 		LOGFUNC() << " e:" << e.what();
 		connection_ptr->terminate(websocketpp::lib::error_code());
 	}
 }
 
+template void WSService::on_tcp_pre_init(WSServer::server&, websocketpp::connection_hdl, connection::role_type);
+template void WSService::on_tcp_pre_init(WSClient::client&, websocketpp::connection_hdl, connection::role_type);
 template void WSService::on_tcp_post_init(WSServer::server&, websocketpp::connection_hdl);
 template void WSService::on_tcp_post_init(WSClient::client&, websocketpp::connection_hdl);
 
@@ -31,9 +31,17 @@
 #include "P2PProvider.h"
 #include <util/network.h>
 #include <util/log.h>
+#include <util/shared_buffer.h>
+#include <chrono>
+#include <mutex>
+#include <utility>
+
+#define TLS_CLIENT_SESSIONS 256   // Sessions, remembered for resumption of outgoing connections
+#define TLS_SESSION_TIMEOUT 3600  // Seconds
 
 namespace librevault {
 
+class FolderGroup;
 class P2PFolder;
 
 class WSService {
@@ -45,7 +53,8 @@ public:
 	struct connection {
 		// Set immediately after creation
 		websocketpp::connection_hdl connection_handle;
-		enum role_type {SERVER, CLIENT} role;
+		enum role_type {SERVER, CLIENT} role;   // For a channel, CLIENT is the side, that opened it
+		std::chrono::steady_clock::time_point handshake_started;
 
 		// Set on_tcp_post_init
 		blob remote_pubkey;
@@ -56,13 +65,38 @@ public:
 
 		// Set on_open
 		std::weak_ptr<P2PFolder> folder;
+		bool open = false;
+		bool multiplexed = false;
+
+		// Multiplexed connection only. Copies, given to P2PFolder, have channel set instead
+		uint16_t channel = 0;
+		uint16_t next_channel = 0;
+		std::map<uint16_t, std::weak_ptr<P2PFolder>> channels;
+		DiscoveryService::ConnectCredentials dialed;    // Set by WSClient::connect
+		std::vector<std::pair<DiscoveryService::ConnectCredentials, std::weak_ptr<FolderGroup>>> pending;  // Opened as channels, when connection opens
 	};
 
+	/* Opens a channel for the group on an existing (or being established) multiplexed connection to the node.
+	 * Returns false, if there is no such connection */
+	bool open_channel(const DiscoveryService::ConnectCredentials& node_credentials, std::shared_ptr<FolderGroup> group_ptr);
+
 	/* Actions */
 	virtual void send_message(websocketpp::connection_hdl hdl, const blob& message) = 0;
+	virtual void send_message(websocketpp::connection_hdl hdl, const blob& header, const shared_buffer& content) = 0;   // Sent as one message
+	void send_channel_message(websocketpp::connection_hdl hdl, uint16_t channel, const blob& message);
+	void send_channel_message(websocketpp::connection_hdl hdl, uint16_t channel, const blob& header, const shared_buffer& content);
 	virtual void ping(websocketpp::connection_hdl hdl, std::string message) = 0;
 	virtual void pong(websocketpp::connection_hdl hdl, std::string message) = 0;
 	virtual void close(websocketpp::connection_hdl hdl, const std::string& reason) = 0;
+	virtual size_t buffered_amount(websocketpp::connection_hdl hdl) = 0; // Bytes, queued in the transport, but not sent yet
+
+	struct HandshakeStats {
+		uint64_t handshakes = 0;
+		uint64_t resumed = 0;
+		std::chrono::microseconds average_latency = std::chrono::microseconds(0);
+		std::chrono::microseconds max_latency = std::chrono::microseconds(0);
+	};
+	HandshakeStats handshake_stats() const; // Thread-safe
 
 protected:
 	struct connection_error : public std::runtime_error {
@@ -74,34 +108,104 @@ protected:
 	NodeKey& node_key_;
 	FolderService& folder_service_;
 
+	/* Connection handlers run on many threads, each connection on its own strand. Connections are accessed only under ws_assignment_mtx_ */
 	std::map<websocketpp::connection_hdl, connection, std::owner_less<websocketpp::connection_hdl>> ws_assignment_;
+	std::mutex ws_assignment_mtx_;
+
+	// Runs fn on the connection, while holding the lock. References must not escape fn.
+	// Throws connection_error, if the connection is not assigned (e.g. erased on disconnect)
+	template<class Fn> auto with_assignment(websocketpp::connection_hdl hdl, Fn fn) -> decltype(fn(std::declval<connection&>())) {
+		std::lock_guard<std::mutex> lk(ws_assignment_mtx_);
+		auto conn_it = ws_assignment_.find(hdl);
+		if(conn_it == ws_assignment_.end()) throw connection_error("Connection is closed");
+		return fn(conn_it->second);
+	}
+	// Same, but assigns a new connection, if there is none. Only for connections, that are being set up
+	template<class Fn> auto add_assignment(websocketpp::connection_hdl hdl, Fn fn) -> decltype(fn(std::declval<connection&>())) {
+		std::lock_guard<std::mutex> lk(ws_assignment_mtx_);
+		return fn(ws_assignment_[hdl]);
+	}
+	connection assignment(websocketpp::connection_hdl hdl);   // Copy. Throws connection_error
+	std::shared_ptr<P2PFolder> assigned_folder(websocketpp::connection_hdl hdl);    // Throws std::bad_weak_ptr
+	std::vector<std::shared_ptr<P2PFolder>> assigned_folders(websocketpp::connection_hdl hdl);  // All channels of multiplexed connection
+	void erase_assignment(websocketpp::connection_hdl hdl);
 
 	static const char* subprotocol_;
+	static const char* subprotocol_mux_;
+	static const char* raw_port_header_;   // Set by server, if it accepts raw connections
+
+	/* Multiplexing. On a connection with subprotocol_mux_ every message starts with a big-endian channel number.
+	 * Channel 0 carries control messages: type, channel number and, for MUX_OPEN, the folder hash.
+	 * Every other channel is a separate P2PFolder, authorized by its own handshake. Client side of the connection opens odd
+	 * channels, server side opens even ones. */
+	enum mux_message_type : uint8_t {MUX_OPEN = 0, MUX_CLOSE = 1};
+
+	void open_channel(websocketpp::connection_hdl hdl, std::shared_ptr<FolderGroup> group_ptr);
+	void close_channel(websocketpp::connection_hdl hdl, uint16_t channel, const std::string& reason);
+	std::shared_ptr<P2PFolder> erase_channel(websocketpp::connection_hdl hdl, uint16_t channel);
+	bool has_channel(websocketpp::connection_hdl hdl, uint16_t channel);
+	uint16_t colliding_channel(websocketpp::connection_hdl hdl, const blob& hash);  // Channel for the folder, opened by this side. 0, if none
+	bool connected_to(const connection& conn, const DiscoveryService::ConnectCredentials& node_credentials) const;
+	void send_control(websocketpp::connection_hdl hdl, mux_message_type type, uint16_t channel, const blob& hash = blob());
+	connection channel_connection(const connection& conn, uint16_t channel, const blob& hash, connection::role_type role) const;
+
+	void handle_channel_message(websocketpp::connection_hdl hdl, const shared_buffer& message);
+	void handle_control(websocketpp::connection_hdl hdl, const shared_buffer& message);
+	void handle_open(websocketpp::connection_hdl hdl, uint16_t channel, const blob& hash);
+	void detach_folder(std::shared_ptr<P2PFolder> folder);
+
+	/* TLS context is shared by all connections and rebuilt only when the node key changes.
+	 * Incoming sessions are resumed using session cache and tickets, outgoing ones using the session, saved for the remote endpoint. */
+	std::shared_ptr<ssl_context> ssl_ctx_;
+	blob ssl_ctx_pubkey_;
+	std::map<tcp_endpoint, std::shared_ptr<SSL_SESSION>> client_sessions_;
+	std::mutex ssl_ctx_mtx_;
+
+	mutable std::mutex handshake_stats_mtx_;
+	uint64_t handshakes_ = 0, resumed_handshakes_ = 0;
+	std::chrono::microseconds handshake_latency_total_ = std::chrono::microseconds(0), handshake_latency_max_ = std::chrono::microseconds(0);
 
 	/* TLS functions */
 	std::shared_ptr<ssl_context> make_ssl_ctx();
 	blob pubkey_from_cert(X509* x509);
+	void save_session(const tcp_endpoint& endpoint, SSL* ssl);
+	void count_handshake(std::chrono::steady_clock::duration latency, bool resumed);
+	std::shared_ptr<ssl_context> shared_ssl_ctx();
+
+	/* Connection setup, common for all transports. establish_connection throws, if the connection must be dropped */
+	void prepare_connection(websocketpp::connection_hdl hdl, connection::role_type role, SSL* ssl, const tcp_endpoint& remote_endpoint);
+	void establish_connection(websocketpp::connection_hdl hdl, SSL* ssl, const tcp_endpoint& remote_endpoint);
 
 	/* Handlers */
-	void on_tcp_pre_init(websocketpp::connection_hdl hdl, connection::role_type role);
+	virtual void on_tcp_pre_init(websocketpp::connection_hdl hdl) = 0;
 	virtual void on_tcp_post_init(websocketpp::connection_hdl hdl) = 0;
 	std::shared_ptr<ssl_context> on_tls_init(websocketpp::connection_hdl hdl);
-	bool on_tls_verify(websocketpp::connection_hdl hdl, bool preverified, boost::asio::ssl::verify_context& ctx);    // Not WebSockets callback, but asio::ssl
+	bool on_tls_verify(bool preverified, boost::asio::ssl::verify_context& ctx);    // Not WebSockets callback, but asio::ssl
 	void on_open(websocketpp::connection_hdl hdl);
-	void on_message(websocketpp::connection_hdl hdl, const std::string& message);
+	void on_message(websocketpp::connection_hdl hdl, shared_buffer message);
 	void on_disconnect(websocketpp::connection_hdl hdl);
 
 	bool on_ping(websocketpp::connection_hdl hdl, std::string message);
 	void on_pong(websocketpp::connection_hdl hdl, std::string message);
 
 	/* Handler templates */
+	template<class WSClass> void on_tcp_pre_init(WSClass& c, websocketpp::connection_hdl hdl, connection::role_type role);
 	template<class WSClass> void on_tcp_post_init(WSClass& c, websocketpp::connection_hdl hdl);
 
 	/* Actions */
+	virtual std::string subprotocol(websocketpp::connection_hdl hdl) = 0;
+	template<class WSClass> std::string subprotocol(WSClass& c, websocketpp::connection_hdl hdl) {
+		return c.get_con_from_hdl(hdl)->get_subprotocol();
+	}
 	template<class WSClass> void close(WSClass& c, websocketpp::connection_hdl hdl, const std::string& reason) {
 		LOGFUNC();
 		c.get_con_from_hdl(hdl)->close(websocketpp::close::status::internal_endpoint_error, reason);
 	}
+	template<class WSClass> size_t buffered_amount(WSClass& c, websocketpp::connection_hdl hdl) {
+		websocketpp::lib::error_code ec;
+		auto connection_ptr = c.get_con_from_hdl(hdl, ec);
+		return ec ? 0 : connection_ptr->get_buffered_amount();
+	}
 	//virtual void terminate(websocketpp::connection_hdl hdl);
 	virtual std::string errmsg(websocketpp::connection_hdl hdl) = 0;
 };
@@ -0,0 +1,214 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "FileDescriptorCache.h"
+#include <boost/filesystem/operations.hpp>
+#include <vector>
+#if BOOST_OS_WINDOWS
+#	include <io.h>
+#	include <fcntl.h>
+#	include <sys/stat.h>
+#else
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
+
+namespace librevault {
+
+class FileDescriptorCache::Descriptor {
+public:
+	Descriptor(const boost::filesystem::path& path) {
+#if BOOST_OS_WINDOWS
+		fd_ = _wopen(path.native().c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+		fd_ = ::open(path.native().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+#endif
+		if(fd_ < 0) throw error("Could not open file: " + path.string());
+	}
+	~Descriptor() {
+		sync();    // Evicted descriptor may be closed, before its file is synced
+#if BOOST_OS_WINDOWS
+		_close(fd_);
+#else
+		::close(fd_);
+#endif
+	}
+
+	bool write(uint64_t offset, const uint8_t* data, size_t size) {
+		dirty_ = true;
+#if BOOST_OS_WINDOWS
+		std::lock_guard<std::mutex> lk(position_mtx_);  // There is no pwrite() on Windows, so seek+write must be atomic
+		if(_lseeki64(fd_, offset, SEEK_SET) < 0) return false;
+		for(size_t written = 0; written < size;) {
+			int result = _write(fd_, data+written, unsigned(size-written));
+			if(result <= 0) return false;
+			written += result;
+		}
+#else
+		for(size_t written = 0; written < size;) {
+			ssize_t result = ::pwrite(fd_, data+written, size-written, offset+written);
+			if(result <= 0) return false;
+			written += result;
+		}
+#endif
+		return true;
+	}
+
+	bool read(uint64_t offset, uint8_t* data, size_t size) {
+#if BOOST_OS_WINDOWS
+		std::lock_guard<std::mutex> lk(position_mtx_);
+		if(_lseeki64(fd_, offset, SEEK_SET) < 0) return false;
+		for(size_t read = 0; read < size;) {
+			int result = _read(fd_, data+read, unsigned(size-read));
+			if(result <= 0) return false;
+			read += result;
+		}
+#else
+		for(size_t read = 0; read < size;) {
+			ssize_t result = ::pread(fd_, data+read, size-read, offset+read);
+			if(result <= 0) return false;
+			read += result;
+		}
+#endif
+		return true;
+	}
+
+	bool sync() {
+		if(!dirty_.exchange(false)) return false;
+#if BOOST_OS_WINDOWS
+		_commit(fd_);
+#else
+		::fsync(fd_);
+#endif
+		return true;
+	}
+
+	void discard() {dirty_ = false;}
+
+private:
+	int fd_;
+	std::atomic<bool> dirty_ = {false};
+#if BOOST_OS_WINDOWS
+	std::mutex position_mtx_;
+#endif
+};
+
+FileDescriptorCache::FileDescriptorCache() {
+	opens_ = 0;
+	evictions_ = 0;
+	syncs_ = 0;
+	set_budget(100);
+}
+
+void FileDescriptorCache::set_budget(size_t budget) {
+	shard_budget_ = std::max(budget / shard_count_, size_t(1));
+}
+
+FileDescriptorCache::Shard& FileDescriptorCache::get_shard(const boost::filesystem::path& path) {
+	return shards_[std::hash<std::string>()(path.string()) % shard_count_];
+}
+
+std::shared_ptr<FileDescriptorCache::Descriptor> FileDescriptorCache::get_descriptor(const boost::filesystem::path& path) {
+	Shard& shard = get_shard(path);
+	std::vector<std::shared_ptr<Descriptor>> evicted;  // Closed (and synced, if dirty) outside the lock
+	std::lock_guard<std::mutex> lk(shard.mtx);
+
+	auto it = shard.index.find(path.string());
+	if(it != shard.index.end()) {
+		shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+		return it->second->second;
+	}
+
+	auto descriptor = std::make_shared<Descriptor>(path);
+	opens_++;
+	shard.lru.emplace_front(path, descriptor);
+	shard.index[path.string()] = shard.lru.begin();
+
+	// Evicted descriptors are closed, when the last writer releases them
+	while(shard.lru.size() > shard_budget_) {
+		shard.index.erase(shard.lru.back().first.string());
+		evicted.push_back(std::move(shard.lru.back().second));
+		shard.lru.pop_back();
+		evictions_++;
+	}
+	return descriptor;
+}
+
+void FileDescriptorCache::write(const boost::filesystem::path& path, uint64_t offset, const uint8_t* data, size_t size) {
+	if(!get_descriptor(path)->write(offset, data, size))
+		throw error("Could not write to file: " + path.string());
+}
+
+bool FileDescriptorCache::read(const boost::filesystem::path& path, uint64_t offset, uint8_t* data, size_t size) {
+	try {
+		return get_descriptor(path)->read(offset, data, size);
+	}catch(error& e) {
+		return false;
+	}
+}
+
+void FileDescriptorCache::sync(const boost::filesystem::path& path) {
+	Shard& shard = get_shard(path);
+	std::shared_ptr<Descriptor> descriptor;
+	{
+		std::lock_guard<std::mutex> lk(shard.mtx);
+		auto it = shard.index.find(path.string());
+		if(it != shard.index.end())
+			descriptor = it->second->second;
+	}
+	// Evicted descriptors are synced, when they are closed
+	if(descriptor && descriptor->sync())
+		syncs_++;
+}
+
+void FileDescriptorCache::release(const boost::filesystem::path& path) {
+	Shard& shard = get_shard(path);
+	std::lock_guard<std::mutex> lk(shard.mtx);
+
+	auto it = shard.index.find(path.string());
+	if(it != shard.index.end()) {
+		it->second->second->discard();
+		shard.lru.erase(it->second);
+		shard.index.erase(it);
+	}
+}
+
+FileDescriptorCache::Stats FileDescriptorCache::stats() const {
+	Stats stats;
+	stats.opens = opens_;
+	stats.evictions = evictions_;
+	stats.syncs = syncs_;
+	stats.open_files = 0;
+	for(auto& shard : shards_) {
+		std::lock_guard<std::mutex> lk(shard.mtx);
+		stats.open_files += shard.lru.size();
+	}
+	return stats;
+}
+
+} /* namespace librevault */
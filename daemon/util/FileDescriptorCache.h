@@ -0,0 +1,89 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <boost/filesystem/path.hpp>
+#include <boost/predef/os.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace librevault {
+
+/* FileDescriptorCache is a singleton class, used to keep a bounded number of file descriptors open for positional I/O.
+ * Descriptors are split into shards, each one with its own lock and LRU list. */
+class FileDescriptorCache {
+public:
+	struct error : std::runtime_error {
+		error(const std::string& what) : std::runtime_error(what) {}
+	};
+
+	struct Stats {
+		uint64_t opens;
+		uint64_t evictions;
+		uint64_t syncs;
+		size_t open_files;
+	};
+
+	static FileDescriptorCache* get_instance() {
+		static FileDescriptorCache instance;
+		return &instance;
+	}
+
+	void set_budget(size_t budget);
+
+	void write(const boost::filesystem::path& path, uint64_t offset, const uint8_t* data, size_t size);   // pwrite(). Throws error
+	bool read(const boost::filesystem::path& path, uint64_t offset, uint8_t* data, size_t size);   // pread()
+	void sync(const boost::filesystem::path& path); // Flushes file to disk, if it was written since last sync.
+	void release(const boost::filesystem::path& path);  // Closes file without syncing it, must be called before moving or removing it
+
+	Stats stats() const;
+
+private:
+	class Descriptor;
+
+	struct Shard {
+		mutable std::mutex mtx;
+		std::list<std::pair<boost::filesystem::path, std::shared_ptr<Descriptor>>> lru;    // Most recently used are in front
+		std::unordered_map<std::string, decltype(lru)::iterator> index;
+	};
+	static constexpr size_t shard_count_ = 16;
+	Shard shards_[shard_count_];
+
+	std::atomic<size_t> shard_budget_;
+	std::atomic<uint64_t> opens_, evictions_, syncs_;
+
+	FileDescriptorCache();
+
+	Shard& get_shard(const boost::filesystem::path& path);
+	std::shared_ptr<Descriptor> get_descriptor(const boost::filesystem::path& path);
+};
+
+} /* namespace librevault */
@@ -0,0 +1,92 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include "TokenBucket.h"
+#include <algorithm>
+
+namespace librevault {
+
+TokenBucket::TokenBucket(std::shared_ptr<TokenBucket> parent, uint64_t rate) : parent_(std::move(parent)), rate_(rate) {}
+
+void TokenBucket::set_rate(uint64_t rate) {
+	std::unique_lock<std::mutex> lk(mtx_);
+	refill();
+	rate_ = rate;
+}
+
+std::chrono::steady_clock::duration TokenBucket::reserve(uint64_t bytes, bool payload) {
+	std::chrono::steady_clock::duration own_delay;
+	{
+		std::unique_lock<std::mutex> lk(mtx_);
+		(payload ? payload_bytes_ : overhead_bytes_) += bytes;
+
+		refill();
+		if(rate_ != 0) tokens_ -= bytes;
+		own_delay = debt_delay();
+	}
+
+	if(parent_)
+		return std::max(own_delay, parent_->reserve(bytes, payload));
+	return own_delay;
+}
+
+std::chrono::steady_clock::duration TokenBucket::delay() const {
+	std::chrono::steady_clock::duration own_delay;
+	{
+		std::unique_lock<std::mutex> lk(mtx_);
+		refill();
+		own_delay = debt_delay();
+	}
+
+	if(parent_)
+		return std::max(own_delay, parent_->delay());
+	return own_delay;
+}
+
+TokenBucket::Stats TokenBucket::stats() const {
+	std::unique_lock<std::mutex> lk(mtx_);
+	return {rate_, payload_bytes_, overhead_bytes_};
+}
+
+void TokenBucket::refill() const {
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::duration<double> elapsed = now - last_refill_;
+	last_refill_ = now;
+
+	if(rate_ == 0)
+		tokens_ = 0;
+	else
+		tokens_ = std::min(tokens_ + elapsed.count() * rate_, double(rate_));    // Bursts are limited to one second of traffic
+}
+
+std::chrono::steady_clock::duration TokenBucket::debt_delay() const {
+	if(tokens_ >= 0 || rate_ == 0) return std::chrono::steady_clock::duration::zero();
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(-tokens_ / rate_));
+}
+
+} /* namespace librevault */
@@ -0,0 +1,75 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace librevault {
+
+/* TokenBucket limits rate of a byte stream. Bytes, reserved in a bucket, are reserved in its parent too,
+ * so buckets form a hierarchy (e.g. global -> folder -> peer). Rate 0 means "unlimited". Thread-safe. */
+class TokenBucket {
+public:
+	struct Stats {
+		uint64_t rate;
+		uint64_t payload_bytes;     // Block contents
+		uint64_t overhead_bytes;    // Everything else
+	};
+
+	TokenBucket(std::shared_ptr<TokenBucket> parent = nullptr, uint64_t rate = 0);
+
+	void set_rate(uint64_t rate);   // Bytes per second
+
+	// Takes tokens, possibly going into debt. Returns time to wait before sending these bytes, so the rate is kept.
+	std::chrono::steady_clock::duration reserve(uint64_t bytes, bool payload = true);
+	// Takes tokens without waiting. Used for control messages and for received data.
+	void charge(uint64_t bytes, bool payload = false) {reserve(bytes, payload);}
+	// Time until the debt is paid, including parents.
+	std::chrono::steady_clock::duration delay() const;
+
+	Stats stats() const;
+
+private:
+	const std::shared_ptr<TokenBucket> parent_;
+
+	mutable std::mutex mtx_;
+	uint64_t rate_;
+	mutable double tokens_ = 0;
+	mutable std::chrono::steady_clock::time_point last_refill_ = std::chrono::steady_clock::now();
+
+	uint64_t payload_bytes_ = 0;
+	uint64_t overhead_bytes_ = 0;
+
+	void refill() const;
+	std::chrono::steady_clock::duration debt_delay() const;
+};
+
+} /* namespace librevault */
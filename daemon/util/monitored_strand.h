@@ -0,0 +1,87 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/strand.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+namespace librevault {
+
+/* Strand, that measures its scheduling latency: the time, that handlers spend waiting for their turn */
+class monitored_strand {
+public:
+	monitored_strand(boost::asio::io_service& io_service) : io_service_(io_service), strand_(io_service), counters_(std::make_shared<Counters>()) {}
+
+	template<class Handler> void post(Handler handler) {strand_.post(measured(std::move(handler)));}
+	template<class Handler> void dispatch(Handler handler) {strand_.dispatch(measured(std::move(handler)));}
+
+	boost::asio::io_service& get_io_service() {return io_service_;}
+	boost::asio::io_service::strand& strand() {return strand_;}
+
+	struct Stats {
+		uint64_t handlers = 0;
+		std::chrono::microseconds average_latency = std::chrono::microseconds(0);
+		std::chrono::microseconds max_latency = std::chrono::microseconds(0);
+	};
+	Stats heartbeat() { // Since previous heartbeat. Thread-safe
+		Stats stats;
+		stats.handlers = counters_->handlers.exchange(0);
+		uint64_t latency_us = counters_->latency_us.exchange(0);
+		stats.average_latency = std::chrono::microseconds(stats.handlers ? latency_us / stats.handlers : 0);
+		stats.max_latency = std::chrono::microseconds(counters_->max_latency_us.exchange(0));
+		return stats;
+	}
+
+private:
+	boost::asio::io_service& io_service_;
+	boost::asio::io_service::strand strand_;
+
+	struct Counters {
+		std::atomic<uint64_t> handlers = {0};
+		std::atomic<uint64_t> latency_us = {0};
+		std::atomic<uint64_t> max_latency_us = {0};
+	};
+	std::shared_ptr<Counters> counters_;    // Handlers can outlive the strand
+
+	template<class Handler> auto measured(Handler handler) {
+		return [counters = counters_, posted = std::chrono::steady_clock::now(), handler = std::move(handler)]() mutable {
+			uint64_t latency_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - posted).count();
+			counters->handlers++;
+			counters->latency_us += latency_us;
+			uint64_t max_latency_us = counters->max_latency_us;
+			while(latency_us > max_latency_us && !counters->max_latency_us.compare_exchange_weak(max_latency_us, latency_us));
+
+			handler();
+		};
+	}
+};
+
+} /* namespace librevault */
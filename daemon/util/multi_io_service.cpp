@@ -28,6 +28,7 @@
  */
 #include "multi_io_service.h"
 #include "log.h"
+#include <algorithm>
 
 namespace librevault {
 
@@ -42,6 +43,13 @@ void multi_io_service::start(unsigned thread_count) {
 
 	LOGI("Threads: " << thread_count);
 
+	{
+		std::lock_guard<std::mutex> lk(heartbeat_mtx_);
+		for(unsigned i = 1; i <= thread_count; i++)
+			thread_counters_.push_back(std::make_unique<ThreadCounters>());
+		last_heartbeat_ = std::chrono::steady_clock::now();
+	}
+
 	for(unsigned i = 1; i <= thread_count; i++){
 		worker_threads_.emplace_back([this, i]{run_thread(i);});	// Running io_service in threads
 	}
@@ -56,10 +64,41 @@ void multi_io_service::stop() {
 	}
 }
 
+std::vector<multi_io_service::ThreadStats> multi_io_service::heartbeat() {
+	std::lock_guard<std::mutex> lk(heartbeat_mtx_);
+
+	auto now = std::chrono::steady_clock::now();
+	uint64_t interval_ns = std::max<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_heartbeat_).count(), 1);
+	last_heartbeat_ = now;
+
+	std::vector<ThreadStats> stats;
+	for(auto& counters : thread_counters_) {
+		uint64_t handlers = counters->handlers, busy_ns = counters->busy_ns;
+
+		ThreadStats thread_stats;
+		thread_stats.handlers = handlers - counters->last_handlers;
+		thread_stats.load = std::min(float(busy_ns - counters->last_busy_ns) / interval_ns, 1.0f);
+		stats.push_back(thread_stats);
+
+		counters->last_handlers = handlers;
+		counters->last_busy_ns = busy_ns;
+	}
+	return stats;
+}
+
 void multi_io_service::run_thread(unsigned worker_number) {
 	LOGD("Thread #" << worker_number << " started");
+	auto& counters = *thread_counters_[worker_number-1];
 	try {
-		ios_.run();
+		// Ready handlers are timed. The one, that wakes up an idle thread, is accounted as idle time, as waiting can't be told apart from running there
+		for(;;) {
+			auto started = std::chrono::steady_clock::now();
+			if(ios_.poll_one()) {
+				counters.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+			}else if(!ios_.run_one())
+				break;  // Stopped
+			counters.handlers++;
+		}
 	}catch(std::exception& e) {
 		LOGEM("Unhandled exception: " << e.what());
 		LOGGER->flush();
@@ -28,7 +28,11 @@
  */
 #pragma once
 #include <boost/asio/io_service.hpp>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 namespace librevault {
 
@@ -42,6 +46,12 @@ public:
 
 	boost::asio::io_service& ios() {return ios_;}
 
+	struct ThreadStats {
+		uint64_t handlers = 0;  // Handlers, executed since previous heartbeat
+		float load = 0;         // Part of time since previous heartbeat, spent on executing handlers
+	};
+	std::vector<ThreadStats> heartbeat();   // Thread-safe
+
 protected:
 	std::string name_;
 	boost::asio::io_service ios_;
@@ -49,6 +59,17 @@ protected:
 
 	std::vector<std::thread> worker_threads_;
 
+	/* Load metrics */
+	struct ThreadCounters {
+		std::atomic<uint64_t> handlers = {0};
+		std::atomic<uint64_t> busy_ns = {0};
+		uint64_t last_handlers = 0;
+		uint64_t last_busy_ns = 0;
+	};
+	std::vector<std::unique_ptr<ThreadCounters>> thread_counters_;
+	std::chrono::steady_clock::time_point last_heartbeat_;
+	std::mutex heartbeat_mtx_;
+
 	void run_thread(unsigned worker_number);
 
 	std::string log_tag() const {return std::string("[pool:") + name_ + "] ";}
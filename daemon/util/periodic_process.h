@@ -28,6 +28,7 @@
  */
 #pragma once
 #include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
 #include <atomic>
 #include <chrono>
 #include <thread>
@@ -37,6 +38,10 @@ public:
 	PeriodicProcess(boost::asio::io_service& io_service, std::function<void(PeriodicProcess&)> function) : io_service_(io_service), timer_(io_service_), function_(function) {
 		started_handlers_ = 0;
 	}
+	// Function is run on the strand, serialized with the other handlers of the strand
+	PeriodicProcess(boost::asio::io_service& io_service, boost::asio::io_service::strand& strand, std::function<void(PeriodicProcess&)> function) : PeriodicProcess(io_service, function) {
+		strand_ = &strand;
+	}
 	~PeriodicProcess() {
 		wait();
 	}
@@ -51,11 +56,15 @@ public:
 
 		++started_handlers_;
 		timer_.expires_from_now(duration);
-		timer_.async_wait([this](const boost::system::error_code& ec){
+		std::function<void(const boost::system::error_code&)> handler = [this](const boost::system::error_code& ec){
 			if(ec != boost::asio::error::operation_aborted)
 				try_concurrent_run();
 			--started_handlers_;
-		});
+		};
+		if(strand_)
+			timer_.async_wait(strand_->wrap(handler));
+		else
+			timer_.async_wait(handler);
 	}
 
 	void invoke() {
@@ -66,10 +75,14 @@ public:
 
 	void invoke_post() {
 		++started_handlers_;
-		io_service_.post([this]{
+		std::function<void()> handler = [this]{
 			try_concurrent_run();
 			--started_handlers_;
-		});
+		};
+		if(strand_)
+			strand_->post(handler);
+		else
+			io_service_.post(handler);
 	}
 
 	void wait() {
@@ -86,6 +99,7 @@ public:
 
 protected:
 	boost::asio::io_service& io_service_;
+	boost::asio::io_service::strand* strand_ = nullptr;
 	boost::asio::steady_timer timer_;
 	std::atomic<unsigned> started_handlers_;
 	std::atomic_flag running_;
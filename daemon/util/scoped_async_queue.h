@@ -34,16 +34,20 @@
 
 class ScopedAsyncQueue {
 public:
-	ScopedAsyncQueue(boost::asio::io_service& io_service) : io_service_(io_service), io_service_strand_(io_service) {
+	ScopedAsyncQueue(boost::asio::io_service& io_service) : io_service_(io_service), io_service_strand_(io_service), strand_(&io_service_strand_) {
 		started_handlers_ = 0;
 	}
+	// Functions are run on the strand, serialized with the other handlers of the strand
+	ScopedAsyncQueue(boost::asio::io_service& io_service, boost::asio::io_service::strand& strand) : ScopedAsyncQueue(io_service) {
+		strand_ = &strand;
+	}
 	~ScopedAsyncQueue() {
 		wait();
 	}
 
 	void invoke_post(std::function<void()> function) {
 		++started_handlers_;
-		io_service_strand_.post([this, function]{
+		strand_->post([this, function]{
 			function();
 			--started_handlers_;
 		});
@@ -63,5 +67,6 @@ public:
 protected:
 	boost::asio::io_service& io_service_;
 	boost::asio::io_service::strand io_service_strand_;
+	boost::asio::io_service::strand* strand_;
 	std::atomic<unsigned> started_handlers_;
 };
\ No newline at end of file
@@ -0,0 +1,70 @@
+/* Copyright (C) 2016 Alexander Shishenko <alex@shishenko.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#pragma once
+#include "blob.h"
+#include <cassert>
+#include <memory>
+
+namespace librevault {
+
+/* Read-only view into a reference-counted buffer. Copying and slicing it doesn't copy the data, the buffer lives,
+ * while any view into it exists. Used to pass blocks between the transport and the storage without copying */
+class shared_buffer {
+public:
+	shared_buffer() = default;
+	shared_buffer(std::shared_ptr<const void> owner, const uint8_t* data, size_t size) : owner_(std::move(owner)), data_(data), size_(size) {}
+	explicit shared_buffer(blob data) {
+		auto owner = std::make_shared<const blob>(std::move(data));
+		data_ = owner->data();
+		size_ = owner->size();
+		owner_ = std::move(owner);
+	}
+
+	const uint8_t* data() const {return data_;}
+	size_t size() const {return size_;}
+	bool empty() const {return size_ == 0;}
+
+	const uint8_t* begin() const {return data_;}
+	const uint8_t* end() const {return data_ + size_;}
+	uint8_t operator[](size_t pos) const {return data_[pos];}
+
+	shared_buffer slice(size_t offset, size_t size) const {
+		assert(offset <= size_ && size <= size_ - offset);
+		return shared_buffer(owner_, data_ + offset, size);
+	}
+
+	blob to_blob() const {return blob(begin(), end());}   // Copies
+
+private:
+	std::shared_ptr<const void> owner_;
+	const uint8_t* data_ = nullptr;
+	size_t size_ = 0;
+};
+
+} /* namespace librevault */